@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "src/qagen-dcm2mhd.h"
+#include "src/qagen-error.h"
+#include "src/qagen-log.h"
+#include "src/qagen-memory.h"
+
+#define PROGNAME L"dcm2mhd"
+
+
+static void print_usage(void)
+{
+    fputws(L"Usage: " PROGNAME " [-j THREADS] [-w WORKERS] [-o DIR] DCM...\n"
+           L"Convert DICOM RTDose files DCM to float MetaImage files of the same name, with\n"
+           L"their voxels in .raw files next to them\n"
+           L"\n"
+           L"  -j THREADS  Use THREADS threads in total (default: one per logical\n"
+           L"              processor)\n"
+           L"  -o DIR      Write the MetaImages to DIR instead of next to each DCM\n"
+           L"  -w WORKERS  Convert up to WORKERS files at once (default: 4)\n", stdout);
+}
+
+
+static int log_cb(const wchar_t *msg, void *data, qagen_loglvl_t lvl)
+{
+    const wchar_t *prefix = L"Info";
+    FILE *fp = stdout;
+
+    (void)data;
+    switch (lvl) {
+    case QAGEN_LOG_DEBUG:
+        prefix = L"Debug";
+        break;
+    case QAGEN_LOG_INFO:
+        break;
+    case QAGEN_LOG_WARN:
+        prefix = L"Warning";
+        fp = stderr;
+        break;
+    case QAGEN_LOG_ERROR:
+        prefix = L"Error";
+        fp = stderr;
+        break;
+    }
+    return fwprintf(fp, PROGNAME L": %s: %s\n", prefix, msg);
+}
+
+
+static void print_error(const wchar_t *dcm)
+{
+    const wchar_t *erctx, *ermsg;
+
+    qagen_error_string(&erctx, &ermsg);
+    if (ermsg[0]) {
+        fwprintf(stderr, PROGNAME L": Error: %s: %s: %s\n", dcm, erctx, ermsg);
+    } else {
+        fwprintf(stderr, PROGNAME L": Error: %s: %s\n", dcm, erctx);
+    }
+}
+
+
+/** @brief Parses the leading options out of @p argv
+ *  @param argc
+ *      Argument count
+ *  @param argv
+ *      Argument vector
+ *  @param[out] opts
+ *      Conversion options
+ *  @param[out] outdir
+ *      Output directory, if one was given
+ *  @returns The index of the first operand, or zero on error
+ */
+static int parse_opts(int argc, wchar_t *argv[], struct qagen_dcm2mhd_opts *opts,
+                      const wchar_t **outdir)
+{
+    const wchar_t *val;
+    wchar_t *end;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == L'-'; i++) {
+        switch (argv[i][1]) {
+        case L'j':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -j requires a thread count");
+                return 0;
+            }
+            opts->nthreads = (unsigned)wcstoul(val, &end, 10);
+            if (*end) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid thread count %s", val);
+                return 0;
+            }
+            break;
+        case L'w':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -w requires a worker count");
+                return 0;
+            }
+            opts->nworkers = (unsigned)wcstoul(val, &end, 10);
+            if (*end) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid worker count %s", val);
+                return 0;
+            }
+            break;
+        case L'o':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -o requires a directory");
+                return 0;
+            }
+            *outdir = val;
+            break;
+        default:
+            qagen_log_printf(QAGEN_LOG_ERROR, L"Unknown option %s", argv[i]);
+            return 0;
+        }
+    }
+    return i;
+}
+
+
+int wmain(int argc, wchar_t *argv[])
+{
+    struct qagen_log lf = {
+        .callback  = log_cb,
+        .cbdata    = NULL,
+        .threshold = QAGEN_LOG_INFO
+    };
+    struct qagen_dcm2mhd_opts opts = { 0 };
+    struct qagen_dcm2mhd_status *status;
+    const wchar_t *outdir = NULL;
+    int res = 0, i, j;
+
+    if (qagen_log_add(&lf)) {
+        fputws(PROGNAME L": Error: Failed to add log file\n", stderr);
+    }
+    i = parse_opts(argc, argv, &opts, &outdir);
+    if (!i) {
+        print_usage();
+        return 1;
+    }
+    if (i >= argc) {
+        qagen_log_puts(QAGEN_LOG_ERROR, L"Missing required operand");
+        print_usage();
+        return 1;
+    }
+
+    status = qagen_malloc(sizeof *status * (argc - i));
+    if (!status) {
+        print_error(argv[i]);
+        return 2;
+    }
+    if (qagen_dcm2mhd_convert_batch((const wchar_t *const *)&argv[i], argc - i, outdir, &opts, status)) {
+        res = 4;
+        for (j = 0; j < argc - i; j++) {
+            if (status[j].result) {
+                qagen_error_restore(&status[j].error);
+                print_error(argv[i + j]);
+            }
+        }
+    }
+    qagen_free(status);
+
+    qagen_log_cleanup();
+    return res;
+}
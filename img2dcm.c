@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "src/qagen-path.h"
 #include "src/qagen-img2dcm.h"
 #include "src/qagen-error.h"
@@ -9,20 +10,25 @@
 
 static void print_usage(void)
 {
-    fputws(L"Usage: " PROGNAME " IMG TEMPLATE\n"
+    fputws(L"Usage: " PROGNAME " [-m MIB] IMG TEMPLATE\n"
            L"Convert ITK-readable image file IMG to a DICOM RTDose file, using the tags in\n"
-           L"DICOM file TEMPLATE as a basis\n", stdout);
+           L"DICOM file TEMPLATE as a basis\n"
+           L"\n"
+           L"  -m MIB  Read at most MIB mebibytes of IMG at a time, if its format can be\n"
+           L"          streamed (default: read it all at once). The output pixels go to a\n"
+           L"          temp file as they are made, unless IMG's frames have to be\n"
+           L"          resliced, which holds all of them\n", stdout);
 }
 
 
-static int main_run(const wchar_t *src, PATH *dst, const wchar_t *tmplt)
+static int main_run(const wchar_t *src, PATH *dst, const wchar_t *tmplt, size_t budget)
 {
     int res = 0;
 
     if (dst) {
         qagen_path_remove_extension(&dst);
         if (!qagen_path_rename_extension(&dst, L"dcm")) {
-            if (qagen_img2dcm_convert(src, dst->buf, tmplt)) {
+            if (qagen_img2dcm_convert(src, dst->buf, tmplt, budget)) {
                 res = 4;
             }
         } else {
@@ -69,17 +75,28 @@ int wmain(int argc, wchar_t *argv[])
         .cbdata    = NULL,
         .threshold = QAGEN_LOG_INFO
     };
-    int res = 0;
+    size_t budget = 0;
+    wchar_t *end;
+    int res = 0, i = 1;
 
     if (qagen_log_add(&lf)) {
         fputws(PROGNAME L": Error: Failed to add log file\n", stderr);
     }
-    if (argc < 3) {
+    if (argc > 2 && !wcscmp(argv[1], L"-m")) {
+        budget = (size_t)wcstoull(argv[2], &end, 10) << 20;
+        if (*end || !budget) {
+            qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid slab budget %s", argv[2]);
+            print_usage();
+            return 1;
+        }
+        i = 3;
+    }
+    if (argc - i < 2) {
         qagen_log_puts(QAGEN_LOG_ERROR, L"Missing required operand");
         print_usage();
         return 1;
     }
-    if ((res = main_run(argv[1], qagen_path_create(argv[1]), argv[2]))) {
+    if ((res = main_run(argv[i], qagen_path_create(argv[i]), argv[i + 1], budget))) {
         qagen_error_string(&erctx, &ermsg);
         if (ermsg[0]) {
             fwprintf(stderr, PROGNAME L": Error: %s: %s", erctx, ermsg);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "src/qagen-path.h"
 #include "src/qagen-metaio.h"
 #include "src/qagen-error.h"
@@ -7,19 +8,42 @@
 
 static void print_usage(void)
 {
-    fputws(L"Usage: mhd2dcm MHD TEMPLATE\n"
+    fputws(L"Usage: mhd2dcm [-d] [-s] [-b BITS] [-c THRESH] [-j THREADS] [-l] [-z LEVEL]\n"
+           L"               [-t TOL] [-r REL] [-C DIR] MHD... TEMPLATE\n"
            L"Convert MetaImage header file MHD to a DICOM RTDose file, using the tags in\n"
-           L"DICOM file TEMPLATE as a basis\n", stdout);
+           L"DICOM file TEMPLATE as a basis. MHD may also be a .nii or .nii.gz file\n"
+           L"\n"
+           L"  -b BITS     Write BITS-bit pixels, 16 (default) or 32\n"
+           L"  -c THRESH   Crop the output to the bounding box of voxels above THRESH,\n"
+           L"              in the units stored in MHD\n"
+           L"  -C DIR      Reuse earlier conversions cached in DIR, when the MHD, its\n"
+           L"              data, TEMPLATE and these options are unchanged\n"
+           L"  -d          Write the file directly, encoding the template only once\n"
+           L"  -j THREADS  Split each volume across THREADS threads (default: one per\n"
+           L"              logical processor)\n"
+           L"  -l          Save as JPEG-LS lossless, encoding the frames in parallel.\n"
+           L"              16-bit only, and not with -d, -s or -z\n"
+           L"  -r REL      Fail if any voxel above 1% of the maximum quantizes with an\n"
+           L"              error of more than REL of its dose\n"
+           L"  -s          Spool the pixels through a temp file a few slices at a time, to\n"
+           L"              bound memory\n"
+           L"  -t TOL      Keep every voxel within TOL Gy of its source dose, writing\n"
+           L"              32-bit pixels if 16-bit steps are too coarse, and failing if\n"
+           L"              any voxel is measured past it\n"
+           L"  -z LEVEL    Save as Deflated Explicit VR Little Endian, at zlib LEVEL 1\n"
+           L"              (fastest) to 9 (smallest). Implies -d\n", stdout);
 }
 
 
-static int main_run(const wchar_t *src, PATH *dst, const wchar_t *tmplt)
+static int main_run(const wchar_t *src, PATH *dst,
+                    const struct qagen_metaio_template *tmplt,
+                    const struct qagen_metaio_opts *opts)
 {
     int res = 0;
 
     if (dst) {
         if (!qagen_path_rename_extension(&dst, L"dcm")) {
-            if (qagen_metaio_convert(src, dst->buf, tmplt)) {
+            if (qagen_metaio_convert_cached(src, dst->buf, tmplt, opts)) {
                 res = 4;
             }
         } else {
@@ -59,36 +83,172 @@ static int log_cb(const wchar_t *msg, void *data, qagen_loglvl_t lvl)
 }
 
 
-int wmain(int argc, wchar_t *argv[])
+static void print_error(void)
 {
     const wchar_t *erctx, *ermsg;
+
+    qagen_error_string(&erctx, &ermsg);
+    if (ermsg[0]) {
+        fwprintf(stderr, L"mhd2dcm: Error: %s: %s", erctx, ermsg);
+    } else {
+        fwprintf(stderr, L"mhd2dcm: Error: %s", erctx);
+    }
+}
+
+
+/** @brief Parses the leading options out of @p argv
+ *  @param argc
+ *      Argument count
+ *  @param argv
+ *      Argument vector
+ *  @param[out] opts
+ *      Conversion options
+ *  @returns The index of the first operand, or zero on error
+ */
+static int parse_opts(int argc, wchar_t *argv[], struct qagen_metaio_opts *opts)
+{
+    const wchar_t *val;
+    wchar_t *end;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == L'-'; i++) {
+        switch (argv[i][1]) {
+        case L'b':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -b requires a bit depth");
+                return 0;
+            }
+            opts->bits = (unsigned)wcstoul(val, &end, 10);
+            if (*end || (opts->bits != 16 && opts->bits != 32)) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid bit depth %s", val);
+                return 0;
+            }
+            break;
+        case L'c':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -c requires a threshold");
+                return 0;
+            }
+            opts->crop = true;
+            opts->crop_threshold = wcstod(val, &end);
+            if (*end || opts->crop_threshold < 0.0) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid crop threshold %s", val);
+                return 0;
+            }
+            break;
+        case L'C':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -C requires a directory");
+                return 0;
+            }
+            opts->cache = val;
+            break;
+        case L'j':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -j requires a thread count");
+                return 0;
+            }
+            opts->nthreads = (unsigned)wcstoul(val, &end, 10);
+            if (*end) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid thread count %s", val);
+                return 0;
+            }
+            break;
+        case L'r':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -r requires a relative tolerance");
+                return 0;
+            }
+            opts->rel_tolerance = wcstod(val, &end);
+            if (*end || !(opts->rel_tolerance > 0.0)) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid relative tolerance %s", val);
+                return 0;
+            }
+            break;
+        case L't':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -t requires a tolerance");
+                return 0;
+            }
+            opts->tolerance = wcstod(val, &end);
+            if (*end || !(opts->tolerance > 0.0)) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid tolerance %s", val);
+                return 0;
+            }
+            break;
+        case L'z':
+            val = (argv[i][2]) ? &argv[i][2] : argv[++i];
+            if (!val) {
+                qagen_log_puts(QAGEN_LOG_ERROR, L"Option -z requires a compression level");
+                return 0;
+            }
+            opts->deflate = (int)wcstol(val, &end, 10);
+            if (*end || opts->deflate < 1 || opts->deflate > 9) {
+                qagen_log_printf(QAGEN_LOG_ERROR, L"Invalid compression level %s", val);
+                return 0;
+            }
+            break;
+        case L'd':
+            opts->direct = true;
+            break;
+        case L'l':
+            opts->jpegls = true;
+            break;
+        case L's':
+            opts->stream = true;
+            break;
+        default:
+            qagen_log_printf(QAGEN_LOG_ERROR, L"Unknown option %s", argv[i]);
+            return 0;
+        }
+    }
+    return i;
+}
+
+
+int wmain(int argc, wchar_t *argv[])
+{
     struct qagen_log lf = {
         .callback  = log_cb,
         .cbdata    = NULL,
         .threshold = QAGEN_LOG_INFO
     };
+    struct qagen_metaio_opts opts = { 0 };
+    struct qagen_metaio_template *tmplt;
     int res = 0, i;
 
     if (qagen_log_add(&lf)) {
         fputws(L"mhd2dcm: Error: Failed to add log file\n", stderr);
     }
-    if (argc < 3) {
+    i = parse_opts(argc, argv, &opts);
+    if (!i) {
+        print_usage();
+        return 1;
+    }
+    if (argc - i < 2) {
         qagen_log_puts(QAGEN_LOG_ERROR, L"Missing required operand");
         print_usage();
         return 1;
     }
 
     argc--;
-    for (i = 1; i < argc; i++) {
-        if ((res = main_run(argv[i], qagen_path_create(argv[i]), argv[argc]))) {
-            qagen_error_string(&erctx, &ermsg);
-            if (ermsg[0]) {
-                fwprintf(stderr, L"mhd2dcm: Error: %s: %s", erctx, ermsg);
-            } else {
-                fwprintf(stderr, L"mhd2dcm: Error: %s", erctx);
-            }
+    tmplt = qagen_metaio_template_load(argv[argc]);
+    if (!tmplt) {
+        res = 5;
+        print_error();
+    }
+    for (; tmplt && i < argc; i++) {
+        if ((res = main_run(argv[i], qagen_path_create(argv[i]), tmplt, &opts))) {
+            print_error();
         }
     }
+    qagen_metaio_template_free(tmplt);
 
     qagen_log_cleanup();
     return res;
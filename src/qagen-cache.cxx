@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "qagen-cache.h"
+#include "qagen-log.h"
+
+
+/** Bump this whenever the converter's output changes, which orphans every
+ *  existing entry */
+#define QAGEN_CACHE_VERSION "qagen-metaio 2"
+
+/** Bytes of the MHD hashed. Headers are a few hundred bytes, so this covers
+ *  them whole, and stops early on a file with LOCAL data */
+#define QAGEN_CACHE_HEAD (64 * 1024)
+
+/** First word of a .stats file */
+#define QAGEN_CACHE_MAGIC 0x53474151u   /* "QAGS" */
+
+/** Age past which leftover temp files and orphaned entries are removed */
+#define QAGEN_CACHE_STALE (24ULL * 3600 * 10000000)
+
+
+/** @class 64-bit FNV-1a */
+class CacheHash {
+    std::uint64_t m_hash = 0xcbf29ce484222325ULL;
+
+public:
+    void add(const void *buf, std::size_t len) noexcept
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(buf);
+
+        for (std::size_t i = 0; i < len; i++) {
+            m_hash = (m_hash ^ p[i]) * 0x100000001b3ULL;
+        }
+    }
+
+    template <class T>
+    void add(const T &val) noexcept
+    {
+        static_assert(std::is_arithmetic_v<T>);
+        add(&val, sizeof val);
+    }
+
+    void add(const std::wstring &str) noexcept
+    {
+        add(str.size());
+        add(str.data(), str.size() * sizeof (wchar_t));
+    }
+
+    std::uint64_t value() const noexcept { return m_hash; }
+};
+
+
+static std::uint64_t filetime64(const FILETIME &ft)
+{
+    return ((std::uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+
+bool qagen_cache_stamp(const wchar_t *path, CacheStamp &stamp) noexcept
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &fad)) {
+        return false;
+    }
+    stamp.size = ((std::uint64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+    stamp.mtime = filetime64(fad.ftLastWriteTime);
+    return true;
+}
+
+
+/** @brief Finds the ElementDataFile named in an MHD header
+ *  @param mhd
+ *      Path to the header
+ *  @param head
+ *      The start of the header
+ *  @param[out] path
+ *      The data file, resolved against the header's directory
+ *  @returns 1 if the voxels are in a separate file, 0 if they are in @p mhd
+ *      itself (LOCAL, or not an MHD at all), and -1 if they are in several
+ *      files, which are not worth chasing
+ */
+static int mhd_data_file(const wchar_t *mhd, const std::vector<char> &head, std::wstring &path)
+{
+    static const char key[] = "ElementDataFile";
+    const char *p = head.data(), *end = p + head.size(), *eol, *val;
+    std::wstring dir;
+    std::size_t sep;
+    std::string name;
+
+    for (; p < end; p = eol + 1) {
+        eol = std::find(p, end, '\n');
+        if ((std::size_t)(eol - p) < sizeof key - 1 || std::memcmp(p, key, sizeof key - 1)) {
+            continue;
+        }
+        val = std::find(p, eol, '=');
+        if (val == eol) {
+            continue;
+        }
+        for (val++; val < eol && (*val == ' ' || *val == '\t'); val++);
+        name.assign(val, eol);
+        while (!name.empty() && std::isspace((unsigned char)name.back())) {
+            name.pop_back();
+        }
+        if (name == "LOCAL") {
+            return 0;
+        } else if (name == "LIST" || name.find('%') != std::string::npos || name.find(' ') != std::string::npos) {
+            return -1;
+        }
+        path.assign(name.begin(), name.end());
+        /* Relative names are relative to the header */
+        if (!(path[0] == L'\\' || path[0] == L'/' || (path.size() > 1 && path[1] == L':'))) {
+            dir = mhd;
+            sep = dir.find_last_of(L"\\/");
+            dir.resize((sep == std::wstring::npos) ? 0 : sep + 1);
+            path.insert(0, dir);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+bool qagen_cache_key(const wchar_t *mhd, const std::wstring &tmplt, const CacheStamp &tstamp,
+                     const struct qagen_metaio_opts &opts, std::wstring &key)
+{
+    std::vector<char> head(QAGEN_CACHE_HEAD);
+    CacheStamp stamp, data;
+    std::wstring datafile;
+    CacheHash hash;
+    wchar_t buf[17];
+    std::FILE *fp;
+
+    if (!qagen_cache_stamp(mhd, stamp) || !(fp = _wfopen(mhd, L"rb"))) {
+        return false;
+    }
+    head.resize(std::fread(head.data(), 1, head.size(), fp));
+    std::fclose(fp);
+
+    hash.add(QAGEN_CACHE_VERSION, sizeof QAGEN_CACHE_VERSION);
+    hash.add(head.data(), head.size());
+    switch (mhd_data_file(mhd, head, datafile)) {
+    case 1:
+        if (!qagen_cache_stamp(datafile.c_str(), data)) {
+            return false;
+        }
+        hash.add(data.size);
+        hash.add(data.mtime);
+        break;
+    case 0:
+        hash.add(stamp.size);
+        hash.add(stamp.mtime);
+        break;
+    default:
+        return false;
+    }
+    hash.add(tmplt);
+    hash.add(tstamp.size);
+    hash.add(tstamp.mtime);
+    /* Only the options that change the file. Threads and streaming don't */
+    hash.add((opts.bits) ? opts.bits : 16u);
+    hash.add(opts.direct);
+    hash.add(opts.crop);
+    hash.add((opts.crop) ? opts.crop_threshold : 0.0);
+    hash.add(opts.deflate);
+    hash.add(opts.jpegls);
+    hash.add(opts.tolerance);
+    hash.add(opts.rel_tolerance);
+
+    swprintf(buf, BUFLEN(buf), L"%016llx", (unsigned long long)hash.value());
+    key = buf;
+    return true;
+}
+
+
+/** @brief The path of entry @p key, without an extension */
+static std::wstring entry_path(const wchar_t *dir, const std::wstring &key)
+{
+    std::wstring res = dir;
+
+    if (!res.empty() && res.back() != L'\\' && res.back() != L'/') {
+        res += L'\\';
+    }
+    return res + key;
+}
+
+
+/** @brief Reads a .stats file
+ *  @returns false if it is missing or malformed
+ */
+static bool read_stats(const std::wstring &path, struct qagen_dose_stats &stats)
+{
+    std::uint32_t hdr[2];
+    std::FILE *fp;
+    bool res;
+
+    fp = _wfopen(path.c_str(), L"rb");
+    if (!fp) {
+        return false;
+    }
+    res = std::fread(hdr, sizeof hdr, 1, fp) == 1
+       && hdr[0] == QAGEN_CACHE_MAGIC && hdr[1] == sizeof stats
+       && std::fread(&stats, sizeof stats, 1, fp) == 1;
+    std::fclose(fp);
+    return res;
+}
+
+
+static bool write_stats(const std::wstring &path, const struct qagen_dose_stats &stats)
+{
+    const std::uint32_t hdr[2] = { QAGEN_CACHE_MAGIC, sizeof stats };
+    std::FILE *fp;
+    bool res;
+
+    fp = _wfopen(path.c_str(), L"wb");
+    if (!fp) {
+        return false;
+    }
+    res = std::fwrite(hdr, sizeof hdr, 1, fp) == 1
+       && std::fwrite(&stats, sizeof stats, 1, fp) == 1;
+    return !std::fclose(fp) && res;
+}
+
+
+/** @brief Marks an entry as just used */
+static void touch(const std::wstring &path)
+{
+    FILETIME now;
+    HANDLE hfile;
+
+    hfile = CreateFileW(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile != INVALID_HANDLE_VALUE) {
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(hfile, NULL, NULL, &now);
+        CloseHandle(hfile);
+    }
+}
+
+
+/** @brief Puts @p src at @p dst, as a hard link if they share a volume */
+static bool link_or_copy(const wchar_t *src, const wchar_t *dst)
+{
+    return CreateHardLinkW(dst, src, NULL) || CopyFileW(src, dst, FALSE);
+}
+
+
+bool qagen_cache_fetch(const wchar_t *dir, const std::wstring &key, const wchar_t *dst,
+                       struct qagen_dose_stats &stats)
+{
+    const std::wstring base = entry_path(dir, key);
+
+    if (!read_stats(base + L".stats", stats)) {
+        return false;
+    }
+    /* A hard link cannot replace an existing file */
+    DeleteFileW(dst);
+    if (!link_or_copy((base + L".dcm").c_str(), dst)) {
+        /* Most likely evicted since the .stats was read */
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Cache entry %s vanished, converting", key.c_str());
+        return false;
+    }
+    touch(base + L".stats");
+    return true;
+}
+
+
+/** @brief Creates @p dir and any missing parents */
+static bool make_dirs(const wchar_t *dir)
+{
+    std::wstring path = dir;
+    std::size_t pos = 0;
+    DWORD attr;
+
+    /* Skip the root: "C:\", or "\\server\share\" */
+    if (path.compare(0, 2, L"\\\\") == 0) {
+        pos = path.find_first_of(L"\\/", path.find_first_of(L"\\/", 2) + 1);
+    } else if (path.size() > 2 && path[1] == L':') {
+        pos = 2;
+    }
+    while (pos != std::wstring::npos && (pos = path.find_first_of(L"\\/", pos + 1)) != std::wstring::npos) {
+        CreateDirectoryW(path.substr(0, pos).c_str(), NULL);
+    }
+    CreateDirectoryW(path.c_str(), NULL);
+    attr = GetFileAttributesW(path.c_str());
+    return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+
+/** @brief Whether a file last written at @p mtime was abandoned long ago. A
+ *      shared directory may have its clock ahead of ours, and a file from the
+ *      future is someone's work in progress, not stale
+ */
+static bool is_stale(std::uint64_t mtime, std::uint64_t now)
+{
+    return mtime < now && now - mtime > QAGEN_CACHE_STALE;
+}
+
+
+/** @brief Deletes the least recently used entries until the cache fits in
+ *      @p cap bytes. Only one process does this at a time, the others skip it
+ */
+static void evict(const wchar_t *dir, std::uint64_t cap)
+{
+    struct Entry {
+        std::uint64_t used;     /* .stats mtime, zero if there is none */
+        std::uint64_t size;
+        std::uint64_t mtime;    /* Of the .dcm */
+    };
+    const std::wstring base = entry_path(dir, L"");
+    std::map<std::wstring, Entry> entries;
+    std::vector<std::pair<std::uint64_t, std::wstring>> order;
+    std::uint64_t total = 0, now, mtime, size;
+    std::wstring name, stem;
+    WIN32_FIND_DATAW fd;
+    FILETIME ft;
+    HANDLE lock, find;
+    std::size_t dot;
+
+    lock = CreateFileW((base + L"lock").c_str(), GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (lock == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    GetSystemTimeAsFileTime(&ft);
+    now = filetime64(ft);
+    find = FindFirstFileExW((base + L"*").c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, 0);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                continue;
+            }
+            name = fd.cFileName;
+            mtime = filetime64(fd.ftLastWriteTime);
+            size = ((std::uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+            dot = name.find(L'.');
+            stem = name.substr(0, dot);
+            if (dot == std::wstring::npos) {
+                continue;
+            } else if (name.compare(dot, std::wstring::npos, L".stats") == 0) {
+                entries[stem].used = mtime;
+            } else if (name.compare(dot, std::wstring::npos, L".dcm") == 0) {
+                entries[stem].mtime = mtime;
+            } else if (name.size() > 4 && name.compare(name.size() - 4, 4, L".tmp") == 0) {
+                /* Left behind by a process that died mid-store */
+                if (is_stale(mtime, now)) {
+                    DeleteFileW((base + name).c_str());
+                }
+                continue;
+            } else {
+                continue;
+            }
+            entries[stem].size += size;
+            total += size;
+        } while (FindNextFileW(find, &fd));
+        FindClose(find);
+    }
+    for (const auto &ent : entries) {
+        /* A .dcm without a .stats is either mid-store or orphaned */
+        if (!ent.second.used && !is_stale(ent.second.mtime, now)) {
+            continue;
+        }
+        order.emplace_back(ent.second.used, ent.first);
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto &ent : order) {
+        if (total <= cap) {
+            break;
+        }
+        /* The .stats goes first, so the entry disappears all at once */
+        DeleteFileW((base + ent.second + L".stats").c_str());
+        DeleteFileW((base + ent.second + L".dcm").c_str());
+        total -= entries[ent.second].size;
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Evicted cache entry %s", ent.second.c_str());
+    }
+    CloseHandle(lock);
+}
+
+
+void qagen_cache_store(const wchar_t *dir, const std::wstring &key, const wchar_t *dst,
+                       const struct qagen_dose_stats &stats, std::uint64_t cap)
+{
+    const std::wstring base = entry_path(dir, key);
+    std::wstring tmp;
+    wchar_t uniq[32];
+
+    if (!make_dirs(dir)) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"Cannot create conversion cache %s", dir);
+        return;
+    }
+    /* Both files go in under a private name, then are renamed into place */
+    swprintf(uniq, BUFLEN(uniq), L".%lu.%lu.tmp", GetCurrentProcessId(), GetCurrentThreadId());
+    tmp = base + uniq;
+    /* Copied, not linked, so that the entry outlives anything done to dst */
+    if (!CopyFileW(dst, tmp.c_str(), FALSE)
+     || !MoveFileExW(tmp.c_str(), (base + L".dcm").c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"Cannot add %s to the conversion cache: error %lu", key.c_str(), GetLastError());
+        DeleteFileW(tmp.c_str());
+        return;
+    }
+    if (!write_stats(tmp, stats)
+     || !MoveFileExW(tmp.c_str(), (base + L".stats").c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"Cannot add %s to the conversion cache: error %lu", key.c_str(), GetLastError());
+        DeleteFileW(tmp.c_str());
+        return;
+    }
+    evict(dir, cap);
+}
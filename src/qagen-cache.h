@@ -0,0 +1,85 @@
+#pragma once
+/** @file On-disk cache of converted Dose_Beams, keyed by what the output
+ *      depends on
+ *
+ *  A key is a hash of the MHD header, the size and modification time of its
+ *  voxel data, the identity of the RD template and the options that change
+ *  the output. Each entry is two files in the cache directory: <key>.dcm and
+ *  <key>.stats, the raw qagen_dose_stats. The .stats file is renamed into
+ *  place last, so an entry without one does not exist yet, and its
+ *  modification time is the entry's last use
+ *
+ *  Several processes may share a directory. Entries only ever appear by
+ *  rename, a reader that loses a race with eviction just converts again, and
+ *  only the process holding the lock file evicts
+ *
+ *  A hit may hard-link the entry to its destination. Nothing may modify such a
+ *  file in place, only delete or replace it, so the converter unlinks its
+ *  destination before every write, cache or no cache
+ */
+#ifndef QAGEN_CACHE_H
+#define QAGEN_CACHE_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstdint>
+#include <string>
+#include "qagen-metaio.h"
+#include "qagen-stats.h"
+
+
+/** Size and modification time of a file, which is all we look at for inputs
+ *  too large to hash */
+struct CacheStamp {
+    std::uint64_t size;
+    std::uint64_t mtime;
+};
+
+
+/** @brief Stats @p path
+ *  @returns false if it cannot be read
+ */
+bool qagen_cache_stamp(const wchar_t *path, CacheStamp &stamp) noexcept;
+
+
+/** @brief Computes the cache key of converting @p mhd
+ *  @param mhd
+ *      Path to the MHD or NIfTI file
+ *  @param tmplt
+ *      Path to the RD template
+ *  @param tstamp
+ *      The template's stamp, taken when it was loaded
+ *  @param opts
+ *      Conversion options
+ *  @param[out] key
+ *      Key, as hex digits
+ *  @returns false if this conversion cannot be cached
+ */
+bool qagen_cache_key(const wchar_t *mhd, const std::wstring &tmplt, const CacheStamp &tstamp,
+                     const struct qagen_metaio_opts &opts, std::wstring &key);
+
+
+/** @brief Looks up @p key, and if it is there, puts its RTDose file at @p dst
+ *      by hard link or by copy, and marks it used
+ *  @param[out] stats
+ *      The entry's dose statistics
+ *  @returns true on a hit. Any failure is a miss
+ */
+bool qagen_cache_fetch(const wchar_t *dir, const std::wstring &key, const wchar_t *dst,
+                       struct qagen_dose_stats &stats);
+
+
+/** @brief Adds the freshly converted @p dst as @p key, then evicts the least
+ *      recently used entries until the cache is no larger than @p cap bytes
+ *  @details Failures are logged and otherwise ignored. The conversion itself
+ *      succeeded
+ */
+void qagen_cache_store(const wchar_t *dir, const std::wstring &key, const wchar_t *dst,
+                       const struct qagen_dose_stats &stats, std::uint64_t cap);
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_CACHE_H */
@@ -3,7 +3,6 @@
 #include "qagen-error.h"
 #include "qagen-string.h"
 #include "qagen-metaio.h"
-#include "qagen-img2dcm.h"
 #include "qagen-memory.h"
 #include "qagen-log.h"
 
@@ -321,53 +320,120 @@ static void qagen_copy_itk_prepare(struct qagen_copy_ctx   *ctx,
 }
 
 
+/** @brief Counts one converted file, and refreshes the count and remaining
+ *      bytes in line 1 for whatever comes next
+ */
 static void qagen_copy_itk_complete(struct qagen_copy_ctx *ctx)
 {
     ctx->completed += ctx->templatesz;
     ctx->ncopied++;
+    if (ctx->ncopied < ctx->nfiles) {
+        qagen_copy_set_message(ctx, true);
+    }
     qagen_copy_update_dlg(ctx);
 }
 
 
-/** @brief Converts the MHD/RAW files into DICOM files in the destination
- *      directory
- *  @details At least, that's what it would do if there were any need in
- *      practice to have this function
- *  @param ctx
- *      Copy context
+/** Progress context for the MHD batch */
+struct qagen_copy_mhd_batch {
+    struct qagen_copy_ctx   *ctx;
+    const struct qagen_file *beams;
+};
+
+
+/** @brief Batch progress callback, this runs on the copy thread
+ *  @details A failed item still counts as done, so the bar reaches the end.
+ *      The batch itself returns the failure
+ */
+static bool qagen_copy_mhd_progress(size_t                            idx,
+                                    const struct qagen_metaio_status *status,
+                                    void                             *data)
+{
+    struct qagen_copy_mhd_batch *batch = data;
+    const struct qagen_file *mhd = batch->beams;
+
+    (void)status;
+    for (; idx && mhd; idx--) {
+        mhd = mhd->next;
+    }
+    if (mhd) {
+        qagen_copy_set_filename(batch->ctx, mhd->name);
+    }
+    qagen_copy_itk_complete(batch->ctx);
+    return !qagen_progdlg_cancelled(&batch->ctx->pdlg);
+}
+
+
+/** @brief Adds the dose statistics of each converted beam to the patient JSON
+ *  @details MCsquare numbers its Dose_Beams from one in RP beam order, so
+ *      Dose_Beam_k goes to field k - 1. A name without a number falls back to
+ *      its place in the list
  *  @param pt
  *      Patient context
+ *  @param status
+ *      Batch results, one for each Dose_Beam in list order
  *  @returns Nonzero on error
- *  @note This function must update the progress dialog itself, because no
- *      calls are made to the copy progress routine
  */
-static int qagen_copy_itk_dosebeams(struct qagen_copy_ctx *ctx,
-                                    struct qagen_patient  *pt)
+static int qagen_copy_mhd_stats(struct qagen_patient             *pt,
+                                const struct qagen_metaio_status *status)
 {
-    const struct qagen_file *itk = pt->dose_beam;
-    const wchar_t *const template = (pt->rd_template) ? pt->rd_template->path : pt->rtdose->path;
-    int res = 0;
+    const struct qagen_dose_stats **stats;
+    const struct qagen_file *mhd;
+    const uint32_t nfields = qagen_patient_num_beams(pt);
+    unsigned k;
+    size_t i;
+    int res;
 
-    for (; itk && !res && !qagen_progdlg_cancelled(&ctx->pdlg); itk = itk->next) {
-        qagen_log_printf(QAGEN_LOG_ERROR, L"Skipping ITK Dose_Beam file %s", itk->name);
-        /* if (qagen_path_join(&pt->basepath, itk->name)) {
-            return 1;
+    if (!nfields) {
+        return 0;
+    }
+    stats = qagen_calloc(nfields, sizeof *stats);
+    if (!stats) {
+        return 1;
+    }
+    for (mhd = pt->dose_beam, i = 0; mhd; mhd = mhd->next, i++) {
+        if (status[i].result) {
+            continue;
+        }
+        k = (swscanf(mhd->name, L"Dose_Beam_%u", &k) == 1 && k) ? k - 1 : (unsigned)i;
+        if (k < nfields) {
+            stats[k] = &status[i].stats;
+        } else {
+            qagen_log_printf(QAGEN_LOG_WARN, L"%s has no field in the RP file", mhd->name);
         }
-        qagen_copy_itk_prepare(ctx, itk);
-        qagen_path_remove_extension(&pt->basepath);
-        res = qagen_path_rename_extension(&pt->basepath, L"dcm")
-           || qagen_img2dcm_convert(itk->path, pt->basepath->buf, template);
-        qagen_path_remove_filespec(&pt->basepath);
-        if (!res) {
-            qagen_copy_itk_complete(ctx);
-        } */
     }
+    res = qagen_patient_add_dose_stats(pt, stats);
+    qagen_free(stats);
     return res;
 }
 
 
-/** @brief Converts the MHD/RAW files into DICOM files in the destination
- *      directory
+/** @brief Finds the per-user conversion cache, %LOCALAPPDATA%\QAGen\cache
+ *  @param buf
+ *      Output buffer
+ *  @param len
+ *      Length of @p buf
+ *  @returns @p buf, or NULL if there is no such directory, which disables the
+ *      cache
+ */
+static const wchar_t *qagen_copy_cache_dir(wchar_t *buf, size_t len)
+{
+    static const wchar_t sub[] = L"\\QAGen\\cache";
+    DWORD n;
+
+    n = GetEnvironmentVariableW(L"LOCALAPPDATA", buf, (DWORD)len);
+    if (!n || n + BUFLEN(sub) > len) {
+        return NULL;
+    }
+    wcscpy(buf + n, sub);
+    return buf;
+}
+
+
+/** @brief Converts the MHD/RAW or NIfTI files into DICOM files in the
+ *      destination directory, then adds their dose statistics to the JSON
+ *  @details The beams are independent, so they are converted several at a
+ *      time. NIfTI is read natively by the MetaIO converter, no ITK needed
  *  @param ctx
  *      Copy context
  *  @param pt
@@ -379,22 +445,59 @@ static int qagen_copy_itk_dosebeams(struct qagen_copy_ctx *ctx,
 static int qagen_copy_mhd_dosebeams(struct qagen_copy_ctx *ctx,
                                     struct qagen_patient  *pt)
 {
-    const struct qagen_file *mhd = pt->dose_beam;
+    const struct qagen_file *mhd;
     const wchar_t *const template = (pt->rd_template) ? pt->rd_template->path : pt->rtdose->path;
-    int res = 0;
+    wchar_t cachedir[MAX_PATH];
+    const struct qagen_metaio_opts opts = {
+        .nthreads = 0,      /* Every processor */
+        .stream   = true,   /* Several of these run at once */
+        .direct   = true,   /* The template is shared, only encode it once */
+        .nworkers = 0,
+        .crop     = true,   /* Beams only touch a small part of the CT grid */
+        .crop_threshold = 0.0,
+        .deflate  = 0,      /* Plain Explicit VR, for the QA tools */
+        .jpegls   = false,
+        .tolerance = 0.0,   /* Always 16 bits */
+        .rel_tolerance = 0.0,   /* The error is only logged */
+        .cache    = qagen_copy_cache_dir(cachedir, BUFLEN(cachedir)),
+        .cache_max = 0      /* Re-exports of the same plan skip conversion */
+    };
+    struct qagen_copy_mhd_batch batch = {
+        .ctx   = ctx,
+        .beams = pt->dose_beam
+    };
+    struct qagen_metaio_status *status;
+    const wchar_t **paths;
+    size_t n = 0;
+    int res;
 
-    for (; mhd && !res && !qagen_progdlg_cancelled(&ctx->pdlg); mhd = mhd->next) {
-        if (qagen_path_join(&pt->basepath, mhd->name)) {
-            return 1;
-        }
-        qagen_copy_itk_prepare(ctx, mhd);
-        res = qagen_path_rename_extension(&pt->basepath, L"dcm")
-           || qagen_metaio_convert(mhd->path, pt->basepath->buf, template);
-        qagen_path_remove_filespec(&pt->basepath);
-        if (!res) {
-            qagen_copy_itk_complete(ctx);
-        }
+    for (mhd = pt->dose_beam; mhd; mhd = mhd->next) {
+        n++;
+    }
+    if (!n) {
+        return 0;
     }
+    paths = qagen_malloc(sizeof *paths * n);
+    status = qagen_malloc(sizeof *status * n);
+    if (!paths || !status) {
+        qagen_free(paths);
+        qagen_free(status);
+        return 1;
+    }
+    n = 0;
+    for (mhd = pt->dose_beam; mhd; mhd = mhd->next) {
+        status[n].result = -1;  /* In case the template cannot even load */
+        paths[n++] = mhd->path;
+    }
+    qagen_copy_itk_prepare(ctx, pt->dose_beam);
+    res = qagen_metaio_convert_batch(paths, n, template, pt->basepath->buf, &opts,
+                                     status, qagen_copy_mhd_progress, &batch);
+    /* Whatever did convert still gets its statistics */
+    if (qagen_copy_mhd_stats(pt, status) && !res) {
+        res = 1;
+    }
+    qagen_free(status);
+    qagen_free(paths);
     return res;
 }
 
@@ -440,9 +543,8 @@ static int qagen_copy_dosebeams(struct qagen_copy_ctx *ctx,
     }
     switch (pt->dose_beam->type) {
     case QAGEN_FILE_MHD_DOSEBEAM:
-        return qagen_copy_mhd_dosebeams(ctx, pt);
     case QAGEN_FILE_ITK_DOSEBEAM:
-        return qagen_copy_itk_dosebeams(ctx, pt);
+        return qagen_copy_mhd_dosebeams(ctx, pt);
     case QAGEN_FILE_DCM_DOSEBEAM:
     default:
         return qagen_copy_dcm_dosebeams(ctx, pt);
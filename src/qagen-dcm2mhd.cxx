@@ -0,0 +1,520 @@
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "qagen-dcm2mhd.h"
+#include "qagen-kernel.h"
+#include "qagen-log.h"
+#include "qagen-parallel.h"
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+#include <dcmtk/dcmjpls/djdecode.h>
+
+
+/** Largest deviation of GridFrameOffsetVector from even spacing, in mm. An MHD
+ *  can only describe evenly spaced frames */
+#define QAGEN_DCM2MHD_SPACING_TOL 1e-3
+
+
+static const wchar_t *failmsg = L"Cannot convert RTDose to MHD";
+
+
+DoseExporter::Exception::Exception(const wchar_t *restrict fmt, ...)
+{
+    wchar_t buf[128];
+    va_list args;
+
+    va_start(args, fmt);
+    vswprintf(buf, BUFLEN(buf), fmt, args);
+    va_end(args);
+    qagen_error_raise(QAGEN_ERR_RUNTIME, failmsg, buf);
+}
+
+
+DoseExporter::Exception::Exception(OFCondition stat, const wchar_t *restrict fmt, ...)
+{
+    wchar_t buf1[128], buf2[128];
+    va_list args;
+
+    mbstowcs(buf1, stat.text(), BUFLEN(buf1));
+    va_start(args, fmt);
+    vswprintf(buf2, BUFLEN(buf2), fmt, args);
+    va_end(args);
+    qagen_error_raise(QAGEN_ERR_RUNTIME, buf1, buf2);
+}
+
+
+DoseExporter::Exception::Exception(DWORD dwerr, const wchar_t *restrict fmt, ...)
+{
+    wchar_t buf[128];
+    va_list args;
+
+    va_start(args, fmt);
+    vswprintf(buf, BUFLEN(buf), fmt, args);
+    va_end(args);
+    qagen_error_raise(QAGEN_ERR_WIN32, &dwerr, buf);
+}
+
+
+void DoseExporter::Exception::ofcheck(OFCondition stat, const wchar_t *msg)
+{
+    if (stat.bad()) {
+        throw Exception(stat, L"%s", msg);
+    }
+}
+
+
+/** @brief Registers the JPEG-LS decoder the first time it is needed */
+static void jpls_register()
+{
+    static std::once_flag once;
+
+    std::call_once(once, []{ DJLSDecoderRegistration::registerCodecs(); });
+}
+
+
+DoseExporter::DoseExporter(const wchar_t *dcm, const struct qagen_dcm2mhd_opts *opts):
+    m_dim(),
+    m_spacing(),
+    m_origin(),
+    m_axes(),
+    m_scaling(1.0),
+    m_bits(16),
+    m_signed(false),
+    m_nthreads(qagen_parallel_threads((opts) ? opts->nthreads : 0))
+{
+    load(dcm);
+    read_geometry();
+    read_pixel_format();
+}
+
+
+void DoseExporter::load(const wchar_t *path)
+{
+    DcmDataset *dset;
+    OFCondition stat;
+
+    stat = m_dcfile.loadFile(OFFilename(path));
+    Exception::ofcheck(stat, L"Cannot load RTDose");
+    dset = m_dcfile.getDataset();
+    /* Deflate is undone by the parser, but encapsulated pixels still have to
+    be decoded into a native representation */
+    if (DcmXfer(dset->getOriginalXfer()).isEncapsulated()) {
+        jpls_register();
+        stat = dset->chooseRepresentation(EXS_LittleEndianExplicit, nullptr);
+        Exception::ofcheck(stat, L"Cannot decompress RTDose pixels");
+    }
+}
+
+
+/** @brief Reads @p n decimal values of @p tag, all of which must be present */
+static void get_decimals(DcmDataset *dset, const DcmTagKey &tag, double *res,
+                         std::size_t n, const wchar_t *name)
+{
+    OFCondition stat;
+
+    for (std::size_t i = 0; i < n; i++) {
+        stat = dset->findAndGetFloat64(tag, res[i], (unsigned long)i);
+        if (stat.bad()) {
+            throw DoseExporter::Exception(stat, L"RTDose has no valid %s", name);
+        }
+    }
+}
+
+
+void DoseExporter::read_geometry()
+{
+    DcmDataset *dset = m_dcfile.getDataset();
+    double iop[6], pxsp[2], *normal = m_axes + 6;
+    std::vector<double> gfov;
+    Uint16 rows, cols;
+    Sint32 frames = 1;
+    OFCondition stat;
+    double step;
+
+    stat = dset->findAndGetUint16(DCM_Columns, cols);
+    Exception::ofcheck(stat, L"RTDose has no Columns");
+    stat = dset->findAndGetUint16(DCM_Rows, rows);
+    Exception::ofcheck(stat, L"RTDose has no Rows");
+    /* Single-frame files may leave this out */
+    if (dset->findAndGetSint32(DCM_NumberOfFrames, frames).bad()) {
+        frames = 1;
+    }
+    if (!cols || !rows || frames < 1) {
+        throw Exception(L"RTDose grid is empty: %u x %u x %d", cols, rows, frames);
+    }
+    m_dim[0] = cols;
+    m_dim[1] = rows;
+    m_dim[2] = (std::size_t)frames;
+
+    get_decimals(dset, DCM_ImagePositionPatient, m_origin, 3, L"ImagePositionPatient");
+    get_decimals(dset, DCM_ImageOrientationPatient, iop, 6, L"ImageOrientationPatient");
+    get_decimals(dset, DCM_PixelSpacing, pxsp, 2, L"PixelSpacing");
+    get_decimals(dset, DCM_DoseGridScaling, &m_scaling, 1, L"DoseGridScaling");
+
+    /* Row spacing, i.e. along a column, comes first */
+    m_spacing[0] = pxsp[1];
+    m_spacing[1] = pxsp[0];
+    std::memcpy(m_axes, iop, sizeof iop);
+    normal[0] = iop[1] * iop[5] - iop[2] * iop[4];
+    normal[1] = iop[2] * iop[3] - iop[0] * iop[5];
+    normal[2] = iop[0] * iop[4] - iop[1] * iop[3];
+
+    if (m_dim[2] == 1) {
+        if (dset->findAndGetFloat64(DCM_SliceThickness, m_spacing[2]).bad() || !(m_spacing[2] > 0.0)) {
+            m_spacing[2] = 1.0;
+        }
+        return;
+    }
+    gfov.resize(m_dim[2]);
+    get_decimals(dset, DCM_GridFrameOffsetVector, gfov.data(), gfov.size(), L"GridFrameOffsetVector");
+    step = (gfov.back() - gfov.front()) / (double)(m_dim[2] - 1);
+    for (std::size_t k = 0; k < m_dim[2]; k++) {
+        if (std::fabs(gfov[k] - gfov.front() - step * (double)k) > QAGEN_DCM2MHD_SPACING_TOL) {
+            throw Exception(L"Frame %zu is off the even %g mm spacing, which MHD cannot describe", k, step);
+        }
+    }
+    if (!(std::fabs(step) > 0.0)) {
+        throw Exception(L"RTDose frames are all in the same plane");
+    }
+    /* Frames that run against the normal just get a reversed third axis */
+    if (step < 0.0) {
+        normal[0] = -normal[0];
+        normal[1] = -normal[1];
+        normal[2] = -normal[2];
+    }
+    m_spacing[2] = std::fabs(step);
+}
+
+
+void DoseExporter::read_pixel_format()
+{
+    DcmDataset *dset = m_dcfile.getDataset();
+    Uint16 bits, rep;
+    OFCondition stat;
+
+    stat = dset->findAndGetUint16(DCM_BitsAllocated, bits);
+    Exception::ofcheck(stat, L"RTDose has no BitsAllocated");
+    stat = dset->findAndGetUint16(DCM_PixelRepresentation, rep);
+    Exception::ofcheck(stat, L"RTDose has no PixelRepresentation");
+    if (bits != 16 && bits != 32) {
+        throw Exception(L"Unsupported BitsAllocated %u, expected 16 or 32", bits);
+    }
+    m_bits = bits;
+    m_signed = rep != 0;
+}
+
+
+/** @class Output file, preallocated and mapped for writing. The file is
+ *      deleted when this is destroyed, unless it has been kept with keep()
+ */
+class MappedOutput {
+    HANDLE m_hfile;
+    HANDLE m_hmap;
+    void  *m_view;
+    bool   m_keep;
+
+    void close() noexcept;
+
+public:
+    MappedOutput(const wchar_t *path, std::size_t size);
+    ~MappedOutput() { close(); }
+
+    void *data() noexcept { return m_view; }
+
+    void keep() noexcept { m_keep = true; }
+};
+
+
+MappedOutput::MappedOutput(const wchar_t *path, std::size_t size):
+    m_hfile(INVALID_HANDLE_VALUE),
+    m_hmap(NULL),
+    m_view(NULL),
+    m_keep(false)
+{
+    ULARGE_INTEGER sz;
+    DWORD err;
+
+    sz.QuadPart = size;
+    m_hfile = CreateFile(path,
+                         GENERIC_READ | GENERIC_WRITE | DELETE,
+                         0,
+                         NULL,
+                         CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL,
+                         NULL);
+    if (m_hfile == INVALID_HANDLE_VALUE) {
+        throw DoseExporter::Exception(GetLastError(), L"Cannot create %s", path);
+    }
+    /* Mapping past the end extends the file to its full size up front */
+    m_hmap = CreateFileMapping(m_hfile, NULL, PAGE_READWRITE, sz.HighPart, sz.LowPart, NULL);
+    if (m_hmap) {
+        m_view = MapViewOfFile(m_hmap, FILE_MAP_WRITE, 0, 0, size);
+    }
+    if (!m_view) {
+        err = GetLastError();
+        close();
+        throw DoseExporter::Exception(err, L"Cannot map %s", path);
+    }
+}
+
+
+void MappedOutput::close() noexcept
+{
+    FILE_DISPOSITION_INFO disp = { TRUE };
+
+    if (m_view) {
+        UnmapViewOfFile(m_view);
+        m_view = NULL;
+    }
+    if (m_hmap) {
+        CloseHandle(m_hmap);
+        m_hmap = NULL;
+    }
+    if (m_hfile != INVALID_HANDLE_VALUE) {
+        /* A failed conversion leaves nothing behind */
+        if (!m_keep) {
+            SetFileInformationByHandle(m_hfile, FileDispositionInfo, &disp, sizeof disp);
+        }
+        CloseHandle(m_hfile);
+        m_hfile = INVALID_HANDLE_VALUE;
+    }
+}
+
+
+/** @brief Dequantizes @p pixels straight into the mapped .raw, a chunk of
+ *      frames per thread
+ */
+template <class PixelT>
+void DoseExporter::write_voxels(const wchar_t *raw, const void *pixels)
+{
+    const std::size_t framelen = m_dim[0] * m_dim[1];
+    const PixelT *src = static_cast<const PixelT *>(pixels);
+    const float scal = (float)m_scaling;
+    MappedOutput out(raw, framelen * m_dim[2] * sizeof (float));
+    float *dst = static_cast<float *>(out.data());
+
+    qagen_parallel_for(m_dim[2], m_nthreads, [&](std::size_t k0, std::size_t k1, unsigned){
+        qagen_kernel_dequantize_flip(dst + k0 * framelen, src + k0 * framelen, framelen, k1 - k0, scal);
+    });
+    out.keep();
+}
+
+
+/** @brief Appends @p n space-separated shortest round-trip decimals */
+template <class T>
+static void append_values(std::string &str, const T *val, std::size_t n)
+{
+    char buf[32];
+    std::to_chars_result res;
+
+    for (std::size_t i = 0; i < n; i++) {
+        res = std::to_chars(buf, buf + sizeof buf, val[i]);
+        if (i) {
+            str += ' ';
+        }
+        str.append(buf, res.ptr);
+    }
+}
+
+
+void DoseExporter::write_header(const wchar_t *mhd, const std::wstring &raw)
+{
+    const double zero[3] = { 0.0, 0.0, 0.0 };
+    std::string text, name;
+    std::FILE *fp;
+    bool ok;
+
+    /* Just the file name, the data lives next to the header */
+    name.reserve(raw.size());
+    for (wchar_t c : raw.substr(raw.find_last_of(L"\\/") + 1)) {
+        if (c > 0x7f) {
+            throw Exception(L"MHD data file names must be ASCII");
+        }
+        name += (char)c;
+    }
+    text = "ObjectType = Image\nNDims = 3\nBinaryData = True\n"
+           "BinaryDataByteOrderMSB = False\nCompressedData = False\n";
+    text += "TransformMatrix = ";
+    append_values(text, m_axes, 9);
+    text += "\nOffset = ";
+    append_values(text, m_origin, 3);
+    text += "\nCenterOfRotation = ";
+    append_values(text, zero, 3);
+    text += "\nElementSpacing = ";
+    append_values(text, m_spacing, 3);
+    text += "\nDimSize = ";
+    append_values(text, m_dim, 3);
+    text += "\nElementType = MET_FLOAT\nElementDataFile = " + name + "\n";
+
+    fp = _wfopen(mhd, L"wb");
+    if (!fp) {
+        throw Exception(L"Cannot create %s: %S", mhd, std::strerror(errno));
+    }
+    ok = std::fwrite(text.data(), 1, text.size(), fp) == text.size();
+    ok = !std::fclose(fp) && ok;
+    if (!ok) {
+        _wremove(mhd);
+        throw Exception(L"Cannot write %s", mhd);
+    }
+}
+
+
+void DoseExporter::write(const wchar_t *mhd)
+{
+    const std::size_t n = m_dim[0] * m_dim[1] * m_dim[2];
+    DcmDataset *dset = m_dcfile.getDataset();
+    DcmElement *elem;
+    Uint16 *pixels;
+    std::wstring raw;
+    OFCondition stat;
+    std::size_t dot;
+
+    stat = dset->findAndGetElement(DCM_PixelData, elem);
+    Exception::ofcheck(stat, L"RTDose has no PixelData");
+    stat = elem->getUint16Array(pixels);
+    Exception::ofcheck(stat, L"Cannot read RTDose pixels");
+    if (!pixels || elem->getLength() < n * (m_bits / 8)) {
+        throw Exception(L"PixelData is shorter than its %zu x %zu x %zu grid", m_dim[0], m_dim[1], m_dim[2]);
+    }
+
+    raw = mhd;
+    dot = raw.find_last_of(L'.');
+    if (dot != std::wstring::npos && raw.find_first_of(L"\\/", dot) == std::wstring::npos) {
+        raw.erase(dot);
+    }
+    raw += L".raw";
+    if (m_bits == 32 && m_signed) {
+        write_voxels<Sint32>(raw.c_str(), pixels);
+    } else if (m_bits == 32) {
+        write_voxels<Uint32>(raw.c_str(), pixels);
+    } else if (m_signed) {
+        write_voxels<Sint16>(raw.c_str(), pixels);
+    } else {
+        write_voxels<Uint16>(raw.c_str(), pixels);
+    }
+    try {
+        write_header(mhd, raw);
+    } catch (Exception &) {
+        _wremove(raw.c_str());
+        throw;
+    }
+}
+
+
+EXTERN_C
+int qagen_dcm2mhd_convert(const wchar_t *restrict dcm,
+                          const wchar_t *restrict mhd,
+                          const struct qagen_dcm2mhd_opts *opts)
+{
+    try {
+        DoseExporter exp(dcm, opts);
+        exp.write(mhd);
+        return 0;
+    } catch (DoseExporter::Exception &) {
+        /* Already raised */
+    } catch (std::bad_alloc &) {
+        int err = ENOMEM;
+        qagen_error_raise(QAGEN_ERR_SYSTEM, &err, failmsg);
+    } catch (std::exception &) {
+        qagen_error_raise(QAGEN_ERR_RUNTIME, failmsg, L"Caught unknown polymorphic std::exception");
+    }
+    return 1;
+}
+
+
+/** @brief The output header for @p dcm: its name with the extension .mhd, in
+ *      @p outdir if there is one
+ */
+static std::wstring qagen_dcm2mhd_name(const wchar_t *dcm, const wchar_t *outdir)
+{
+    std::wstring name = dcm, res;
+    std::size_t sep, dot;
+
+    sep = name.find_last_of(L"\\/");
+    sep = (sep == std::wstring::npos) ? 0 : sep + 1;
+    dot = name.find_last_of(L'.');
+    if (dot != std::wstring::npos && dot > sep) {
+        name.erase(dot);
+    }
+    if (outdir) {
+        res = outdir;
+        if (!res.empty() && res.back() != L'\\' && res.back() != L'/') {
+            res += L'\\';
+        }
+        res.append(name, sep, std::wstring::npos);
+    } else {
+        res = std::move(name);
+    }
+    return res + L".mhd";
+}
+
+
+EXTERN_C
+int qagen_dcm2mhd_convert_batch(const wchar_t *const             *dcm,
+                                size_t                            n,
+                                const wchar_t *restrict           outdir,
+                                const struct qagen_dcm2mhd_opts  *opts,
+                                struct qagen_dcm2mhd_status      *status)
+{
+    struct qagen_dcm2mhd_opts itemopts = (opts) ? *opts : qagen_dcm2mhd_opts{ };
+    std::vector<struct qagen_dcm2mhd_status> st;
+    std::atomic<size_t> next(0);
+    unsigned nworkers, nthreads;
+    int res = 0;
+
+    if (!n) {
+        return 0;
+    }
+    try {
+        st.resize(n);
+    } catch (std::bad_alloc &) {
+        int err = ENOMEM;
+        qagen_error_raise(QAGEN_ERR_SYSTEM, &err, L"Failed to convert RTDose batch");
+        return 1;
+    }
+    /* Split the processors between the workers, so that nested frame loops
+    don't oversubscribe the pool */
+    nworkers = (itemopts.nworkers) ? itemopts.nworkers : QAGEN_DCM2MHD_WORKERS;
+    nworkers = (nworkers > n) ? (unsigned)n : nworkers;
+    nthreads = qagen_parallel_threads(itemopts.nthreads);
+    itemopts.nthreads = (nworkers && nthreads > nworkers) ? nthreads / nworkers : 1;
+
+    /* Each worker claims the next file when it finishes one, so a few large
+    files don't hold up the rest */
+    qagen_parallel_for(nworkers, nworkers, [&](size_t, size_t, unsigned){
+        size_t i;
+
+        while ((i = next.fetch_add(1)) < n) {
+            try {
+                st[i].result = qagen_dcm2mhd_convert(dcm[i], qagen_dcm2mhd_name(dcm[i], outdir).c_str(), &itemopts);
+            } catch (std::bad_alloc &) {
+                int err = ENOMEM;
+                qagen_error_raise(QAGEN_ERR_SYSTEM, &err, failmsg);
+                st[i].result = 1;
+            }
+            if (st[i].result) {
+                qagen_error_save(&st[i].error);
+                /* Pool threads are reused, don't leave this lying around on them */
+                qagen_error_raise(QAGEN_ERR_NONE, NULL, NULL);
+            } else {
+                qagen_log_printf(QAGEN_LOG_INFO, L"Converted %s", dcm[i]);
+            }
+        }
+    });
+
+    for (size_t j = 0; j < n; j++) {
+        if (status) {
+            status[j] = st[j];
+        }
+        if (!res && st[j].result) {
+            qagen_error_restore(&st[j].error);
+            res = 1;
+        }
+    }
+    return res;
+}
@@ -0,0 +1,139 @@
+#pragma once
+/** @file Converts RTDose files back into float MetaImages
+ *
+ *  This is mhd2dcm run backwards, for feeding doses back into MCsquare and the
+ *  analysis scripts. The header describes the DICOM grid exactly, and each
+ *  frame of the .raw is written backwards, which is the in-plane reversal
+ *  every Dose_Beam has (see qagen-reformat.h). So a converted Dose_Beam comes
+ *  back out as the MHD it started from, up to quantization and cropping
+ */
+#ifndef QAGEN_DCM2MHD_H
+#define QAGEN_DCM2MHD_H
+
+#include "qagen-defs.h"
+#include "qagen-error.h"
+
+EXTERN_C_START
+
+
+/** Conversion options. Zero-initialize this for the defaults */
+struct qagen_dcm2mhd_opts {
+    unsigned nthreads;  /* Threads used to split each volume by frame. Zero
+                        uses one per logical processor */
+    unsigned nworkers;  /* Files converted at once by a batch conversion.
+                        Zero converts up to QAGEN_DCM2MHD_WORKERS at once.
+                        The nthreads above are shared between them */
+};
+
+
+/** Default worker count for batch conversions */
+#define QAGEN_DCM2MHD_WORKERS 4
+
+
+/** Result of one item of a batch conversion */
+struct qagen_dcm2mhd_status {
+    int result;                 /* Zero on success, nonzero on error */
+    struct qagen_error error;   /* The error raised by this item, if it failed */
+};
+
+
+/** @brief Converts the RTDose file @p dcm to a MetaImage at @p mhd, with its
+ *      voxels in a .raw file of the same name
+ *  @param dcm
+ *      Path to DICOM RTDose file. Deflated and JPEG-LS files work too
+ *  @param mhd
+ *      Path to the output header
+ *  @param opts
+ *      Conversion options, or NULL for the defaults
+ *  @returns Nonzero on error
+ */
+int qagen_dcm2mhd_convert(const wchar_t *restrict dcm,
+                          const wchar_t *restrict mhd,
+                          const struct qagen_dcm2mhd_opts *opts);
+
+
+/** @brief Converts every file in @p dcm to a MetaImage of the same name in
+ *      @p outdir, several at a time
+ *  @details Items are independent, so one failure does not stop the others
+ *  @param dcm
+ *      Array of paths to RTDose files
+ *  @param n
+ *      Number of paths in @p dcm
+ *  @param outdir
+ *      Output directory, or NULL to write each MHD next to its RTDose
+ *  @param opts
+ *      Conversion options, or NULL for the defaults
+ *  @param[out] status
+ *      Array of @p n per-item results, or NULL if you don't care
+ *  @returns Nonzero if any item failed. The error state is that of the first
+ *      failed item
+ */
+int qagen_dcm2mhd_convert_batch(const wchar_t *const             *dcm,
+                                size_t                            n,
+                                const wchar_t *restrict           outdir,
+                                const struct qagen_dcm2mhd_opts  *opts,
+                                struct qagen_dcm2mhd_status      *status);
+
+
+EXTERN_C_END
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstddef>
+#include <string>
+#include <dcmtk/dcmdata/dcfilefo.h>
+
+
+/** @class Reads one RTDose file and writes it out as a MetaImage */
+class DoseExporter {
+public:
+    /** Raises an application error when constructed, then is thrown */
+    class Exception {
+    public:
+        Exception(const wchar_t *restrict fmt, ...);
+
+        /** DCMTK error */
+        Exception(OFCondition stat, const wchar_t *restrict fmt, ...);
+
+        /** Win32 error, from GetLastError() */
+        Exception(DWORD dwerr, const wchar_t *restrict fmt, ...);
+
+        /** Throws an Exception with @p msg if @p stat is bad */
+        static void ofcheck(OFCondition stat, const wchar_t *msg);
+    };
+
+private:
+    DcmFileFormat m_dcfile;
+
+    std::size_t m_dim[3];       /* Columns, rows, frames */
+    double      m_spacing[3];
+    double      m_origin[3];    /* ImagePositionPatient */
+    double      m_axes[9];      /* Rows: row direction, column direction and
+                                the direction frames advance in */
+    double      m_scaling;      /* DoseGridScaling */
+    unsigned    m_bits;         /* BitsAllocated */
+    bool        m_signed;
+
+    unsigned m_nthreads;
+
+    void load(const wchar_t *path);
+    void read_geometry();
+    void read_pixel_format();
+
+    template <class PixelT>
+    void write_voxels(const wchar_t *raw, const void *pixels);
+
+    void write_header(const wchar_t *mhd, const std::wstring &raw);
+
+public:
+    /** @brief Loads @p dcm, decompressing its pixels if need be */
+    DoseExporter(const wchar_t *dcm, const struct qagen_dcm2mhd_opts *opts);
+
+    /** @brief Writes the MetaImage header @p mhd, and its voxels next to it */
+    void write(const wchar_t *mhd);
+};
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_DCM2MHD_H */
@@ -0,0 +1,47 @@
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include "qagen-decimal.h"
+
+
+/** @brief The shortest round-trip form if it fits, otherwise the most
+ *      significant digits that do. Sixteen characters always fit one
+ *      significant digit, even with a sign and a three-digit exponent
+ */
+template <class T>
+static char *ds_put(char *dst, T val) noexcept
+{
+    char *const end = dst + QAGEN_DS_MAX;
+    std::to_chars_result res;
+
+    if (!std::isfinite(val)) {
+        return nullptr;
+    }
+    res = std::to_chars(dst, end, val);
+    for (int prec = std::numeric_limits<T>::max_digits10; res.ec != std::errc() && prec > 0; prec--) {
+        res = std::to_chars(dst, end, val, std::chars_format::general, prec);
+    }
+    return (res.ec == std::errc()) ? res.ptr : nullptr;
+}
+
+
+char *qagen_ds_put(char *dst, double val) noexcept
+{
+    return ds_put(dst, val);
+}
+
+
+char *qagen_ds_put(char *dst, float val) noexcept
+{
+    return ds_put(dst, val);
+}
+
+
+char *qagen_is_put(char *dst, long long val) noexcept
+{
+    /* IS is limited to a signed 32-bit range */
+    if (val < -2147483648LL || val > 2147483647LL) {
+        return nullptr;
+    }
+    return std::to_chars(dst, dst + QAGEN_IS_MAX, val).ptr;
+}
@@ -0,0 +1,89 @@
+#pragma once
+/** @file DICOM decimal (DS) and integer (IS) string formatting
+ *
+ *  Values are written with std::to_chars into buffers the caller owns, so a
+ *  multi-valued tag like GridFrameOffsetVector is formatted with no allocation
+ *  past its own buffer. DS values are the shortest string that reads back to
+ *  the same value, unless that is longer than the 16 bytes DS allows, in which
+ *  case they are rounded to the most significant digits that fit
+ */
+#ifndef QAGEN_DECIMAL_H
+#define QAGEN_DECIMAL_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstddef>
+#include <type_traits>
+
+
+/** Longest DS value */
+#define QAGEN_DS_MAX 16
+
+/** Longest IS value */
+#define QAGEN_IS_MAX 12
+
+
+/** @brief Writes @p val as a single DS value, without a terminator
+ *  @param dst
+ *      Output, with room for at least QAGEN_DS_MAX characters
+ *  @returns One past the last character written, or nullptr if @p val is not
+ *      finite
+ */
+char *qagen_ds_put(char *dst, double val) noexcept;
+
+/** @brief Float overload. The shortest string is the one that reads back to
+ *      the same float, not the same double
+ */
+char *qagen_ds_put(char *dst, float val) noexcept;
+
+/** @brief Writes @p val as a single IS value, without a terminator
+ *  @param dst
+ *      Output, with room for at least QAGEN_IS_MAX characters
+ *  @returns One past the last character written, or nullptr if @p val is out
+ *      of the IS range
+ */
+char *qagen_is_put(char *dst, long long val) noexcept;
+
+
+/** @brief Writes @p n values of @p val joined by backslashes, and terminates
+ *      the string
+ *  @details Floating-point values are written as DS, and integers as IS
+ *  @param buf
+ *      Output buffer. qagen_decimal_size() gives the size it needs
+ *  @returns false if a value cannot be represented
+ */
+template <class T>
+bool qagen_decimal_format(char *buf, const T *val, std::size_t n) noexcept
+{
+    for (std::size_t i = 0; i < n; i++) {
+        if (i) {
+            *buf++ = '\\';
+        }
+        if constexpr (std::is_floating_point_v<T>) {
+            buf = qagen_ds_put(buf, val[i]);
+        } else {
+            buf = qagen_is_put(buf, (long long)val[i]);
+        }
+        if (!buf) {
+            return false;
+        }
+    }
+    *buf = '\0';
+    return true;
+}
+
+
+/** @brief Buffer size needed to format @p n values, including the delimiters
+ *      and the terminator
+ */
+constexpr std::size_t qagen_decimal_size(std::size_t n) noexcept
+{
+    return n * (QAGEN_DS_MAX + 1) + 1;
+}
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_DECIMAL_H */
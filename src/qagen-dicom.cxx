@@ -108,9 +108,14 @@ void DCMReader::Exception::ofcheck(OFCondition stat, const wchar_t *restrict fmt
 }
 
 
-DCMReader::DCMReader(const wchar_t *filename)
+DCMReader::DCMReader(const wchar_t *filename, const DcmTagKey &stop)
 {
-    OFCondition stat = m_dcfile.loadFile(OFFilename(filename));
+    OFCondition stat = m_dcfile.loadFileUntilTag(OFFilename(filename),
+                                                 EXS_Unknown,
+                                                 EGL_noChange,
+                                                 DCM_MaxReadLength,
+                                                 ERM_autoDetect,
+                                                 stop);
     Exception::ofcheck(stat, L"Failed to load DICOM file");
     m_dset = m_dcfile.getDataset();
 }
@@ -287,8 +292,11 @@ void RDReader::read_beamnum(void)
 }
 
 
+/* Only the references are read, and they all come long before the dose. The
+   search opens every RD in the export, often over the network, so don't read
+   megabytes of PixelData just to throw them away */
 RDReader::RDReader(const wchar_t *filename, struct qagen_rtdose *rd):
-    DCMReader(filename),
+    DCMReader(filename, DCM_PixelData),
     m_rd(rd)
 {
 
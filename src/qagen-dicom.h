@@ -141,8 +141,11 @@ public:
     /** @brief Creates a new DICOM reader to read the DICOM file at @p filename
      *  @param filename
      *      Path to DICOM file
+     *  @param stop
+     *      Top-level tag to stop parsing at, which is not read and neither is
+     *      anything after it. The default reads the whole file
      */
-    explicit DCMReader(const wchar_t *filename);
+    explicit DCMReader(const wchar_t *filename, const DcmTagKey &stop = DCM_UndefinedTagKey);
 
     /** @note This is only here to enforce the interface */
     virtual void read_tags(void) = 0;
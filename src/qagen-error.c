@@ -102,3 +102,18 @@ bool qagen_error_state(void)
 {
     return error.type != QAGEN_ERR_NONE;
 }
+
+
+void qagen_error_save(struct qagen_error *err)
+{
+    *err = error;
+}
+
+
+void qagen_error_restore(const struct qagen_error *err)
+{
+    error = *err;
+    if (error.type) {
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Error state %d restored", error.type);
+    }
+}
@@ -71,6 +71,22 @@ void qagen_error_string(const wchar_t **ctx, const wchar_t **msg);
 bool qagen_error_state(void);
 
 
+/** @brief Copies this thread's error state into @p err
+ *  @details Use this to hand an error raised on a worker thread back to the
+ *      thread that is waiting on it
+ *  @param[out] err
+ *      Buffer receiving the error state
+ */
+void qagen_error_save(struct qagen_error *err);
+
+
+/** @brief Replaces this thread's error state with @p err
+ *  @param err
+ *      Error state saved by qagen_error_save, possibly on another thread
+ */
+void qagen_error_restore(const struct qagen_error *err);
+
+
 EXTERN_C_END
 
 #endif /* QAGEN_ERROR_H */
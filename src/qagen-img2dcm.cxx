@@ -1,11 +1,24 @@
 #include <cstdarg>
+#include <mutex>
 #include <string>
+#include <vector>
 #include <itkImageFileReader.h>
-#include <itkMinimumMaximumImageCalculator.h>
+#include <itkMetaImageIO.h>
+#include <itkMetaImageIOFactory.h>
+#include <itkNiftiImageIO.h>
+#include <itkNiftiImageIOFactory.h>
 #include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcistrmf.h>
+#include <dcmtk/dcmdata/dcpixel.h>
 #include <dcmtk/dcmdata/dcvrdt.h>
+#include <dcmtk/dcmdata/dcvrobow.h>
 #include "qagen-img2dcm.h"
+#include "qagen-decimal.h"
 #include "qagen-error.h"
+#include "qagen-kernel.h"
+#include "qagen-parallel.h"
+#include "qagen-reformat.h"
+#include "qagen-stats.h"
 
 using namespace std::literals;
 
@@ -13,13 +26,15 @@ using namespace std::literals;
 EXTERN_C
 int qagen_img2dcm_convert(const wchar_t *restrict img,
                           const wchar_t *restrict dcm,
-                          const wchar_t *restrict tmplt)
+                          const wchar_t *restrict tmplt,
+                          size_t                  budget)
 {
     static const wchar_t *failmsg = L"Cannot convert image to DICOM file";
     ITKConverter cvt;
     int erno;
 
     try {
+        cvt.set_budget(budget);
         cvt.initialize(img, tmplt);
         cvt.write(dcm);
         return 0;
@@ -74,19 +89,114 @@ ITKConverter::Exception::Exception(const DcmTagKey &key, OFCondition stat)
 }
 
 
+ITKConverter::Exception::Exception(int errnum, const wchar_t *ctx)
+    noexcept
+{
+    qagen_error_raise(QAGEN_ERR_SYSTEM, &errnum, ctx);
+}
+
+
+ITKConverter::Exception::Exception(DWORD dwerr, const wchar_t *ctx)
+    noexcept
+{
+    qagen_error_raise(QAGEN_ERR_WIN32, &dwerr, ctx);
+}
+
+
+/** @class Spools quantized slabs to a temp file, which DCMTK then reads back
+ *      on demand while saving. The file is deleted on destruction unless it
+ *      has been handed to the dataset
+ */
+class ITKConverter::Spool {
+    wchar_t m_path[MAX_PATH];
+    FILE   *m_fp;
+
+public:
+    Spool():
+        m_fp(nullptr)
+    {
+        wchar_t dir[MAX_PATH];
+        int err;
+
+        if (!GetTempPath(BUFLEN(dir), dir) || !GetTempFileName(dir, L"qag", 0, m_path)) {
+            throw Exception(GetLastError(), L"Cannot create a temp file for pixel data");
+        }
+        m_fp = _wfopen(m_path, L"wb");
+        if (!m_fp) {
+            err = errno;
+            DeleteFile(m_path);
+            throw Exception(err, L"Cannot open pixel data temp file");
+        }
+    }
+
+    ~Spool()
+    {
+        if (m_fp) {
+            fclose(m_fp);
+        }
+        if (m_path[0]) {
+            DeleteFile(m_path);
+        }
+    }
+
+    Spool(const Spool &) = delete;
+    Spool &operator=(const Spool &) = delete;
+
+    void write(const void *buf, size_t size)
+    {
+        if (fwrite(buf, 1, size, m_fp) != size) {
+            throw Exception(errno, L"Cannot write pixel data temp file");
+        }
+    }
+
+    /** @brief Closes the file and makes it @p dset's PixelData, @p size bytes
+     *      of it. DCMTK deletes it once it is done with it
+     */
+    void insert(DcmDataset *dset, size_t size)
+    {
+        DcmOtherByteOtherWord *px;
+        DcmTempFileHandler *handler;
+        OFCondition stat;
+        int err;
+
+        err = fclose(m_fp);
+        m_fp = nullptr;
+        if (err) {
+            throw Exception(errno, L"Cannot flush pixel data temp file");
+        }
+        handler = DcmTempFileHandler::newInstance(OFFilename(m_path));
+        m_path[0] = L'\0';
+        px = new DcmOtherByteOtherWord(DcmTag(DCM_PixelData, EVR_OW));
+        stat = px->createValueFromTempFile(new DcmInputTempFileStreamFactory(handler),
+                                           static_cast<Uint32>(size), EBO_LittleEndian);
+        handler->decreaseRefCount();    /* The factory holds it now */
+        if (stat.good()) {
+            stat = dset->insert(px, true);
+        }
+        if (stat.bad()) {
+            delete px;
+            throw Exception(DCM_PixelData, stat);
+        }
+    }
+};
+
+
 template <class InsertT>
 void ITKConverter::insert(const DcmTagKey &tag, size_t n, const InsertT val[])
 {
-    static const char *delim[] = { "", "\\" };
-    std::stringstream ss;
-    unsigned i, j = 0;
+    char stack[qagen_decimal_size(6)];
+    std::unique_ptr<char[]> heap;
+    char *buf = stack;
     OFCondition stat;
 
-    for (i = 0; i < n; i++) {
-        ss << delim[j] << val[i];
-        j |= (unsigned)1;
+    if (n > 6) {
+        heap = std::make_unique<char[]>(qagen_decimal_size(n));
+        buf = heap.get();
+    }
+    if (!qagen_decimal_format(buf, val, n)) {
+        throw Exception(tag, EC_InvalidValue);
     }
-    stat = dataset()->putAndInsertString(tag, ss.str().c_str());
+    stat = dataset()->putAndInsertString(tag, buf);
     if (stat.bad()) {
         throw Exception(tag, stat);
     }
@@ -125,16 +235,53 @@ void ITKConverter::insert(const DcmTagKey &tag, const DcmTagKey &val)
 }
 
 
-void ITKConverter::insert_pixels(const std::vector<pixel_t> &px)
+ITKConverter::pixel_t *ITKConverter::create_pixels(size_t n)
 {
+    DcmPixelData *px;
     OFCondition stat;
+    Uint16 *words;
 
-    stat = dataset()->putAndInsertUint16Array(DCM_PixelData,
-                                              px.data(),
-                                              px.size());
+    px = new DcmPixelData(DCM_PixelData);
+    stat = px->createUint16Array(static_cast<Uint32>(n), words);
+    if (stat.good()) {
+        stat = dataset()->insert(px, true);
+    }
     if (stat.bad()) {
+        delete px;
         throw Exception(DCM_PixelData, stat);
     }
+    return words;
+}
+
+
+/** @brief Picks the ImageIO from @p path's extension, so that the reader
+ *      doesn't have to ask every registered factory whether it can read it
+ *  @returns The ImageIO, or nullptr to let the factories decide
+ */
+static itk::ImageIOBase::Pointer image_io(const wchar_t *path)
+{
+    static const struct {
+        const wchar_t *ext;
+        bool           nifti;
+    } exts[] = {
+        { L".mhd",    false },
+        { L".mha",    false },
+        { L".nii",    true  },
+        { L".nii.gz", true  }
+    };
+    const size_t len = wcslen(path);
+    size_t extlen;
+
+    for (const auto &ext: exts) {
+        extlen = wcslen(ext.ext);
+        if (len > extlen && !_wcsicmp(path + len - extlen, ext.ext)) {
+            if (ext.nifti) {
+                return itk::NiftiImageIO::New().GetPointer();
+            }
+            return itk::MetaImageIO::New().GetPointer();
+        }
+    }
+    return nullptr;
 }
 
 
@@ -142,13 +289,64 @@ void ITKConverter::load_image(const wchar_t *path)
 {
     using reader_t = itk::ImageFileReader<image_t>;
     reader_t::Pointer reader;   /* The default constructor isn't noexcept... */
+    itk::ImageIOBase::Pointer io;
     char buf[256];  /* We're just gonna do it this way */
+#if QAGEN_ITK_MINIMAL_IO
+    static std::once_flag registered;
+
+    /* Without ITK's factory manager, nothing is registered unless we do it */
+    std::call_once(registered, []{
+        itk::MetaImageIOFactory::RegisterOneFactory();
+        itk::NiftiImageIOFactory::RegisterOneFactory();
+    });
+#endif
 
     snprintf(buf, BUFLEN(buf), "%S", path);
     reader = reader_t::New();
     reader->SetFileName(buf);
-    reader->Update();
+    io = image_io(path);
+    if (io) {
+        reader->SetImageIO(io);
+    }
+    reader->UpdateOutputInformation();
     image_ptr() = reader->GetOutput();
+    m_reader = reader.GetPointer();
+}
+
+
+/** @brief Pulls the image through in slabs of whole frames that fit in the
+ *      budget, calling @p fn with the first frame, frame count, and a pointer
+ *      to the slab's first voxel
+ *  @details If the ImageIO can't stream, ITK reads the whole thing on the
+ *      first slab and the rest just come out of its buffer
+ */
+size_t ITKConverter::slab_frames() const noexcept
+{
+    const size_t framesz = sizeof (data_t) * dimension(0) * dimension(1);
+    size_t slab = (m_budget && framesz) ? m_budget / framesz : dimension(2);
+
+    return (slab) ? slab : 1;
+}
+
+
+template <class FnT>
+void ITKConverter::for_each_slab(FnT fn)
+{
+    const image_t::RegionType whole = image().GetLargestPossibleRegion();
+    const size_t slab = slab_frames();
+    image_t::RegionType region = whole;
+    image_t::IndexType first;
+    size_t k, n;
+
+    for (k = 0; k < dimension(2); k += n) {
+        n = (slab < dimension(2) - k) ? slab : dimension(2) - k;
+        region.SetIndex(2, whole.GetIndex(2) + k);
+        region.SetSize(2, n);
+        image().SetRequestedRegion(region);
+        image().Update();
+        first = region.GetIndex();
+        fn(k, n, image().GetBufferPointer() + image().ComputeOffset(first));
+    }
 }
 
 
@@ -212,27 +410,36 @@ void ITKConverter::write_strings()
 void ITKConverter::write_geometry()
 /** None of these ITK calls are noexcept... */
 {
+    const image_t::DirectionType &dir = image().GetDirection();
     std::vector<float> gfov;
-    double orient[9];
-    unsigned i;
+    std::size_t dim[3];
+    double axes[9], iop[6], ipp[3], pxsp[2];
+    unsigned i, j;
 
     for (i = 0; i < 3; i++) {
-        dimension(i) = image().GetBufferedRegion().GetSize(i);
+        dimension(i) = image().GetLargestPossibleRegion().GetSize(i);
         spacing(i) = image().GetSpacing()[i];
         origin(i) = image().GetOrigin()[i];
-        std::copy(&image().GetDirection()[i][0],
-                  &image().GetDirection()[i][3],
-                  &orient[3 * i]);
+        dim[i] = dimension(i);
+        /* ITK keeps each axis in a column */
+        for (j = 0; j < 3; j++) {
+            axes[3 * i + j] = dir[j][i];
+        }
     }
-    insert(DCM_Rows, dimension(1));
-    insert(DCM_Columns, dimension(0));
-    insert(DCM_NumberOfFrames, dimension(2));
-    insert(DCM_PixelSpacing, 2, spacing().data());
-    insert(DCM_SliceThickness, spacing(2));
-    insert(DCM_ImageOrientationPatient, 6, orient);
-    insert(DCM_ImagePositionPatient, 3, origin().data());
-    for (i = 0; i < dimension(2); i++) {
-        gfov.push_back((double)i * spacing(2));
+    m_fmt = std::make_unique<Reformat>(dim, spacing().data(), origin().data(), axes);
+    m_fmt->orientation(iop);
+    m_fmt->position(ipp);
+    pxsp[0] = m_fmt->spacing(1);
+    pxsp[1] = m_fmt->spacing(0);
+    insert(DCM_Rows, (unsigned)m_fmt->size(1));
+    insert(DCM_Columns, (unsigned)m_fmt->size(0));
+    insert(DCM_NumberOfFrames, (unsigned)m_fmt->size(2));
+    insert(DCM_PixelSpacing, 2, pxsp);
+    insert(DCM_SliceThickness, m_fmt->spacing(2));
+    insert(DCM_ImageOrientationPatient, 6, iop);
+    insert(DCM_ImagePositionPatient, 3, ipp);
+    for (i = 0; i < m_fmt->size(2); i++) {
+        gfov.push_back((double)i * m_fmt->spacing(2));
     }
     insert(DCM_FrameIncrementPointer, DCM_GridFrameOffsetVector);
     insert(DCM_GridFrameOffsetVector, gfov.size(), gfov.data());
@@ -241,14 +448,19 @@ void ITKConverter::write_geometry()
 
 void ITKConverter::write_scaling()
 {
-    using calc_t = itk::MinimumMaximumImageCalculator<image_t>;
-    calc_t::Pointer calc;
+    const data_t lowest = std::numeric_limits<data_t>::lowest();
+    const size_t framelen = (size_t)dimension(0) * dimension(1);
+    const unsigned nthreads = qagen_parallel_threads(0);
+    std::vector<data_t> maxima(nthreads, lowest);
     data_t max;
 
-    calc = calc_t::New();
-    calc->SetImage(image_ptr());
-    calc->ComputeMaximum();
-    max = calc->GetMaximum();
+    /* The true maximum, same as MinimumMaximumImageCalculator gave us */
+    for_each_slab([&](size_t, size_t nframes, const data_t *buf){
+        qagen_parallel_for(nframes, nthreads, [&](size_t k0, size_t k1, unsigned c){
+            maxima[c] = qagen_kernel_max(buf + k0 * framelen, buf + k1 * framelen, maxima[c]);
+        });
+    });
+    max = qagen_kernel_max(maxima.data(), maxima.data() + maxima.size(), lowest);
     dose_gridscaling() = max / (data_t)std::numeric_limits<pixel_t>::max();
     insert(DCM_DoseGridScaling, dose_gridscaling());
 }
@@ -263,45 +475,76 @@ void ITKConverter::write_attributes()
 }
 
 
+/** The buffer is x-fastest, so each source frame is contiguous. The reformat
+ *  reslices it onto the output grid, which for the usual identity direction
+ *  is just each frame backwards, exactly what the old GetPixel loop did. The
+ *  scale is a double, so the quantizer takes its widening vector body. The
+ *  dose statistics are tallied off each frame as it is written. With a budget,
+ *  and output frames that follow the source frames, each slab is spooled to
+ *  disk as soon as it is quantized. A reslice across frames can touch every
+ *  output frame from any slab, so then the whole output is held */
 void ITKConverter::write_pixels()
 {
-    using pxvector_t = std::vector<pixel_t>;
-    pxvector_t pixels;
-    pixel_t *ptr, *end;
-    itk::Index<3> idx;
-    OFCondition stat;
-    size_t framelen;
-
-    framelen = (size_t)dimension(0) * dimension(1);
-    pixels.resize(framelen * dimension(2));
-    end = pixels.data() + framelen;
-    for (idx[2] = 0; idx[2] < dimension(2); idx[2]++) {
-        ptr = end;
-        for (idx[1] = 0; idx[1] < dimension(1); idx[1]++) {
-            for (idx[0] = 0; idx[0] < dimension(0); idx[0]++) {
-                *--ptr = image().GetPixel(idx) / dose_gridscaling();
-            }
+    const unsigned nthreads = qagen_parallel_threads(0);
+    const double scal = dose_gridscaling();
+    const size_t outlen = m_fmt->frame_size();
+    const size_t n = outlen * m_fmt->size(2);
+    DoseTally<pixel_t> tally(nthreads);
+    const auto tally_fn = [&tally](const pixel_t *px, size_t w, size_t h, size_t ldd, unsigned c){
+        tally.add(px, w, h, ldd, c);
+    };
+    std::unique_ptr<pixel_t[]> slab;
+    std::unique_ptr<Spool> spool;
+    qagen_kernel_qerr *err;
+    pixel_t *pixels;
+
+    if (m_budget && m_fmt->in_order()) {
+        spool = std::make_unique<Spool>();
+        slab = std::make_unique<pixel_t[]>(outlen * std::min(slab_frames(), m_fmt->size(2)));
+        pixels = slab.get();
+    } else {
+        pixels = create_pixels(n);
+    }
+    err = tally.errors();
+    for_each_slab([&](size_t first, size_t nframes, const data_t *buf){
+        if (spool) {
+            m_fmt->apply(pixels, first, buf, first, nframes, scal, nthreads, err, tally_fn);
+            spool->write(pixels, nframes * outlen * sizeof (pixel_t));
+        } else {
+            m_fmt->apply(pixels, 0, buf, first, nframes, scal, nthreads, err, tally_fn);
         }
-        end += framelen;
+    });
+    if (spool) {
+        spool->insert(dataset(), n * sizeof (pixel_t));
     }
-    insert_pixels(pixels);
+    tally.finish(scal, spacing().data(), m_stats);
 }
 
 
 ITKConverter::ITKConverter()
-    noexcept
+    noexcept:
+    m_budget(0),
+    m_stats()
 {
 
 }
 
 
 ITKConverter::ITKConverter(const wchar_t *restrict img,
-                           const wchar_t *restrict tmplt)
+                           const wchar_t *restrict tmplt):
+    m_budget(0),
+    m_stats()
 {
     initialize(img, tmplt);
 }
 
 
+ITKConverter::~ITKConverter()
+{
+
+}
+
+
 void ITKConverter::initialize(const wchar_t *restrict img,
                               const wchar_t *restrict tmplt)
 {
@@ -325,4 +568,5 @@ void ITKConverter::write(const wchar_t *path)
     if (stat.bad()) {
         throw Exception(stat, L"Cannot save DICOM file to disk");
     }
+    qagen_stats_write(&m_stats, path);
 }
@@ -6,6 +6,7 @@
 #define QAGEN_IMG2DCM_H
 
 #include "qagen-defs.h"
+#include "qagen-stats.h"
 
 EXTERN_C_START
 
@@ -17,10 +18,15 @@ EXTERN_C_START
  *      Output DICOM path
  *  @param tmplt
  *      Template DICOM file to be used
+ *  @param budget
+ *      Bytes of source image to hold at once. The image is read in slabs of
+ *      whole frames that fit in this, where the ImageIO can stream. Zero
+ *      reads the whole image at once
  */
 int qagen_img2dcm_convert(const wchar_t *restrict img,
                           const wchar_t *restrict dcm,
-                          const wchar_t *restrict tmplt);
+                          const wchar_t *restrict tmplt,
+                          size_t                  budget);
 
 
 EXTERN_C_END
@@ -28,9 +34,12 @@ EXTERN_C_END
 #if defined(__cplusplus) && __cplusplus
 
 #include <array>
+#include <memory>
 #include <dcmtk/dcmdata/dcfilefo.h>
 #include <itkImage.h>
+#include <itkProcessObject.h>
 
+class Reformat;
 
 class ITKConverter {
 public:
@@ -51,20 +60,36 @@ public:
 
         /* DICOM attribute insertion failure */
         Exception(const DcmTagKey &key, OFCondition stat) noexcept;
+
+        /* C runtime error, from errno */
+        Exception(int errnum, const wchar_t *ctx) noexcept;
+
+        /* Win32 error, from GetLastError() */
+        Exception(DWORD dwerr, const wchar_t *ctx) noexcept;
     };
 
 private:
+    class Spool;    /* Temp file of quantized slabs */
+
     using pixel_t = Uint16;
     using data_t = float;
     using image_t = itk::Image<data_t, 3>;
     image_t::Pointer m_img;
     DcmFileFormat    m_dcfile;
 
+    itk::ProcessObject::Pointer m_reader;   /* The image only holds a weak
+                                            reference to its source */
+    size_t m_budget;    /* Source bytes per slab, zero for everything */
+
     std::array<unsigned, 3> m_dim;
     std::array<double, 3> m_res, m_org;
 
     double m_dgs;
 
+    std::unique_ptr<Reformat> m_fmt;    /* Output grid, set by write_geometry */
+
+    struct qagen_dose_stats m_stats;    /* Of the output, set by write_pixels */
+
 
     /** These are marked noexcept in spite of the dereference operator's
      *  disposition to throw if the target pointer is NULL. Do not misuse these
@@ -105,12 +130,22 @@ private:
     void insert(const DcmTagKey &tag, const char *val);
     void insert(const DcmTagKey &tag, const DcmTagKey &val);
 
-    void insert_pixels(const std::vector<pixel_t> &px);
+    /** @brief Creates PixelData for @p n pixels and returns its buffer, which
+     *  is owned by the dataset. Fill it in place */
+    pixel_t *create_pixels(size_t n);
 
-    /** Catch ITK's polymorphic exception from this, if it even throws, idk
+    /** Catch ITK's polymorphic exception from this, if it even throws, idk.
+     *  This only reads the image information, the voxels are pulled through
+     *  slab by slab with for_each_slab
      */
     void load_image(const wchar_t *path);
 
+    /** @brief Frames per slab, as set by the budget */
+    size_t slab_frames() const noexcept;
+
+    template <class FnT>
+    void for_each_slab(FnT fn);
+
     /** This uses DCMTK, don't catch from this */
     void load_template(const wchar_t *path);
 
@@ -125,9 +160,16 @@ private:
 public:
     ITKConverter() noexcept;
     ITKConverter(const wchar_t *restrict img, const wchar_t *restrict tmplt);
+    ~ITKConverter();
+
+    /** @brief Sets the slab budget in bytes. Call this before initialize.
+     *      Unless the image has to be resliced across frames, the quantized
+     *      pixels are spooled to a temp file a slab at a time too, so nothing
+     *      ever holds the whole volume */
+    void set_budget(size_t budget) noexcept { m_budget = budget; }
 
 
-    /** @brief Convert to a DICOM dataset in memory
+    /** @brief Convert to a DICOM dataset, in memory or spooled
      *  @param img
      *      Path to ITK-readable image file
      *  @param tmplt
@@ -136,7 +178,7 @@ public:
     void initialize(const wchar_t *restrict img, const wchar_t *restrict tmplt);
 
 
-    /** @brief Flush the dataset to disk
+    /** @brief Flush the dataset to disk, with its dose statistics next to it
      *  @param path
      *      Path to write the dataset to
      */
@@ -0,0 +1,144 @@
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "qagen-jpls.h"
+#include "qagen-metaio.h"
+#include "qagen-parallel.h"
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcpixel.h>
+#include <dcmtk/dcmdata/dcpixseq.h>
+#include <dcmtk/dcmdata/dcpxitem.h>
+#include <dcmtk/dcmjpls/djencode.h>
+#include <dcmtk/dcmjpls/djrparam.h>
+
+
+/** Lossless, so the near-lossless deviation is unused */
+static const DJLSRepresentationParameter jpls_lossless(0, OFTrue);
+
+
+/** @brief Registers the encoder the first time it is needed. DCMTK locks its
+ *      codec list, so the frames can all look it up at once after this
+ */
+static void jpls_register()
+{
+    static std::once_flag once;
+
+    std::call_once(once, []{ DJLSEncoderRegistration::registerCodecs(); });
+}
+
+
+/** @brief Encodes one frame as a single-frame dataset, and takes its fragments
+ *  @param frame
+ *      Native pixels, @p cols * @p rows of them
+ *  @param[out] frags
+ *      The frame's fragments, now owned by the caller
+ *  @returns DCMTK's status. This runs on a pool thread, so it must not throw
+ */
+static OFCondition jpls_encode_frame(const Uint16 *frame, std::size_t cols,
+                                     std::size_t rows, std::vector<DcmPixelItem *> &frags)
+{
+    DcmDataset tmp;
+    DcmPixelSequence *seq = nullptr;
+    DcmElement *elem = nullptr;
+    DcmPixelItem *item = nullptr;
+    OFCondition stat;
+
+    stat = tmp.putAndInsertUint16(DCM_SamplesPerPixel, 1);
+    if (stat.good()) {
+        stat = tmp.putAndInsertString(DCM_PhotometricInterpretation, "MONOCHROME2");
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_Rows, static_cast<Uint16>(rows));
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_Columns, static_cast<Uint16>(cols));
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_BitsAllocated, 16);
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_BitsStored, 16);
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_HighBit, 15);
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16(DCM_PixelRepresentation, 0);
+    }
+    if (stat.good()) {
+        stat = tmp.putAndInsertUint16Array(DCM_PixelData, frame, static_cast<unsigned long>(cols * rows));
+    }
+    if (stat.good()) {
+        stat = tmp.chooseRepresentation(EXS_JPEGLSLossless, &jpls_lossless);
+    }
+    if (stat.good()) {
+        stat = tmp.findAndGetElement(DCM_PixelData, elem);
+    }
+    if (stat.good()) {
+        stat = static_cast<DcmPixelData *>(elem)->getEncapsulatedRepresentation(EXS_JPEGLSLossless,
+                                                                                &jpls_lossless, seq);
+    }
+    /* Item 0 is the single-frame offset table, which is not needed */
+    while (stat.good() && seq->card() > 1) {
+        stat = seq->remove(item, 1);
+        if (stat.good()) {
+            frags.push_back(item);
+        }
+    }
+    return stat;
+}
+
+
+void qagen_jpls_insert(DcmDataset *dset, const Uint16 *pixels, std::size_t cols,
+                       std::size_t rows, std::size_t frames, unsigned nthreads)
+{
+    const std::size_t framelen = cols * rows;
+    std::vector<std::vector<DcmPixelItem *>> frags(frames);
+    std::vector<OFCondition> status(frames);
+    std::vector<Uint32> offsets(frames);
+    std::unique_ptr<DcmPixelSequence> seq;
+    DcmPixelItem *table;
+    DcmPixelData *px;
+    OFCondition stat;
+    std::size_t pos = 0, k;
+
+    jpls_register();
+    qagen_parallel_for(frames, nthreads, [&](std::size_t k0, std::size_t k1, unsigned){
+        for (std::size_t k = k0; k < k1; k++) {
+            status[k] = jpls_encode_frame(pixels + k * framelen, cols, rows, frags[k]);
+        }
+    });
+
+    /* Everything goes into the sequence first, so that it owns every fragment
+    even if a frame failed */
+    seq = std::make_unique<DcmPixelSequence>(DcmTag(DCM_PixelData, EVR_OB));
+    table = new DcmPixelItem(DcmTag(DCM_Item, EVR_OB));
+    seq->insert(table);
+    for (k = 0; k < frames; k++) {
+        offsets[k] = static_cast<Uint32>(pos);
+        for (DcmPixelItem *item : frags[k]) {
+            pos += 8 + item->getLength();   /* Item tag and length */
+            seq->insert(item);
+        }
+    }
+    for (k = 0; k < frames; k++) {
+        if (status[k].bad()) {
+            throw MHDConverter::Exception(status[k], L"Cannot encode frame %zu as JPEG-LS", k);
+        }
+    }
+    if (pos > 0xffffffff) {
+        throw MHDConverter::Exception(L"Encoded pixel data is too large for an offset table: %zu bytes", pos);
+    }
+    /* The table is little endian, like the host */
+    stat = table->putUint8Array(reinterpret_cast<const Uint8 *>(offsets.data()),
+                                static_cast<unsigned long>(frames * sizeof (Uint32)));
+    MHDConverter::Exception::ofcheck(stat, L"Failed to write the JPEG-LS offset table");
+
+    px = new DcmPixelData(DCM_PixelData);
+    px->putOriginalRepresentation(EXS_JPEGLSLossless, &jpls_lossless, seq.release());
+    stat = dset->insert(px, true);
+    if (stat.bad()) {
+        delete px;
+    }
+    MHDConverter::Exception::ofcheck(stat, L"Failed to set the JPEG-LS pixel data");
+}
@@ -0,0 +1,43 @@
+#pragma once
+/** @file Encapsulates RTDose pixels as JPEG-LS lossless, a frame at a time
+ *
+ *  DCMTK's own chooseRepresentation() encodes every frame of a dataset on one
+ *  thread. Here each frame is handed to the dcmjpls codec as a dataset of its
+ *  own, the frames are encoded across the thread pool, and their fragments
+ *  are moved into a single pixel sequence in frame order, with a basic offset
+ *  table so that viewers can decode any one frame by itself
+ */
+#ifndef QAGEN_JPLS_H
+#define QAGEN_JPLS_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstddef>
+#include <dcmtk/dcmdata/dcdatset.h>
+
+
+/** @brief Inserts @p pixels into @p dset as JPEG-LS lossless PixelData, one
+ *      fragment per frame
+ *  @param dset
+ *      Output dataset. Save it with EXS_JPEGLSLossless
+ *  @param pixels
+ *      Native pixels, @p cols * @p rows * @p frames of them
+ *  @param cols
+ *      Columns
+ *  @param rows
+ *      Rows
+ *  @param frames
+ *      Number of frames
+ *  @param nthreads
+ *      Frames encoded at once
+ *  @throws MHDConverter::Exception if any frame cannot be encoded
+ */
+void qagen_jpls_insert(DcmDataset *dset, const Uint16 *pixels, std::size_t cols,
+                       std::size_t rows, std::size_t frames, unsigned nthreads);
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_JPLS_H */
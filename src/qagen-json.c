@@ -10,6 +10,7 @@
 
 #define PT_KEY_ISO    "isocenter"
 #define PT_KEY_FIELDS "fields"
+#define PT_KEY_DOSE   "dose"
 
 /** json-c provides no evident error-handling mechanisms, so I log verbosely
  *  from this file
@@ -237,30 +238,36 @@ static json_object *qagen_json_make(const struct qagen_patient *pt)
 }
 
 
-int qagen_json_write(const struct qagen_patient *pt, const wchar_t *filename)
+/** @brief Writes @p root to @p filename and releases it. Failure is only
+ *      logged
+ */
+static void qagen_json_save(json_object *root, const wchar_t *filename)
 {
-    static const wchar_t *failmsg = L"Failed to open JSON file for writing";
     const int jflags = JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED;
-    int res = 0;
-    json_object *root;
     FILE *fp;
 
+    fp = _wfopen(filename, L"w");
+    if (fp) {
+        fputs(json_object_to_json_string_ext(root, jflags), fp);
+        fclose(fp);
+    } else {
+        qagen_log_printf(QAGEN_LOG_ERROR, L"Could not _wfopen %s: %s", filename, _wcserror(errno));
+    }
+    json_object_put(root);
+}
+
+
+int qagen_json_write(const struct qagen_patient *pt, const wchar_t *filename)
+{
+    json_object *root;
+
     root = qagen_json_make(pt);
     if (root) {
-        fp = _wfopen(filename, L"w");
-        if (fp) {
-            fputs(json_object_to_json_string_ext(root, jflags), fp);
-            json_object_put(root);
-            fclose(fp);
-        } else {
-            qagen_log_printf(QAGEN_LOG_ERROR, L"Could not _wfopen %s: %s", filename, _wcserror(errno));
-            /* qagen_error_raise(QAGEN_ERR_SYSTEM, NULL, failmsg); */
-            /* res = 1; */
-        }
+        qagen_json_save(root, filename);
     } else {
         qagen_log_puts(QAGEN_LOG_ERROR, L"Attempt to build JSON failed");
     }
-    return res;
+    return 0;
 }
 
 
@@ -331,11 +338,14 @@ static char *qagen_json_load_file(const wchar_t *filename)
 
     hfile = qagen_json_get_handle(filename, &len);
     if (hfile != INVALID_HANDLE_VALUE) {
-        res = qagen_malloc(sizeof *res * len);
+        /* The tokener wants a terminated string */
+        res = qagen_malloc(sizeof *res * (len + 1));
         if (res) {
             if (!ReadFile(hfile, res, (DWORD)len, &(DWORD){ 0 }, NULL)) {
                 qagen_error_raise(QAGEN_ERR_WIN32, NULL, failmsg);
                 qagen_ptr_nullify(&res, qagen_free);
+            } else {
+                res[len] = '\0';
             }
         }
         CloseHandle(hfile);
@@ -609,3 +619,72 @@ int qagen_json_read(struct qagen_patient *pt, const wchar_t *filename)
     }
     return res;
 }
+
+
+/** @brief Adds @p stats[i] to field i of @p root
+ *  @returns Nonzero if the fields array is missing, or a node cannot be added
+ */
+static int qagen_json_set_dose(json_object                          *root,
+                               const struct qagen_dose_stats *const *stats,
+                               size_t                                n)
+{
+    json_object *fields, *field, *node;
+    char buf[1024];
+    size_t i, nfields;
+
+    if (!json_object_object_get_ex(root, PT_KEY_FIELDS, &fields)
+     || !json_object_is_type(fields, json_type_array)) {
+        qagen_log_puts(QAGEN_LOG_ERROR, L"JSON has no field array to add dose statistics to");
+        return 1;
+    }
+    nfields = json_object_array_length(fields);
+    if (nfields < n) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"JSON has %zu fields, but there are dose statistics for %zu", nfields, n);
+        n = nfields;
+    }
+    for (i = 0; i < n; i++) {
+        field = json_object_array_get_idx(fields, i);
+        if (!stats[i] || !json_object_is_type(field, json_type_object)) {
+            continue;
+        }
+        if (qagen_stats_format(buf, BUFLEN(buf), stats[i]) >= BUFLEN(buf)) {
+            qagen_log_printf(QAGEN_LOG_ERROR, L"Dose statistics of field %zu do not fit their buffer", i);
+            return 1;
+        }
+        node = json_tokener_parse(buf);
+        if (!node || json_object_object_add(field, PT_KEY_DOSE, node) < 0) {
+            qagen_log_printf(QAGEN_LOG_ERROR, L"Failed adding dose statistics to field %zu", i);
+            json_object_put(node);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int qagen_json_add_dose(const wchar_t                        *filename,
+                        const struct qagen_dose_stats *const *stats,
+                        size_t                                n)
+{
+    enum json_tokener_error jerr;
+    json_object *root;
+    char *jbuf;
+
+    jbuf = qagen_json_load_file(filename);
+    if (!jbuf) {
+        qagen_log_printf(QAGEN_LOG_ERROR, L"Could not read %s to add dose statistics", filename);
+        /* Not fatal, so don't leave it raised */
+        qagen_error_raise(QAGEN_ERR_NONE, NULL, NULL);
+        return 0;
+    }
+    root = json_tokener_parse_verbose(jbuf, &jerr);
+    qagen_free(jbuf);
+    if (!root) {
+        qagen_log_printf(QAGEN_LOG_ERROR, L"Could not parse JSON to add dose statistics: %S", json_tokener_error_desc(jerr));
+    } else if (qagen_json_set_dose(root, stats, n)) {
+        json_object_put(root);
+    } else {
+        qagen_json_save(root, filename);
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 
 #include "qagen-defs.h"
 #include "qagen-patient.h"
+#include "qagen-stats.h"
 
 
 /** @brief Writes patient information to a JSON file
@@ -33,4 +34,22 @@ int qagen_json_write(const struct qagen_patient *pt, const wchar_t *filename);
 int qagen_json_read(struct qagen_patient *pt, const wchar_t *filename);
 
 
+/** @brief Adds dose statistics to the fields of an existing JSON file, under
+ *      the key "dose", and rewrites it
+ *  @param filename
+ *      Path to JSON, as written by qagen_json_write or the RS QA script
+ *  @param stats
+ *      Array of @p n statistics, one for each field in order. NULL entries are
+ *      left out
+ *  @param n
+ *      Number of entries in @p stats
+ *  @returns Nonzero on error
+ *  @note Like qagen_json_write, this always returns zero. The statistics are
+ *      in each Dose_Beam's sidecar anyway
+ */
+int qagen_json_add_dose(const wchar_t                        *filename,
+                        const struct qagen_dose_stats *const *stats,
+                        size_t                                n);
+
+
 #endif /* QAGEN_PATIENT_JSON_H */
@@ -0,0 +1,1399 @@
+#pragma once
+/** @file Vectorized pixel kernels used by the RTDose converters
+ *
+ *  The converters quantize floating-point dose onto an unsigned integer grid,
+ *  reorienting each frame as they go (usually that just means writing it
+ *  backwards). These kernels do that in one sweep over the source, with
+ *  AVX2/SSE4/NEON bodies and a scalar fallback
+ *
+ *  Every kernel in here must produce the *exact* same bits as the scalar
+ *  expression static_cast<PixelT>(x / scal). Our regression baselines were
+ *  made that way, and I am not regenerating them. The vector bodies multiply
+ *  by the reciprocal, and any lane that lands close enough to an integer that
+ *  the rounding could differ is recomputed with a real division. With a double
+ *  scale (the ITK path) they widen to double and divide outright, which is
+ *  the scalar expression lane for lane
+ *
+ *  qagen_kernel_tally() reads the quantized pixels back for the dose
+ *  statistics, straight after they are written. qagen_kernel_dequantize_flip()
+ *  goes the other way for dcm2mhd
+ *
+ *  The quantizers can also measure the quantization error as they go, from
+ *  the quotients they already hold in registers. The vector bodies take the
+ *  residual q - trunc(q) and its ratio to q through the approximate
+ *  reciprocal, so measuring adds no division and no second read
+ */
+#ifndef QAGEN_KERNEL_H
+#define QAGEN_KERNEL_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+#if defined(__AVX2__)
+#   define QAGEN_KERNEL_AVX2 1
+#   include <immintrin.h>
+#elif defined(__SSE4_1__) || defined(__AVX__) || defined(QAGEN_KERNEL_FORCE_SSE4)
+#   define QAGEN_KERNEL_SSE4 1
+#   include <smmintrin.h>
+#elif (defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64)
+#   define QAGEN_KERNEL_NEON 1
+#   include <arm_neon.h>
+#endif
+
+
+/** Relative distance from an integer, below which a lane is recomputed by
+ *  division. The reciprocal product is within 3 ulp of the true quotient, so
+ *  this leaves a generous margin */
+#define QAGEN_KERNEL_GUARD 0x1p-20f
+
+
+/** Relative error bound of the approximate reciprocals used for relative
+ *  quantization errors. Vector lanes are scaled up by this, so that what they
+ *  report is never below the true error */
+#define QAGEN_KERNEL_RCP_ERROR 0x1p-11
+
+
+/** Edge of the square tiles qagen_kernel_reformat() gathers through. A tile
+ *  of doubles is 8 KiB, so source and tile both stay in L1 */
+#define QAGEN_KERNEL_TILE 32
+
+
+/** Running quantization error of one chunk of frames. Keep one per thread */
+struct alignas(64) qagen_kernel_qerr {
+    double floor;       /* Relative errors only count for quotients above this
+                        many steps, tiny doses would swamp them */
+    double max_abs;     /* Largest error, in pixel steps */
+    double max_rel;     /* Largest error relative to its source value */
+};
+
+
+/** @brief Folds @p n lanes of vector error accumulators into @p err */
+template <class T>
+inline void qagen_kernel_qerr_fold(qagen_kernel_qerr &err, const T *amax, const T *rmax, std::size_t n)
+{
+    double r;
+
+    for (std::size_t i = 0; i < n; i++) {
+        r = (double)rmax[i] * (1.0 + QAGEN_KERNEL_RCP_ERROR);
+        err.max_abs = (err.max_abs < amax[i]) ? (double)amax[i] : err.max_abs;
+        err.max_rel = (err.max_rel < r) ? r : err.max_rel;
+    }
+}
+
+
+/** @brief The reference quantizer. All kernels must agree with this bit for bit
+ *  @param x
+ *      Source value
+ *  @param scal
+ *      Grid scaling, i.e. the value of one pixel step
+ *  @returns The quantized pixel
+ */
+template <class DataT, class ScaleT, class PixelT>
+inline PixelT qagen_kernel_quantize1(DataT x, ScaleT scal)
+{
+    return static_cast<PixelT>(x / scal);
+}
+
+
+/** @brief Scalar max, with the semantics of std::max(res, x) applied in order.
+ *      NaNs are skipped
+ */
+template <class DataT>
+inline DataT qagen_kernel_max_scalar(const DataT *d0, const DataT *d1, DataT res)
+{
+    for (; d0 < d1; d0++) {
+        res = (res < *d0) ? *d0 : res;
+    }
+    return res;
+}
+
+
+/** @brief Scalar min, the mirror image of qagen_kernel_max_scalar() */
+template <class DataT>
+inline DataT qagen_kernel_min_scalar(const DataT *d0, const DataT *d1, DataT res)
+{
+    for (; d0 < d1; d0++) {
+        res = (*d0 < res) ? *d0 : res;
+    }
+    return res;
+}
+
+
+/** @brief Scalar qagen_kernel_max_min() */
+template <class DataT>
+inline DataT qagen_kernel_max_min_scalar(const DataT *d0, const DataT *d1, DataT res, DataT &min, bool &nan)
+{
+    DataT lo = min;
+    bool un = false;
+
+    for (; d0 < d1; d0++) {
+        res = (res < *d0) ? *d0 : res;
+        lo = (*d0 < lo) ? *d0 : lo;
+        un |= *d0 != *d0;
+    }
+    min = lo;
+    nan |= un;
+    return res;
+}
+
+
+/** @brief Scalar quantize/flip of a single frame
+ *  @param err
+ *      If not nullptr, accumulates the quantization error of the frame
+ */
+template <class DataT, class ScaleT, class PixelT>
+inline void qagen_kernel_qflip_scalar(PixelT            *dst,
+                                      const DataT       *src,
+                                      std::size_t        framelen,
+                                      ScaleT             scal,
+                                      qagen_kernel_qerr *err = nullptr)
+{
+    const DataT *sptr = src + framelen;
+    double q, e, a, re = 0.0, rq = 1.0;
+
+    if (!err) {
+        for (std::size_t j = 0; j < framelen; j++) {
+            dst[j] = qagen_kernel_quantize1<DataT, ScaleT, PixelT>(*--sptr, scal);
+        }
+        return;
+    }
+    a = err->max_abs;
+    for (std::size_t j = 0; j < framelen; j++) {
+        /* The same quotient the reference quantizer truncates */
+        const auto x = *--sptr / scal;
+
+        dst[j] = static_cast<PixelT>(x);
+        q = (double)x;
+        e = q - (double)dst[j];
+        a = (a < e) ? e : a;
+        /* e / q > re / rq, cross-multiplied so the run divides only once */
+        if (q > err->floor && e * rq > re * q) {
+            re = e;
+            rq = q;
+        }
+    }
+    err->max_abs = a;
+    e = re / rq;
+    err->max_rel = (err->max_rel < e) ? e : err->max_rel;
+}
+
+
+/** @brief Scalar dequantize/flip of a single frame */
+template <class PixelT>
+inline void qagen_kernel_dqflip_scalar(float        *dst,
+                                       const PixelT *src,
+                                       std::size_t   framelen,
+                                       float         scal)
+{
+    const PixelT *sptr = src + framelen;
+
+    for (std::size_t j = 0; j < framelen; j++) {
+        dst[j] = static_cast<float>(*--sptr) * scal;
+    }
+}
+
+
+/** @brief Counts the NaN, infinite and negative values in [@p d, @p d + @p n).
+ *      None of them can be quantized. This is the slow path, for when
+ *      qagen_kernel_max_min() has already found some
+ *  @param[in,out] nonfinite
+ *      NaN and infinity count
+ *  @param[in,out] negative
+ *      Negative count
+ *  @param[in,out] min
+ *      Smallest finite value seen. Start this at zero
+ */
+template <class DataT>
+inline void qagen_kernel_invalid(const DataT *d, std::size_t n, std::size_t &nonfinite,
+                                 std::size_t &negative, DataT &min)
+{
+    std::size_t nf = 0, neg = 0;
+    DataT lo = min;
+
+    if constexpr (!std::is_unsigned_v<DataT>) {
+        for (std::size_t i = 0; i < n; i++) {
+            if constexpr (std::is_floating_point_v<DataT>) {
+                /* x - x is NaN for both NaN and infinity */
+                if (!(d[i] - d[i] == 0)) {
+                    nf++;
+                    continue;
+                }
+            }
+            neg += d[i] < 0;
+            lo = (d[i] < lo) ? d[i] : lo;
+        }
+    }
+    nonfinite += nf;
+    negative += neg;
+    min = lo;
+}
+
+
+/** @brief Scalar search for the first value in [@p d, @p d + @p n) above
+ *      @p thresh. NaNs never match
+ */
+template <class DataT>
+inline std::size_t qagen_kernel_first_above_scalar(const DataT *d, std::size_t n, DataT thresh)
+{
+    std::size_t i;
+
+    for (i = 0; i < n && !(d[i] > thresh); i++);
+    return i;
+}
+
+
+/** @brief Scalar search for the last value above @p thresh, or @p n if none */
+template <class DataT>
+inline std::size_t qagen_kernel_last_above_scalar(const DataT *d, std::size_t n, DataT thresh)
+{
+    std::size_t i;
+
+    for (i = n; i > 0; i--) {
+        if (d[i - 1] > thresh) {
+            return i - 1;
+        }
+    }
+    return n;
+}
+
+
+/** @brief Bit index helpers for movemask results, which are never zero when
+ *      these are called */
+inline unsigned qagen_kernel_ctz(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (unsigned)idx;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+
+inline unsigned qagen_kernel_msb(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanReverse(&idx, mask);
+    return (unsigned)idx;
+#else
+    return 31u - (unsigned)__builtin_clz(mask);
+#endif
+}
+
+
+/** @brief Recomputes a block of @p n reversed lanes by division. This is the
+ *      slow path for blocks that contain a lane near an integer boundary
+ *  @param dst
+ *      First output pixel of the block
+ *  @param end
+ *      One past the last source value of the block (the block is reversed)
+ */
+template <class PixelT>
+inline void qagen_kernel_fixup_f32(PixelT *dst, const float *end, std::size_t n, float scal,
+                                   qagen_kernel_qerr *err = nullptr)
+{
+    qagen_kernel_qflip_scalar(dst, end - n, n, scal, err);
+}
+
+
+#if QAGEN_KERNEL_AVX2
+
+inline float qagen_kernel_max_f32(const float *d0, const float *d1, float init)
+{
+    __m256 acc0 = _mm256_set1_ps(init), acc1 = acc0;
+    alignas(32) float lane[8];
+    float res;
+
+    for (; d1 - d0 >= 16; d0 += 16) {
+        /* Source operand second: maxps returns it when the first is NaN */
+        acc0 = _mm256_max_ps(_mm256_loadu_ps(d0), acc0);
+        acc1 = _mm256_max_ps(_mm256_loadu_ps(d0 + 8), acc1);
+    }
+    _mm256_store_ps(lane, _mm256_max_ps(acc0, acc1));
+    res = qagen_kernel_max_scalar(lane, lane + 8, init);
+    return qagen_kernel_max_scalar(d0, d1, res);
+}
+
+
+inline float qagen_kernel_max_min_f32(const float *d0, const float *d1, float init, float &min, bool &nan)
+{
+    __m256 hi0 = _mm256_set1_ps(init), hi1 = hi0;
+    __m256 lo0 = _mm256_set1_ps(min), lo1 = lo0;
+    __m256 un = _mm256_setzero_ps(), x0, x1;
+    alignas(32) float hi[8], lo[8];
+    float res;
+
+    for (; d1 - d0 >= 16; d0 += 16) {
+        x0 = _mm256_loadu_ps(d0);
+        x1 = _mm256_loadu_ps(d0 + 8);
+        hi0 = _mm256_max_ps(x0, hi0);
+        hi1 = _mm256_max_ps(x1, hi1);
+        lo0 = _mm256_min_ps(x0, lo0);
+        lo1 = _mm256_min_ps(x1, lo1);
+        /* Unordered if either of them is NaN */
+        un = _mm256_or_ps(un, _mm256_cmp_ps(x0, x1, _CMP_UNORD_Q));
+    }
+    _mm256_store_ps(hi, _mm256_max_ps(hi0, hi1));
+    _mm256_store_ps(lo, _mm256_min_ps(lo0, lo1));
+    nan |= _mm256_movemask_ps(un) != 0;
+    res = qagen_kernel_max_scalar(hi, hi + 8, init);
+    min = qagen_kernel_min_scalar(lo, lo + 8, min);
+    return qagen_kernel_max_min_scalar(d0, d1, res, min, nan);
+}
+
+
+/** Lane-wise quantization error of one run, folded into a qagen_kernel_qerr
+ *  at the end of it */
+struct qagen_kernel_qacc_ps {
+    __m256 amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_ps(double f) noexcept:
+        amax(_mm256_setzero_ps()), rmax(amax), floor(_mm256_set1_ps((float)f)) { }
+
+    /** @brief Adds the quotients @p q, every one of which truncates to its
+     *      pixel
+     */
+    void add(__m256 q) noexcept
+    {
+        const __m256 frac = _mm256_sub_ps(q, _mm256_round_ps(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        const __m256 above = _mm256_cmp_ps(q, floor, _CMP_GT_OQ);
+
+        amax = _mm256_max_ps(amax, frac);
+        rmax = _mm256_max_ps(rmax, _mm256_and_ps(above, _mm256_mul_ps(frac, _mm256_rcp_ps(q))));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        alignas(32) float a[8], r[8];
+
+        _mm256_store_ps(a, amax);
+        _mm256_store_ps(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 8);
+    }
+};
+
+
+/** qagen_kernel_qacc_ps, for double quotients */
+struct qagen_kernel_qacc_pd {
+    __m256d amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_pd(double f) noexcept:
+        amax(_mm256_setzero_pd()), rmax(amax), floor(_mm256_set1_pd(f)) { }
+
+    void add(__m256d q) noexcept
+    {
+        const __m256d frac = _mm256_sub_pd(q, _mm256_round_pd(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        const __m256d above = _mm256_cmp_pd(q, floor, _CMP_GT_OQ);
+        const __m256d rcp = _mm256_cvtps_pd(_mm_rcp_ps(_mm256_cvtpd_ps(q)));
+
+        amax = _mm256_max_pd(amax, frac);
+        rmax = _mm256_max_pd(rmax, _mm256_and_pd(above, _mm256_mul_pd(frac, rcp)));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        alignas(32) double a[4], r[4];
+
+        _mm256_store_pd(a, amax);
+        _mm256_store_pd(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 4);
+    }
+};
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32_u16(std::uint16_t     *dst,
+                                       const float       *src,
+                                       std::size_t        framelen,
+                                       float              scal,
+                                       qagen_kernel_qerr *err)
+{
+    const __m256 rcp = _mm256_set1_ps(1.0f / scal);
+    const __m256 guard = _mm256_set1_ps(QAGEN_KERNEL_GUARD);
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256i lo16 = _mm256_set1_epi32(0xffff);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_ps acc((Measure) ? err->floor : 0.0);
+    std::size_t j;
+    __m256 x, q, dist, lim;
+    __m256i qi;
+    __m128i px;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        x = _mm256_loadu_ps(end - 8);
+        q = _mm256_mul_ps(x, rcp);
+        dist = _mm256_sub_ps(q, _mm256_round_ps(q, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        dist = _mm256_and_ps(dist, absmask);
+        lim = _mm256_mul_ps(_mm256_and_ps(q, absmask), guard);
+        if (_mm256_movemask_ps(_mm256_cmp_ps(dist, lim, _CMP_LT_OQ))) {
+            qagen_kernel_fixup_f32(dst + j, end, 8, scal, err);
+            continue;
+        }
+        if constexpr (Measure) {
+            acc.add(q);
+        }
+        /* cvttps2dq then keep the low word, same as the scalar cast */
+        qi = _mm256_and_si256(_mm256_cvttps_epi32(q), lo16);
+        px = _mm_packus_epi32(_mm256_castsi256_si128(qi),
+                              _mm256_extracti128_si256(qi, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                         _mm_shuffle_epi8(px, rev));
+    }
+    qagen_kernel_fixup_f32(dst + j, end, framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+
+/** @brief Quantizes four floats by a double scale, keeping the low words */
+template <bool Measure>
+inline __m128i qagen_kernel_q4d_avx2(__m128 x, __m256d s, qagen_kernel_qacc_pd &acc)
+{
+    const __m256d q = _mm256_div_pd(_mm256_cvtps_pd(x), s);
+
+    if constexpr (Measure) {
+        acc.add(q);
+    }
+    return _mm_and_si128(_mm256_cvttpd_epi32(q), _mm_set1_epi32(0xffff));
+}
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32d_u16(std::uint16_t     *dst,
+                                        const float       *src,
+                                        std::size_t        framelen,
+                                        double             scal,
+                                        qagen_kernel_qerr *err)
+{
+    const __m256d s = _mm256_set1_pd(scal);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_pd acc((Measure) ? err->floor : 0.0);
+    std::size_t j;
+    __m128i lo, hi;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        lo = qagen_kernel_q4d_avx2<Measure>(_mm_loadu_ps(end - 8), s, acc);
+        hi = qagen_kernel_q4d_avx2<Measure>(_mm_loadu_ps(end - 4), s, acc);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                         _mm_shuffle_epi8(_mm_packus_epi32(lo, hi), rev));
+    }
+    qagen_kernel_qflip_scalar(dst + j, end - (framelen - j), framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+inline std::size_t qagen_kernel_first_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const __m256 t = _mm256_set1_ps(thresh);
+    std::size_t i;
+    int mask;
+
+    for (i = 0; n - i >= 8; i += 8) {
+        mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(d + i), t, _CMP_GT_OQ));
+        if (mask) {
+            return i + qagen_kernel_ctz((unsigned)mask);
+        }
+    }
+    return i + qagen_kernel_first_above_scalar(d + i, n - i, thresh);
+}
+
+
+inline std::size_t qagen_kernel_last_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const __m256 t = _mm256_set1_ps(thresh);
+    std::size_t i, tail = n % 8;
+    int mask;
+
+    i = qagen_kernel_last_above_scalar(d + n - tail, tail, thresh);
+    if (i < tail) {
+        return n - tail + i;
+    }
+    for (i = n - tail; i >= 8; i -= 8) {
+        mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(d + i - 8), t, _CMP_GT_OQ));
+        if (mask) {
+            return i - 8 + qagen_kernel_msb((unsigned)mask);
+        }
+    }
+    return n;
+}
+
+inline void qagen_kernel_dqflip_u16(float               *dst,
+                                    const std::uint16_t *src,
+                                    std::size_t          framelen,
+                                    float                scal)
+{
+    const __m256 s = _mm256_set1_ps(scal);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const std::uint16_t *end = src + framelen;
+    std::size_t j;
+    __m128i px;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        px = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(end - 8)), rev);
+        _mm256_storeu_ps(dst + j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(px)), s));
+    }
+    qagen_kernel_dqflip_scalar(dst + j, end - (framelen - j), framelen - j, scal);
+}
+
+#elif QAGEN_KERNEL_SSE4
+
+inline float qagen_kernel_max_f32(const float *d0, const float *d1, float init)
+{
+    __m128 acc0 = _mm_set1_ps(init), acc1 = acc0;
+    alignas(16) float lane[4];
+    float res;
+
+    for (; d1 - d0 >= 8; d0 += 8) {
+        /* Source operand second: maxps returns it when the first is NaN */
+        acc0 = _mm_max_ps(_mm_loadu_ps(d0), acc0);
+        acc1 = _mm_max_ps(_mm_loadu_ps(d0 + 4), acc1);
+    }
+    _mm_store_ps(lane, _mm_max_ps(acc0, acc1));
+    res = qagen_kernel_max_scalar(lane, lane + 4, init);
+    return qagen_kernel_max_scalar(d0, d1, res);
+}
+
+
+inline float qagen_kernel_max_min_f32(const float *d0, const float *d1, float init, float &min, bool &nan)
+{
+    __m128 hi0 = _mm_set1_ps(init), hi1 = hi0;
+    __m128 lo0 = _mm_set1_ps(min), lo1 = lo0;
+    __m128 un = _mm_setzero_ps(), x0, x1;
+    alignas(16) float hi[4], lo[4];
+    float res;
+
+    for (; d1 - d0 >= 8; d0 += 8) {
+        x0 = _mm_loadu_ps(d0);
+        x1 = _mm_loadu_ps(d0 + 4);
+        hi0 = _mm_max_ps(x0, hi0);
+        hi1 = _mm_max_ps(x1, hi1);
+        lo0 = _mm_min_ps(x0, lo0);
+        lo1 = _mm_min_ps(x1, lo1);
+        /* Unordered if either of them is NaN */
+        un = _mm_or_ps(un, _mm_cmpunord_ps(x0, x1));
+    }
+    _mm_store_ps(hi, _mm_max_ps(hi0, hi1));
+    _mm_store_ps(lo, _mm_min_ps(lo0, lo1));
+    nan |= _mm_movemask_ps(un) != 0;
+    res = qagen_kernel_max_scalar(hi, hi + 4, init);
+    min = qagen_kernel_min_scalar(lo, lo + 4, min);
+    return qagen_kernel_max_min_scalar(d0, d1, res, min, nan);
+}
+
+
+/** Lane-wise quantization error of one run, folded into a qagen_kernel_qerr
+ *  at the end of it */
+struct qagen_kernel_qacc_ps {
+    __m128 amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_ps(double f) noexcept:
+        amax(_mm_setzero_ps()), rmax(amax), floor(_mm_set1_ps((float)f)) { }
+
+    /** @brief Adds the quotients @p q, every one of which truncates to its
+     *      pixel
+     */
+    void add(__m128 q) noexcept
+    {
+        const __m128 frac = _mm_sub_ps(q, _mm_round_ps(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        const __m128 above = _mm_cmpgt_ps(q, floor);
+
+        amax = _mm_max_ps(amax, frac);
+        rmax = _mm_max_ps(rmax, _mm_and_ps(above, _mm_mul_ps(frac, _mm_rcp_ps(q))));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        alignas(16) float a[4], r[4];
+
+        _mm_store_ps(a, amax);
+        _mm_store_ps(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 4);
+    }
+};
+
+
+/** qagen_kernel_qacc_ps, for double quotients */
+struct qagen_kernel_qacc_pd {
+    __m128d amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_pd(double f) noexcept:
+        amax(_mm_setzero_pd()), rmax(amax), floor(_mm_set1_pd(f)) { }
+
+    void add(__m128d q) noexcept
+    {
+        const __m128d frac = _mm_sub_pd(q, _mm_round_pd(q, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        const __m128d above = _mm_cmpgt_pd(q, floor);
+        const __m128d rcp = _mm_cvtps_pd(_mm_rcp_ps(_mm_cvtpd_ps(q)));
+
+        amax = _mm_max_pd(amax, frac);
+        rmax = _mm_max_pd(rmax, _mm_and_pd(above, _mm_mul_pd(frac, rcp)));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        alignas(16) double a[2], r[2];
+
+        _mm_store_pd(a, amax);
+        _mm_store_pd(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 2);
+    }
+};
+
+
+/** @brief Returns the truncated integer lanes of x * rcp, or sets @p bad if any
+ *      lane is too close to call
+ *  @param[out] q
+ *      The quotients
+ */
+inline __m128i qagen_kernel_q4_sse4(__m128 x, __m128 rcp, bool &bad, __m128 &q)
+{
+    const __m128 guard = _mm_set1_ps(QAGEN_KERNEL_GUARD);
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 dist, lim;
+
+    q = _mm_mul_ps(x, rcp);
+    dist = _mm_sub_ps(q, _mm_round_ps(q, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    dist = _mm_and_ps(dist, absmask);
+    lim = _mm_mul_ps(_mm_and_ps(q, absmask), guard);
+    bad |= _mm_movemask_ps(_mm_cmplt_ps(dist, lim)) != 0;
+    return _mm_and_si128(_mm_cvttps_epi32(q), _mm_set1_epi32(0xffff));
+}
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32_u16(std::uint16_t     *dst,
+                                       const float       *src,
+                                       std::size_t        framelen,
+                                       float              scal,
+                                       qagen_kernel_qerr *err)
+{
+    const __m128 rcp = _mm_set1_ps(1.0f / scal);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_ps acc((Measure) ? err->floor : 0.0);
+    __m128 qlo, qhi;
+    __m128i lo, hi;
+    std::size_t j;
+    bool bad;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        bad = false;
+        lo = qagen_kernel_q4_sse4(_mm_loadu_ps(end - 8), rcp, bad, qlo);
+        hi = qagen_kernel_q4_sse4(_mm_loadu_ps(end - 4), rcp, bad, qhi);
+        if (bad) {
+            qagen_kernel_fixup_f32(dst + j, end, 8, scal, err);
+            continue;
+        }
+        if constexpr (Measure) {
+            acc.add(qlo);
+            acc.add(qhi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                         _mm_shuffle_epi8(_mm_packus_epi32(lo, hi), rev));
+    }
+    qagen_kernel_fixup_f32(dst + j, end, framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+
+/** @brief Quantizes four floats by a double scale, keeping the low words */
+template <bool Measure>
+inline __m128i qagen_kernel_q4d_sse4(__m128 x, __m128d s, qagen_kernel_qacc_pd &acc)
+{
+    const __m128d qlo = _mm_div_pd(_mm_cvtps_pd(x), s);
+    const __m128d qhi = _mm_div_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), s);
+
+    if constexpr (Measure) {
+        acc.add(qlo);
+        acc.add(qhi);
+    }
+    return _mm_and_si128(_mm_unpacklo_epi64(_mm_cvttpd_epi32(qlo), _mm_cvttpd_epi32(qhi)),
+                         _mm_set1_epi32(0xffff));
+}
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32d_u16(std::uint16_t     *dst,
+                                        const float       *src,
+                                        std::size_t        framelen,
+                                        double             scal,
+                                        qagen_kernel_qerr *err)
+{
+    const __m128d s = _mm_set1_pd(scal);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_pd acc((Measure) ? err->floor : 0.0);
+    std::size_t j;
+    __m128i lo, hi;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        lo = qagen_kernel_q4d_sse4<Measure>(_mm_loadu_ps(end - 8), s, acc);
+        hi = qagen_kernel_q4d_sse4<Measure>(_mm_loadu_ps(end - 4), s, acc);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                         _mm_shuffle_epi8(_mm_packus_epi32(lo, hi), rev));
+    }
+    qagen_kernel_qflip_scalar(dst + j, end - (framelen - j), framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+inline std::size_t qagen_kernel_first_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const __m128 t = _mm_set1_ps(thresh);
+    std::size_t i;
+    int mask;
+
+    for (i = 0; n - i >= 4; i += 4) {
+        mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(d + i), t));
+        if (mask) {
+            return i + qagen_kernel_ctz((unsigned)mask);
+        }
+    }
+    return i + qagen_kernel_first_above_scalar(d + i, n - i, thresh);
+}
+
+
+inline std::size_t qagen_kernel_last_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const __m128 t = _mm_set1_ps(thresh);
+    std::size_t i, tail = n % 4;
+    int mask;
+
+    i = qagen_kernel_last_above_scalar(d + n - tail, tail, thresh);
+    if (i < tail) {
+        return n - tail + i;
+    }
+    for (i = n - tail; i >= 4; i -= 4) {
+        mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(d + i - 4), t));
+        if (mask) {
+            return i - 4 + qagen_kernel_msb((unsigned)mask);
+        }
+    }
+    return n;
+}
+
+inline void qagen_kernel_dqflip_u16(float               *dst,
+                                    const std::uint16_t *src,
+                                    std::size_t          framelen,
+                                    float                scal)
+{
+    const __m128 s = _mm_set1_ps(scal);
+    const __m128i rev = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                                      6, 7, 4, 5, 2, 3, 0, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const std::uint16_t *end = src + framelen;
+    std::size_t j;
+    __m128i px;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        px = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(end - 8)), rev);
+        _mm_storeu_ps(dst + j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(px)), s));
+        _mm_storeu_ps(dst + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(px, zero)), s));
+    }
+    qagen_kernel_dqflip_scalar(dst + j, end - (framelen - j), framelen - j, scal);
+}
+
+#elif QAGEN_KERNEL_NEON
+
+inline float qagen_kernel_max_f32(const float *d0, const float *d1, float init)
+{
+    float32x4_t acc0 = vdupq_n_f32(init), acc1 = acc0;
+    float lane[4];
+    float res;
+
+    for (; d1 - d0 >= 8; d0 += 8) {
+        /* fmax does not propagate NaN the way we want, so compare manually */
+        float32x4_t x0 = vld1q_f32(d0), x1 = vld1q_f32(d0 + 4);
+        acc0 = vbslq_f32(vcltq_f32(acc0, x0), x0, acc0);
+        acc1 = vbslq_f32(vcltq_f32(acc1, x1), x1, acc1);
+    }
+    vst1q_f32(lane, vbslq_f32(vcltq_f32(acc0, acc1), acc1, acc0));
+    res = qagen_kernel_max_scalar(lane, lane + 4, init);
+    return qagen_kernel_max_scalar(d0, d1, res);
+}
+
+
+inline float qagen_kernel_max_min_f32(const float *d0, const float *d1, float init, float &min, bool &nan)
+{
+    float32x4_t hi0 = vdupq_n_f32(init), hi1 = hi0;
+    float32x4_t lo0 = vdupq_n_f32(min), lo1 = lo0;
+    uint32x4_t ord = vdupq_n_u32(0xffffffff);
+    float hi[4], lo[4];
+    float res;
+
+    for (; d1 - d0 >= 8; d0 += 8) {
+        float32x4_t x0 = vld1q_f32(d0), x1 = vld1q_f32(d0 + 4);
+        hi0 = vbslq_f32(vcltq_f32(hi0, x0), x0, hi0);
+        hi1 = vbslq_f32(vcltq_f32(hi1, x1), x1, hi1);
+        lo0 = vbslq_f32(vcltq_f32(x0, lo0), x0, lo0);
+        lo1 = vbslq_f32(vcltq_f32(x1, lo1), x1, lo1);
+        /* Only NaN compares unequal to itself */
+        ord = vandq_u32(ord, vandq_u32(vceqq_f32(x0, x0), vceqq_f32(x1, x1)));
+    }
+    vst1q_f32(hi, vbslq_f32(vcltq_f32(hi0, hi1), hi1, hi0));
+    vst1q_f32(lo, vbslq_f32(vcltq_f32(lo1, lo0), lo1, lo0));
+    nan |= vminvq_u32(ord) == 0;
+    res = qagen_kernel_max_scalar(hi, hi + 4, init);
+    min = qagen_kernel_min_scalar(lo, lo + 4, min);
+    return qagen_kernel_max_min_scalar(d0, d1, res, min, nan);
+}
+
+
+/** Lane-wise quantization error of one run, folded into a qagen_kernel_qerr
+ *  at the end of it */
+struct qagen_kernel_qacc_ps {
+    float32x4_t amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_ps(double f) noexcept:
+        amax(vdupq_n_f32(0.0f)), rmax(amax), floor(vdupq_n_f32((float)f)) { }
+
+    /** @brief Adds the quotients @p q, every one of which truncates to its
+     *      pixel
+     */
+    void add(float32x4_t q) noexcept
+    {
+        const float32x4_t frac = vsubq_f32(q, vrndq_f32(q));
+        float32x4_t rcp = vrecpeq_f32(q);
+
+        /* One Newton step takes the estimate from 8 bits to about 16 */
+        rcp = vmulq_f32(rcp, vrecpsq_f32(q, rcp));
+        amax = vmaxq_f32(amax, frac);
+        rmax = vmaxq_f32(rmax, vreinterpretq_f32_u32(vandq_u32(vcgtq_f32(q, floor),
+                                                               vreinterpretq_u32_f32(vmulq_f32(frac, rcp)))));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        float a[4], r[4];
+
+        vst1q_f32(a, amax);
+        vst1q_f32(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 4);
+    }
+};
+
+
+/** qagen_kernel_qacc_ps, for double quotients */
+struct qagen_kernel_qacc_pd {
+    float64x2_t amax, rmax, floor;
+
+    explicit qagen_kernel_qacc_pd(double f) noexcept:
+        amax(vdupq_n_f64(0.0)), rmax(amax), floor(vdupq_n_f64(f)) { }
+
+    void add(float64x2_t q) noexcept
+    {
+        const float64x2_t frac = vsubq_f64(q, vrndq_f64(q));
+        float64x2_t rcp = vrecpeq_f64(q);
+
+        rcp = vmulq_f64(rcp, vrecpsq_f64(q, rcp));
+        amax = vmaxq_f64(amax, frac);
+        rmax = vmaxq_f64(rmax, vreinterpretq_f64_u64(vandq_u64(vcgtq_f64(q, floor),
+                                                               vreinterpretq_u64_f64(vmulq_f64(frac, rcp)))));
+    }
+
+    void fold(qagen_kernel_qerr &err) const noexcept
+    {
+        double a[2], r[2];
+
+        vst1q_f64(a, amax);
+        vst1q_f64(r, rmax);
+        qagen_kernel_qerr_fold(err, a, r, 2);
+    }
+};
+
+
+/** @brief Returns the truncated integer lanes of x * rcp, flagging any lane
+ *      too close to call in @p bad
+ *  @param[out] q
+ *      The quotients
+ */
+inline uint16x4_t qagen_kernel_q4_neon(float32x4_t x, float32x4_t rcp, uint32x4_t &bad, float32x4_t &q)
+{
+    const float32x4_t guard = vdupq_n_f32(QAGEN_KERNEL_GUARD);
+    float32x4_t dist;
+
+    q = vmulq_f32(x, rcp);
+    dist = vabdq_f32(q, vrndnq_f32(q));
+    bad = vorrq_u32(bad, vcltq_f32(dist, vmulq_f32(vabsq_f32(q), guard)));
+    /* fcvtzu, then the low word, same as the scalar cast on this target */
+    return vmovn_u32(vcvtq_u32_f32(q));
+}
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32_u16(std::uint16_t     *dst,
+                                       const float       *src,
+                                       std::size_t        framelen,
+                                       float              scal,
+                                       qagen_kernel_qerr *err)
+{
+    const float32x4_t rcp = vdupq_n_f32(1.0f / scal);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_ps acc((Measure) ? err->floor : 0.0);
+    float32x4_t qlo, qhi;
+    uint16x8_t px;
+    uint32x4_t bad;
+    std::size_t j;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        bad = vdupq_n_u32(0);
+        px = vcombine_u16(qagen_kernel_q4_neon(vld1q_f32(end - 8), rcp, bad, qlo),
+                          qagen_kernel_q4_neon(vld1q_f32(end - 4), rcp, bad, qhi));
+        if (vmaxvq_u32(bad)) {
+            qagen_kernel_fixup_f32(dst + j, end, 8, scal, err);
+            continue;
+        }
+        if constexpr (Measure) {
+            acc.add(qlo);
+            acc.add(qhi);
+        }
+        px = vrev64q_u16(px);
+        vst1q_u16(dst + j, vextq_u16(px, px, 4));
+    }
+    qagen_kernel_fixup_f32(dst + j, end, framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+
+/** @brief Quantizes four floats by a double scale, keeping the low words */
+template <bool Measure>
+inline uint16x4_t qagen_kernel_q4d_neon(float32x4_t x, float64x2_t s, qagen_kernel_qacc_pd &acc)
+{
+    const float64x2_t qlo = vdivq_f64(vcvt_f64_f32(vget_low_f32(x)), s);
+    const float64x2_t qhi = vdivq_f64(vcvt_high_f64_f32(x), s);
+
+    if constexpr (Measure) {
+        acc.add(qlo);
+        acc.add(qhi);
+    }
+    return vmovn_u32(vcombine_u32(vmovn_u64(vcvtq_u64_f64(qlo)), vmovn_u64(vcvtq_u64_f64(qhi))));
+}
+
+
+template <bool Measure>
+inline void qagen_kernel_qflip_f32d_u16(std::uint16_t     *dst,
+                                        const float       *src,
+                                        std::size_t        framelen,
+                                        double             scal,
+                                        qagen_kernel_qerr *err)
+{
+    const float64x2_t s = vdupq_n_f64(scal);
+    const float *end = src + framelen;
+    qagen_kernel_qacc_pd acc((Measure) ? err->floor : 0.0);
+    uint16x8_t px;
+    std::size_t j;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        px = vcombine_u16(qagen_kernel_q4d_neon<Measure>(vld1q_f32(end - 8), s, acc),
+                          qagen_kernel_q4d_neon<Measure>(vld1q_f32(end - 4), s, acc));
+        px = vrev64q_u16(px);
+        vst1q_u16(dst + j, vextq_u16(px, px, 4));
+    }
+    qagen_kernel_qflip_scalar(dst + j, end - (framelen - j), framelen - j, scal, err);
+    if constexpr (Measure) {
+        acc.fold(*err);
+    }
+}
+
+/* NEON has no movemask, so these only use the vector unit to skip blocks */
+inline std::size_t qagen_kernel_first_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const float32x4_t t = vdupq_n_f32(thresh);
+    std::size_t i;
+
+    for (i = 0; n - i >= 4; i += 4) {
+        if (vmaxvq_u32(vcgtq_f32(vld1q_f32(d + i), t))) {
+            break;
+        }
+    }
+    return i + qagen_kernel_first_above_scalar(d + i, n - i, thresh);
+}
+
+
+inline std::size_t qagen_kernel_last_above_f32(const float *d, std::size_t n, float thresh)
+{
+    const float32x4_t t = vdupq_n_f32(thresh);
+    std::size_t i, tail = n % 4;
+
+    i = qagen_kernel_last_above_scalar(d + n - tail, tail, thresh);
+    if (i < tail) {
+        return n - tail + i;
+    }
+    for (i = n - tail; i >= 4; i -= 4) {
+        if (vmaxvq_u32(vcgtq_f32(vld1q_f32(d + i - 4), t))) {
+            return i - 4 + qagen_kernel_last_above_scalar(d + i - 4, 4, thresh);
+        }
+    }
+    return n;
+}
+
+inline void qagen_kernel_dqflip_u16(float               *dst,
+                                    const std::uint16_t *src,
+                                    std::size_t          framelen,
+                                    float                scal)
+{
+    const float32x4_t s = vdupq_n_f32(scal);
+    const std::uint16_t *end = src + framelen;
+    std::size_t j;
+    uint16x8_t px;
+
+    for (j = 0; framelen - j >= 8; j += 8, end -= 8) {
+        px = vrev64q_u16(vld1q_u16(end - 8));
+        px = vextq_u16(px, px, 4);
+        vst1q_f32(dst + j, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(px))), s));
+        vst1q_f32(dst + j + 4, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(px))), s));
+    }
+    qagen_kernel_dqflip_scalar(dst + j, end - (framelen - j), framelen - j, scal);
+}
+
+#endif /* QAGEN_KERNEL_* */
+
+
+/** @brief Finds the maximum of [@p d0, @p d1), starting from @p init
+ *  @details Equivalent to folding std::max(res, x) over the range, so NaNs are
+ *      ignored
+ *  @param d0
+ *      Start of the range
+ *  @param d1
+ *      End of the range
+ *  @param init
+ *      Initial value. Use zero to clamp the result to nonnegative, or lowest()
+ *      for the true maximum
+ *  @returns The maximum
+ */
+template <class DataT>
+inline DataT qagen_kernel_max(const DataT *d0, const DataT *d1, DataT init)
+{
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+    if constexpr (std::is_same_v<DataT, float>) {
+        return qagen_kernel_max_f32(d0, d1, init);
+    }
+#endif
+    return qagen_kernel_max_scalar(d0, d1, init);
+}
+
+
+/** @brief qagen_kernel_max(), also tracking the minimum and whether any value
+ *      is NaN
+ *  @details The fast half of a validity check: when @p nan is clear, @p min is
+ *      nonnegative and the result is finite, the range holds nothing that
+ *      qagen_kernel_invalid() would count
+ *  @param d0
+ *      Start of the range
+ *  @param d1
+ *      End of the range
+ *  @param init
+ *      Initial maximum
+ *  @param[in,out] min
+ *      Running minimum. NaNs are ignored
+ *  @param[in,out] nan
+ *      Set if any value is NaN
+ *  @returns The maximum
+ */
+template <class DataT>
+inline DataT qagen_kernel_max_min(const DataT *d0, const DataT *d1, DataT init, DataT &min, bool &nan)
+{
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+    if constexpr (std::is_same_v<DataT, float>) {
+        return qagen_kernel_max_min_f32(d0, d1, init, min, nan);
+    }
+#endif
+    return qagen_kernel_max_min_scalar(d0, d1, init, min, nan);
+}
+
+
+/** @brief Quantizes @p nframes frames of @p src into @p dst, writing each frame
+ *      backwards
+ *  @details Frame k of @p dst is frame k of @p src in reverse order, where
+ *      each pixel is static_cast<PixelT>(x / scal)
+ *  @param dst
+ *      Output pixels, framelen * nframes of them
+ *  @param src
+ *      Source values, framelen * nframes of them
+ *  @param framelen
+ *      Number of pixels in a frame
+ *  @param nframes
+ *      Number of frames
+ *  @param scal
+ *      Grid scaling
+ *  @param[in,out] err
+ *      If not null, accumulates the quantization error of every pixel
+ */
+template <class DataT, class ScaleT, class PixelT>
+inline void qagen_kernel_quantize_flip(PixelT            *dst,
+                                       const DataT       *src,
+                                       std::size_t        framelen,
+                                       std::size_t        nframes,
+                                       ScaleT             scal,
+                                       qagen_kernel_qerr *err = nullptr)
+{
+    for (std::size_t k = 0; k < nframes; k++) {
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+        if constexpr (std::is_same_v<DataT, float>
+                   && std::is_same_v<ScaleT, float>
+                   && std::is_same_v<PixelT, std::uint16_t>) {
+            /* The reciprocal must be a normal number for the guard to hold */
+            if (std::isnormal(1.0f / scal)) {
+                if (err) {
+                    qagen_kernel_qflip_f32_u16<true>(dst, src, framelen, scal, err);
+                } else {
+                    qagen_kernel_qflip_f32_u16<false>(dst, src, framelen, scal, nullptr);
+                }
+                dst += framelen;
+                src += framelen;
+                continue;
+            }
+        } else if constexpr (std::is_same_v<DataT, float>
+                          && std::is_same_v<ScaleT, double>
+                          && std::is_same_v<PixelT, std::uint16_t>) {
+            if (err) {
+                qagen_kernel_qflip_f32d_u16<true>(dst, src, framelen, scal, err);
+            } else {
+                qagen_kernel_qflip_f32d_u16<false>(dst, src, framelen, scal, nullptr);
+            }
+            dst += framelen;
+            src += framelen;
+            continue;
+        }
+#endif
+        qagen_kernel_qflip_scalar(dst, src, framelen, scal, err);
+        dst += framelen;
+        src += framelen;
+    }
+}
+
+
+/** @brief Undoes qagen_kernel_quantize_flip(): turns @p nframes frames of
+ *      pixels back into dose, writing each frame backwards
+ *  @details Frame k of @p dst is frame k of @p src in reverse order, where
+ *      each value is static_cast<float>(p) * scal. Every 16-bit pixel is exact
+ *      as a float, so the vector bodies agree with this bit for bit
+ *  @param dst
+ *      Output dose, framelen * nframes of it
+ *  @param src
+ *      Pixels, framelen * nframes of them
+ *  @param framelen
+ *      Number of pixels in a frame
+ *  @param nframes
+ *      Number of frames
+ *  @param scal
+ *      DoseGridScaling
+ */
+template <class PixelT>
+inline void qagen_kernel_dequantize_flip(float        *dst,
+                                         const PixelT *src,
+                                         std::size_t   framelen,
+                                         std::size_t   nframes,
+                                         float         scal)
+{
+    for (std::size_t k = 0; k < nframes; k++) {
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+        if constexpr (std::is_same_v<PixelT, std::uint16_t>) {
+            qagen_kernel_dqflip_u16(dst, src, framelen, scal);
+            dst += framelen;
+            src += framelen;
+            continue;
+        }
+#endif
+        qagen_kernel_dqflip_scalar(dst, src, framelen, scal);
+        dst += framelen;
+        src += framelen;
+    }
+}
+
+
+/** @brief Quantizes a strided plane of @p src into a @p w by @p h block of
+ *      @p dst
+ *  @details Pixel (r, c) of @p dst is src[r * sr + c * sc], quantized. The
+ *      strides may be negative, and either of them may be the contiguous one,
+ *      so this covers every flip and transpose of a frame. Reversed rows go
+ *      straight through qagen_kernel_quantize_flip(). Anything else is first
+ *      gathered a tile at a time into reversed rows, so that a transpose
+ *      never walks the source more than a tile's width apart
+ *  @param dst
+ *      First output pixel
+ *  @param ldd
+ *      Output row stride, in pixels
+ *  @param src
+ *      Source value of output pixel (0, 0)
+ *  @param w
+ *      Output columns
+ *  @param h
+ *      Output rows
+ *  @param sc
+ *      Source stride along an output row, in elements
+ *  @param sr
+ *      Source stride between output rows, in elements
+ *  @param scal
+ *      Grid scaling
+ *  @param err
+ *      If not nullptr, accumulates the quantization error of the block
+ */
+template <class DataT, class ScaleT, class PixelT>
+inline void qagen_kernel_reformat(PixelT            *dst,
+                                  std::size_t        ldd,
+                                  const DataT       *src,
+                                  std::size_t        w,
+                                  std::size_t        h,
+                                  std::ptrdiff_t     sc,
+                                  std::ptrdiff_t     sr,
+                                  ScaleT             scal,
+                                  qagen_kernel_qerr *err = nullptr)
+{
+    constexpr std::size_t T = QAGEN_KERNEL_TILE;
+    alignas(64) DataT tile[T * T];
+    std::size_t r0, c0, th, tw, i, j;
+    const DataT *s;
+
+    if (!w || !h) {
+        return;
+    }
+    if (sc == -1) {
+        if (sr == -(std::ptrdiff_t)w && ldd == w) {
+            qagen_kernel_quantize_flip(dst, src - (w * h - 1), w * h, 1, scal, err);
+            return;
+        }
+        for (r0 = 0; r0 < h; r0++) {
+            s = src + (std::ptrdiff_t)r0 * sr - (std::ptrdiff_t)(w - 1);
+            qagen_kernel_quantize_flip(dst + r0 * ldd, s, w, 1, scal, err);
+        }
+        return;
+    }
+    for (r0 = 0; r0 < h; r0 += T) {
+        th = (h - r0 < T) ? h - r0 : T;
+        for (c0 = 0; c0 < w; c0 += T) {
+            tw = (w - c0 < T) ? w - c0 : T;
+            s = src + (std::ptrdiff_t)r0 * sr + (std::ptrdiff_t)c0 * sc;
+            /* Walk the source along whichever stride is shorter */
+            if (std::abs(sr) < std::abs(sc)) {
+                for (j = 0; j < tw; j++) {
+                    for (i = 0; i < th; i++) {
+                        tile[i * T + tw - 1 - j] = s[(std::ptrdiff_t)j * sc + (std::ptrdiff_t)i * sr];
+                    }
+                }
+            } else {
+                for (i = 0; i < th; i++) {
+                    for (j = 0; j < tw; j++) {
+                        tile[i * T + tw - 1 - j] = s[(std::ptrdiff_t)i * sr + (std::ptrdiff_t)j * sc];
+                    }
+                }
+            }
+            for (i = 0; i < th; i++) {
+                qagen_kernel_quantize_flip(dst + (r0 + i) * ldd + c0, tile + i * T, tw, 1, scal, err);
+            }
+        }
+    }
+}
+
+
+/** @brief Finds the first value in [@p d, @p d + @p n) above @p thresh
+ *  @returns Its index, or @p n if there is none. NaNs never match
+ */
+template <class DataT>
+inline std::size_t qagen_kernel_first_above(const DataT *d, std::size_t n, DataT thresh)
+{
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+    if constexpr (std::is_same_v<DataT, float>) {
+        return qagen_kernel_first_above_f32(d, n, thresh);
+    }
+#endif
+    return qagen_kernel_first_above_scalar(d, n, thresh);
+}
+
+
+/** @brief Finds the last value in [@p d, @p d + @p n) above @p thresh
+ *  @returns Its index, or @p n if there is none
+ */
+template <class DataT>
+inline std::size_t qagen_kernel_last_above(const DataT *d, std::size_t n, DataT thresh)
+{
+#if QAGEN_KERNEL_AVX2 || QAGEN_KERNEL_SSE4 || QAGEN_KERNEL_NEON
+    if constexpr (std::is_same_v<DataT, float>) {
+        return qagen_kernel_last_above_f32(d, n, thresh);
+    }
+#endif
+    return qagen_kernel_last_above_scalar(d, n, thresh);
+}
+
+
+/** @brief Adds @p n quantized pixels to running totals
+ *  @details The histogram has NBINS even bins over the whole pixel range, so
+ *      the bin is a multiply and a shift. Zero pixels, usually most of a Dose
+ *      Beam, are counted into bin zero and skipped
+ *  @param px
+ *      Pixels
+ *  @param n
+ *      Number of pixels
+ *  @param thresh
+ *      Three thresholds. above[i] counts the pixels strictly above thresh[i]
+ *  @param[in,out] sum
+ *      Sum of the pixels
+ *  @param[in,out] above
+ *      Counts above each threshold
+ *  @param[in,out] hist
+ *      Histogram
+ *  @param max
+ *      Running maximum
+ *  @returns The new maximum
+ */
+template <std::size_t NBINS, class PixelT>
+inline PixelT qagen_kernel_tally(const PixelT  *px,
+                                 std::size_t    n,
+                                 const PixelT   thresh[3],
+                                 std::uint64_t &sum,
+                                 std::uint64_t  above[3],
+                                 std::uint64_t  hist[NBINS],
+                                 PixelT         max)
+{
+    constexpr unsigned shift = 8 * sizeof (PixelT);
+    std::uint64_t s = 0, a0 = 0, a1 = 0, a2 = 0, nz = 0;
+    PixelT p;
+
+    static_assert(std::is_unsigned_v<PixelT> && sizeof (PixelT) <= 4);
+    for (std::size_t i = 0; i < n; i++) {
+        p = px[i];
+        if (!p) {
+            continue;
+        }
+        nz++;
+        s += p;
+        a0 += p > thresh[0];
+        a1 += p > thresh[1];
+        a2 += p > thresh[2];
+        hist[((std::uint64_t)p * NBINS) >> shift]++;
+        max = (max < p) ? p : max;
+    }
+    hist[0] += n - nz;
+    sum += s;
+    above[0] += a0;
+    above[1] += a1;
+    above[2] += a2;
+    return max;
+}
+
+
+#endif /* QAGEN_KERNEL_H */
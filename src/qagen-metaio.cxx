@@ -1,21 +1,127 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdio>
+#include <cstring>
 #include <memory.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "qagen-metaio.h"
+#include "qagen-cache.h"
+#include "qagen-decimal.h"
 #include "qagen-error.h"
+#include "qagen-jpls.h"
+#include "qagen-kernel.h"
+#include "qagen-nifti.h"
+#include "qagen-parallel.h"
+#include "qagen-part10.h"
+#include "qagen-reformat.h"
+#include "qagen-source.h"
+#include "qagen-stats.h"
+#include "qagen-log.h"
 #include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcistrmf.h>
+#include <dcmtk/dcmdata/dcpixel.h>
 #include <dcmtk/dcmdata/dcvrdt.h>
+#include <dcmtk/dcmdata/dcvrobow.h>
+
+
+struct qagen_metaio_template {
+    DcmFileFormat dcfile;
+
+    std::unique_ptr<Part10Header> header;   /* Encoded on first direct use */
+
+    std::mutex lock;    /* DcmItem's copy constructor walks the source's element
+                        list with its (mutable) cursor, so cloning from two
+                        threads at once is a race */
+
+    std::wstring path;  /* Identity of the template in conversion cache keys */
+    CacheStamp   stamp;
+};
 
 
 EXTERN_C
-int qagen_metaio_convert(const wchar_t *restrict mhd,
-                         const wchar_t *restrict dst,
-                         const wchar_t *restrict tmplt)
+struct qagen_metaio_template *qagen_metaio_template_load(const wchar_t *path)
+{
+    static const wchar_t *failmsg = L"Failed to load RD template";
+    struct qagen_metaio_template *res = nullptr;
+    OFCondition stat;
+
+    try {
+        res = new struct qagen_metaio_template;
+        /* The template's own dose is overwritten anyway, so don't read it */
+        stat = res->dcfile.loadFileUntilTag(OFFilename(path),
+                                            EXS_Unknown,
+                                            EGL_noChange,
+                                            DCM_MaxReadLength,
+                                            ERM_autoDetect,
+                                            DCM_PixelData);
+        MHDConverter::Exception::ofcheck(stat, L"Cannot load RD template");
+        res->path = path;
+        if (!qagen_cache_stamp(path, res->stamp)) {
+            res->stamp = { };
+        }
+        return res;
+    } catch (MHDConverter::Exception &) {
+        /* Already raised */
+    } catch (std::bad_alloc &) {
+        int err = ENOMEM;
+        qagen_error_raise(QAGEN_ERR_SYSTEM, &err, failmsg);
+    } catch (std::exception &) {
+        qagen_error_raise(QAGEN_ERR_RUNTIME, failmsg, L"Caught unknown polymorphic std::exception");
+    }
+    delete res;
+    return nullptr;
+}
+
+
+EXTERN_C
+void qagen_metaio_template_free(struct qagen_metaio_template *tmplt)
+{
+    delete tmplt;
+}
+
+
+/** @brief qagen_metaio_convert_cached, also returning the dose statistics
+ *  @param[out] stats
+ *      The output's dose statistics, or NULL
+ */
+static int qagen_metaio_convert_stats(const wchar_t *restrict mhd,
+                                      const wchar_t *restrict dst,
+                                      const struct qagen_metaio_template *tmplt,
+                                      const struct qagen_metaio_opts *opts,
+                                      struct qagen_dose_stats *stats)
 {
     static const wchar_t *failmsg = L"Failed to convert MHD to DICOM";
+    struct qagen_dose_stats hit;
+    std::wstring key;
+    bool cached;
 
     try {
-        MHDConverter cvtr(mhd, tmplt);
+        cached = opts && opts->cache && qagen_cache_key(mhd, tmplt->path, tmplt->stamp, *opts, key);
+        if (cached && qagen_cache_fetch(opts->cache, key, dst, hit)) {
+            qagen_log_printf(QAGEN_LOG_INFO, L"Reused cached conversion %s of %s", key.c_str(), mhd);
+            qagen_stats_write(&hit, dst);
+            if (stats) {
+                *stats = hit;
+            }
+            return 0;
+        }
+        /* dst may be a link to an entry from an earlier hit, even if this run
+        has no cache. Writing it in place would write through to the entry */
+        DeleteFileW(dst);
+        MHDConverter cvtr(mhd, tmplt, opts);
         cvtr.convert(dst);
+        if (cached) {
+            qagen_cache_store(opts->cache, key, dst, cvtr.stats(),
+                              (opts->cache_max) ? opts->cache_max : QAGEN_METAIO_CACHE_MAX);
+        }
+        if (stats) {
+            *stats = cvtr.stats();
+        }
         return 0;
     } catch (MHDConverter::Exception &) {
         /* Already raised */
@@ -29,6 +135,240 @@ int qagen_metaio_convert(const wchar_t *restrict mhd,
 }
 
 
+EXTERN_C
+int qagen_metaio_convert_cached(const wchar_t *restrict mhd,
+                                const wchar_t *restrict dst,
+                                const struct qagen_metaio_template *tmplt,
+                                const struct qagen_metaio_opts *opts)
+{
+    return qagen_metaio_convert_stats(mhd, dst, tmplt, opts, nullptr);
+}
+
+
+EXTERN_C
+int qagen_metaio_convert(const wchar_t *restrict mhd,
+                         const wchar_t *restrict dst,
+                         const wchar_t *restrict tmplt,
+                         const struct qagen_metaio_opts *opts)
+{
+    struct qagen_metaio_template *cache;
+    int res = 1;
+
+    cache = qagen_metaio_template_load(tmplt);
+    if (cache) {
+        res = qagen_metaio_convert_cached(mhd, dst, cache, opts);
+        qagen_metaio_template_free(cache);
+    }
+    return res;
+}
+
+
+/** State shared between the batch workers and the thread waiting on them */
+struct qagen_metaio_batch {
+    const wchar_t *const *mhd;
+    size_t                n;
+    const wchar_t        *outdir;
+
+    const struct qagen_metaio_template *tmplt;
+
+    struct qagen_metaio_opts opts;  /* Per-conversion options */
+
+    std::vector<struct qagen_metaio_status> status;
+
+    std::atomic<size_t> next;       /* Next unclaimed item */
+    std::atomic<bool>   cancel;
+
+    std::mutex              lock;
+    std::condition_variable cv;
+    std::deque<size_t>      done;   /* Finished items not yet reported */
+    unsigned                running;    /* Workers that have not exited */
+};
+
+
+/** @brief Converts item @p i of @p batch into its status slot. This is run on
+ *      a pool thread
+ */
+static void qagen_metaio_batch_item(struct qagen_metaio_batch *batch, size_t i)
+{
+    static const wchar_t *failmsg = L"Failed to convert MHD to DICOM";
+    struct qagen_metaio_status *st = &batch->status[i];
+    std::wstring name, dst;
+    size_t sep;
+    bool gz;
+
+    try {
+        /* Output is named after the MHD, in the output directory */
+        name = batch->mhd[i];
+        sep = name.find_last_of(L"\\/");
+        if (sep != std::wstring::npos) {
+            name.erase(0, sep + 1);
+        }
+        /* Compound extensions like .nii.gz go entirely */
+        while ((sep = name.find_last_of(L'.')) != std::wstring::npos && sep) {
+            gz = !_wcsicmp(name.c_str() + sep, L".gz");
+            name.erase(sep);
+            if (!gz) {
+                break;
+            }
+        }
+        dst = batch->outdir;
+        if (!dst.empty() && dst.back() != L'\\' && dst.back() != L'/') {
+            dst += L'\\';
+        }
+        dst += name + L".dcm";
+        st->result = qagen_metaio_convert_stats(batch->mhd[i], dst.c_str(), batch->tmplt, &batch->opts, &st->stats);
+    } catch (std::bad_alloc &) {
+        int err = ENOMEM;
+        qagen_error_raise(QAGEN_ERR_SYSTEM, &err, failmsg);
+        st->result = 1;
+    }
+    if (st->result) {
+        qagen_error_save(&st->error);
+        /* Pool threads are reused, don't leave this lying around on them */
+        qagen_error_raise(QAGEN_ERR_NONE, NULL, NULL);
+    }
+}
+
+
+/** @brief Claims and converts items until none remain, or the batch is
+ *      cancelled
+ */
+static void qagen_metaio_batch_run(struct qagen_metaio_batch *batch)
+{
+    size_t i;
+
+    while (!batch->cancel && (i = batch->next.fetch_add(1)) < batch->n) {
+        qagen_metaio_batch_item(batch, i);
+        {
+            std::lock_guard<std::mutex> lock(batch->lock);
+            batch->done.push_back(i);
+        }
+        batch->cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(batch->lock);
+        batch->running--;
+    }
+    batch->cv.notify_one();
+}
+
+
+static VOID CALLBACK qagen_metaio_batch_callback(PTP_CALLBACK_INSTANCE inst,
+                                                 PVOID                 ctx,
+                                                 PTP_WORK              work)
+{
+    (void)inst;
+    (void)work;
+    qagen_metaio_batch_run(reinterpret_cast<struct qagen_metaio_batch *>(ctx));
+}
+
+
+/** @brief Hands finished items to @p progress until every worker has exited */
+static void qagen_metaio_batch_report(struct qagen_metaio_batch *batch,
+                                      qagen_metaio_progress_fn   progress,
+                                      void                      *data)
+{
+    std::unique_lock<std::mutex> lock(batch->lock);
+    size_t i;
+
+    for (;;) {
+        batch->cv.wait(lock, [batch] { return !batch->done.empty() || !batch->running; });
+        if (batch->done.empty()) {
+            break;
+        }
+        i = batch->done.front();
+        batch->done.pop_front();
+        lock.unlock();
+        if (progress && !progress(i, &batch->status[i], data)) {
+            batch->cancel = true;
+        }
+        lock.lock();
+    }
+}
+
+
+EXTERN_C
+int qagen_metaio_convert_batch(const wchar_t *const      *mhd,
+                               size_t                     n,
+                               const wchar_t *restrict    tmplt,
+                               const wchar_t *restrict    outdir,
+                               const struct qagen_metaio_opts *opts,
+                               struct qagen_metaio_status *status,
+                               qagen_metaio_progress_fn   progress,
+                               void                      *data)
+{
+    static const wchar_t *failmsg = L"Failed to convert MHD batch";
+    struct qagen_metaio_batch *batch = nullptr;
+    struct qagen_metaio_template *cache;
+    unsigned nworkers, nthreads, i;
+    PTP_WORK work = NULL;
+    int res = 0;
+
+    cache = qagen_metaio_template_load(tmplt);
+    if (!cache) {
+        return 1;
+    }
+    try {
+        batch = new struct qagen_metaio_batch;
+        batch->mhd = mhd;
+        batch->n = n;
+        batch->outdir = outdir;
+        batch->tmplt = cache;
+        batch->opts = (opts) ? *opts : qagen_metaio_opts{ };
+        batch->status.resize(n);
+        for (auto &st : batch->status) {
+            st.result = -1;
+        }
+        batch->next = 0;
+        batch->cancel = false;
+    } catch (std::bad_alloc &) {
+        int err = ENOMEM;
+        qagen_error_raise(QAGEN_ERR_SYSTEM, &err, failmsg);
+        delete batch;
+        qagen_metaio_template_free(cache);
+        return 1;
+    }
+
+    /* Split the processors between the workers, so that nested slice loops
+    don't oversubscribe the pool */
+    nworkers = (batch->opts.nworkers) ? batch->opts.nworkers : QAGEN_METAIO_WORKERS;
+    nworkers = (nworkers > n) ? (unsigned)n : nworkers;
+    nthreads = qagen_parallel_threads(batch->opts.nthreads);
+    batch->opts.nthreads = (nworkers && nthreads > nworkers) ? nthreads / nworkers : 1;
+    batch->running = nworkers;
+    if (nworkers) {
+        work = CreateThreadpoolWork(qagen_metaio_batch_callback, batch, NULL);
+    }
+    if (work) {
+        for (i = 0; i < nworkers; i++) {
+            SubmitThreadpoolWork(work);
+        }
+        qagen_metaio_batch_report(batch, progress, data);
+        WaitForThreadpoolWorkCallbacks(work, FALSE);
+        CloseThreadpoolWork(work);
+    } else if (nworkers) {
+        /* No pool, so do them all here and report afterwards */
+        qagen_log_puts(QAGEN_LOG_WARN, L"Cannot create pool work, converting serially");
+        batch->running = 1;
+        qagen_metaio_batch_run(batch);
+        qagen_metaio_batch_report(batch, progress, data);
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        if (status) {
+            status[j] = batch->status[j];
+        }
+        if (!res && batch->status[j].result > 0) {
+            qagen_error_restore(&batch->status[j].error);
+            res = 1;
+        }
+    }
+    delete batch;
+    qagen_metaio_template_free(cache);
+    return res;
+}
+
+
 const wchar_t *MHDConverter::m_failmsg = L"Cannot convert MHD file";
 
 
@@ -89,31 +429,172 @@ void MHDConverter::Exception::ofcheck(OFCondition stat, const wchar_t *msg)
 }
 
 
-void MHDConverter::load_template(const wchar_t *fname)
+void MHDConverter::load_template(const struct qagen_metaio_template *tmplt)
 {
-    OFCondition stat;
+    /* Everything convert() writes, i.e. everything that differs per beam */
+    static const DcmTagKey slots[] = {
+        DCM_CreationDate,
+        DCM_CreationTime,
+        DCM_SOPInstanceUID,
+        DCM_ContentDate,
+        DCM_ContentTime,
+        DCM_Manufacturer,
+        DCM_SeriesDescription,
+        DCM_ManufacturerModelName,
+        DCM_SliceThickness,
+        DCM_SeriesInstanceUID,
+        DCM_ImagePositionPatient,
+        DCM_ImageOrientationPatient,
+        DCM_NumberOfFrames,
+        DCM_Rows,
+        DCM_Columns,
+        DCM_PixelSpacing,
+        DCM_BitsAllocated,
+        DCM_BitsStored,
+        DCM_HighBit,
+        DCM_DoseUnits,
+        DCM_DoseType,
+        DCM_GridFrameOffsetVector,
+        DCM_DoseGridScaling
+    };
+    auto cache = const_cast<struct qagen_metaio_template *>(tmplt);
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    if (m_opts.direct || m_opts.deflate) {
+        /* The converter only fills in the slots, in an empty dataset. Deflated
+        output is always written this way, so that each writer has its own
+        level and compresses on its own thread */
+        if (!cache->header) {
+            cache->header = std::make_unique<Part10Header>(cache->dcfile.getDataset(), slots, BUFLEN(slots));
+        }
+        m_header = cache->header.get();
+    } else {
+        m_dcfile = cache->dcfile;
+    }
+}
+
+
+void MHDConverter::check_mhd()
+{
+    const unsigned bits = (m_opts.bits) ? m_opts.bits : 16;
+
+    if (m_mhd.NDims() != 3) {
+        throw Exception(L"MHD has invalid dimensionality %d", m_mhd.NDims());
+    }
+    if (bits != 16 && bits != 32) {
+        throw Exception(L"Invalid output depth %u, expected 16 or 32", bits);
+    }
+    m_convert = select_pixels(m_mhd.ElementType(), bits);
+    if (!m_convert) {
+        throw Exception(L"Unsupported MHD encoding %S", MET_ValueTypeName[m_mhd.ElementType()]);
+    }
+}
+
+
+/** @brief Size in bytes of one source voxel */
+static std::size_t element_size(const MetaImage &mhd)
+{
+    int size = 0;
+
+    MET_SizeOfType(mhd.ElementType(), &size);
+    return (std::size_t)size;
+}
 
-    stat = m_dcfile.loadFile(OFFilename(fname));
-    Exception::ofcheck(stat, L"Cannot load RD template");
+
+/** @brief Opens a slab source directly on the ElementDataFile named in the
+ *      header, memory-mapping it if possible. Compressed data is inflated on
+ *      the fly
+ *  @param fname
+ *      Path to the MHD, which relative data file names are resolved against
+ *  @returns false if this data cannot be read directly, i.e. it is
+ *      byte-swapped, multichannel, or not in a single separate file
+ */
+bool MHDConverter::open_source(const wchar_t *fname)
+{
+    const char *datafile = m_mhd.ElementDataFileName();
+    const std::size_t framesz = element_size(m_mhd) * m_mhd.DimSize(0) * m_mhd.DimSize(1);
+    std::unique_ptr<MappedFileSource> map;
+    wchar_t wdata[MAX_PATH];
+    std::wstring path(fname);
+    std::size_t sep;
+
+    if (m_mhd.BinaryDataByteOrderMSB()
+     || m_mhd.ElementNumberOfChannels() != 1
+     || !std::strcmp(datafile, "LOCAL")
+     || !std::strncmp(datafile, "LIST", 4)
+     || std::strchr(datafile, '%')) {
+        return false;
+    }
+    if (std::mbstowcs(wdata, datafile, BUFLEN(wdata)) == (size_t)-1) {
+        throw Exception(EILSEQ, L"Cannot convert MHD data file path to UTF-16");
+    }
+    if (wdata[0] == L'\\' || wdata[0] == L'/' || (wdata[0] && wdata[1] == L':')) {
+        path = wdata;
+    } else {
+        sep = path.find_last_of(L"\\/");
+        path.erase((sep == std::wstring::npos) ? 0 : sep + 1);
+        path += wdata;
+    }
+    if (m_mhd.CompressedData()) {
+        if (m_mhd.HeaderSize() < 0 && m_mhd.CompressedDataSize() <= 0) {
+            /* No idea where the stream starts */
+            return false;
+        }
+        m_src = std::make_unique<InflateSource>(path.c_str(),
+                                                m_mhd.HeaderSize(),
+                                                (long long)m_mhd.CompressedDataSize(),
+                                                framesz,
+                                                m_mhd.DimSize(2));
+        return true;
+    }
+    map = std::make_unique<MappedFileSource>(framesz, m_mhd.DimSize(2));
+    if (map->map(path.c_str(), m_mhd.HeaderSize())) {
+        m_src = std::move(map);
+    } else {
+        m_src = std::make_unique<RawFileSource>(path.c_str(), m_mhd.HeaderSize(), framesz, m_mhd.DimSize(2));
+    }
+    return true;
 }
 
 
 void MHDConverter::load_mhd(const wchar_t *fname)
 {
+    std::size_t framesz;
     char buf[512];
 
+    if (NiftiReader::is_nifti(fname)) {
+        load_nifti(fname);
+        return;
+    }
     if (std::wcstombs(buf, fname, BUFLEN(buf)) == -1) {
         throw Exception(EILSEQ, L"Cannot convert MHD input path to UTF-8");
     }
-    if (!m_mhd.Read(buf)) {
-        throw Exception(L"Cannot read MHD");
+    if (!m_mhd.Read(buf, false)) {
+        throw Exception(L"Cannot read MHD header");
     }
-    if (m_mhd.NDims() != 3) {
-        throw Exception(L"MHD has invalid dimensionality %d", m_mhd.NDims());
+    check_mhd();
+    if (open_source(fname)) {
+        return;
     }
-    if (m_mhd.ElementType() != MET_FLOAT) {
-        throw Exception(L"Invalid MHD encoding: Expected MET_FLOAT, found %S", MET_ValueTypeName[m_mhd.ElementType()]);
+    qagen_log_puts(QAGEN_LOG_DEBUG, L"MHD data cannot be mapped, reading it through MetaIO");
+    if (!m_mhd.Read(buf)) {
+        throw Exception(L"Cannot read MHD");
     }
+    check_mhd();
+    framesz = element_size(m_mhd) * m_mhd.DimSize(0) * m_mhd.DimSize(1);
+    m_src = std::make_unique<MemorySource>(m_mhd.ElementData(), framesz, m_mhd.DimSize(2));
+}
+
+
+/** @brief Reads a NIfTI-1 Dose_Beam natively, as if it were an MHD */
+void MHDConverter::load_nifti(const wchar_t *fname)
+{
+    NiftiReader nii(fname);
+
+    nii.describe(m_mhd);
+    check_mhd();
+    m_slope = nii.slope();
+    m_src = nii.source(element_size(m_mhd) * m_mhd.DimSize(0) * m_mhd.DimSize(1));
 }
 
 
@@ -178,54 +659,83 @@ void MHDConverter::convert_strings(DcmDataset *dset)
 }
 
 
-void MHDConverter::convert_grid_frame_offset_vector(DcmDataset *dset)
+/** @brief Formats @p n numbers as a DS or IS string and inserts them as
+ *      @p tag. Short tags are formatted on the stack
+ */
+template <class T>
+static void put_decimal(DcmDataset *dset, const DcmTagKey &tag, const T *val,
+                        std::size_t n, const wchar_t *failmsg)
+{
+    char stack[qagen_decimal_size(6)];
+    std::unique_ptr<char[]> heap;
+    char *buf = stack;
+
+    if (n > 6) {
+        heap = std::make_unique<char[]>(qagen_decimal_size(n));
+        buf = heap.get();
+    }
+    if (!qagen_decimal_format(buf, val, n)) {
+        throw MHDConverter::Exception(failmsg, L"(%04x,%04x) has a value DICOM cannot represent",
+                                      tag.getGroup(), tag.getElement());
+    }
+    MHDConverter::Exception::ofcheck(dset->putAndInsertString(tag, buf), failmsg);
+}
+
+
+void MHDConverter::convert_grid_frame_offset_vector(DcmDataset *dset, const Reformat &fmt)
 {
     static const wchar_t *failmsg = L"MHD conversion: Failed to insert GridFrameOffsetVector";
-    char buf[128];
-    double pos = m_mhd.ElementSpacing(2);
+    const std::size_t n = fmt.size(2);
+    std::unique_ptr<char[]> buf;
     OFCondition stat;
-    std::string gfov = "0";
+    char *ptr;
 
-    for (int i = 0; i < m_mhd.DimSize(2); i++) {
-        std::sprintf(buf, "\\%g", pos);
-        gfov += buf;
-        pos += m_mhd.ElementSpacing(2);
+    /* One offset per frame, relative to the first one written. Formatted in
+    place, since this is by far the longest string in the file */
+    buf = std::make_unique<char[]>(qagen_decimal_size(n));
+    ptr = buf.get();
+    for (std::size_t i = 0; i < n && ptr; i++) {
+        if (i) {
+            *ptr++ = '\\';
+        }
+        ptr = qagen_ds_put(ptr, (double)i * fmt.spacing(2));
     }
-    stat = dset->putAndInsertString(DCM_GridFrameOffsetVector, gfov.c_str());
+    if (!ptr) {
+        throw Exception(failmsg, L"Slice spacing %g cannot be written as a DS", fmt.spacing(2));
+    }
+    *ptr = '\0';
+    stat = dset->putAndInsertString(DCM_GridFrameOffsetVector, buf.get());
     Exception::ofcheck(stat, failmsg);
 }
 
 
-void MHDConverter::convert_geometry(DcmDataset *dset)
+/** @brief Writes the output grid chosen by @p fmt */
+void MHDConverter::convert_geometry(DcmDataset *dset, const Reformat &fmt)
 {
     static const wchar_t *failmsg = L"MHD conversion: Failed to insert geometric information";
-    char buf[128];
-    const double *const spacing = m_mhd.ElementSpacing();
-    const double *const origin = m_mhd.Origin();
-    const int *const dim = m_mhd.DimSize();
+    const std::size_t nframes = fmt.size(2);
+    double ipp[3], iop[6], pxsp[2], thick;
     OFCondition stat;
 
-    std::snprintf(buf, BUFLEN(buf), "%g\\%g", spacing[0], spacing[1]);
-    stat = dset->putAndInsertString(DCM_PixelSpacing, buf);
-    Exception::ofcheck(stat, failmsg);
-
-    std::snprintf(buf, BUFLEN(buf), "%g", spacing[2]);
-    stat = dset->putAndInsertString(DCM_SliceThickness, buf);
-    Exception::ofcheck(stat, failmsg);
+    /* Row spacing, i.e. along a column, comes first */
+    pxsp[0] = fmt.spacing(1);
+    pxsp[1] = fmt.spacing(0);
+    put_decimal(dset, DCM_PixelSpacing, pxsp, 2, failmsg);
+    thick = fmt.spacing(2);
+    put_decimal(dset, DCM_SliceThickness, &thick, 1, failmsg);
 
-    stat = dset->putAndInsertUint16(DCM_Columns, dim[0]);
+    stat = dset->putAndInsertUint16(DCM_Columns, (Uint16)fmt.size(0));
     Exception::ofcheck(stat, failmsg);
-    stat = dset->putAndInsertUint16(DCM_Rows, dim[1]);
-    Exception::ofcheck(stat, failmsg);
-    std::snprintf(buf, BUFLEN(buf), "%d", dim[2]);
-    stat = dset->putAndInsertString(DCM_NumberOfFrames, buf);
+    stat = dset->putAndInsertUint16(DCM_Rows, (Uint16)fmt.size(1));
     Exception::ofcheck(stat, failmsg);
+    put_decimal(dset, DCM_NumberOfFrames, &nframes, 1, failmsg);
 
-    std::snprintf(buf, BUFLEN(buf), "%g\\%g\\%g", origin[0], origin[1], origin[2]);
-    stat = dset->putAndInsertString(DCM_ImagePositionPatient, buf);
-    Exception::ofcheck(stat, failmsg);
+    fmt.orientation(iop);
+    put_decimal(dset, DCM_ImageOrientationPatient, iop, 6, failmsg);
+    fmt.position(ipp);
+    put_decimal(dset, DCM_ImagePositionPatient, ipp, 3, failmsg);
 
-    convert_grid_frame_offset_vector(dset);
+    convert_grid_frame_offset_vector(dset, fmt);
 }
 
 
@@ -240,13 +750,26 @@ void MHDConverter::convert_geometry(DcmDataset *dset)
 template <class DataT>
 void MHDConverter::write_grid_scaling(DcmDataset *dset, DataT dosegridscaling)
 {
-    char buf[17];   /* DS has a 16-byte maximum */
+    static_assert(std::is_floating_point<DataT>::value);
+    put_decimal(dset, DCM_DoseGridScaling, &dosegridscaling, 1,
+                L"MHD conversion: Failed to update DoseGridScaling");
+}
+
+
+/** @brief Writes the pixel module attributes describing a @p PixelT grid */
+template <class PixelT>
+void MHDConverter::write_pixel_format(DcmDataset *dset)
+{
+    static const wchar_t *failmsg = L"MHD conversion: Failed to set the pixel format";
+    const Uint16 bits = 8 * sizeof (PixelT);
     OFCondition stat;
 
-    static_assert(std::is_floating_point<DataT>::value);
-    std::snprintf(buf, BUFLEN(buf), "%1.10e", dosegridscaling);
-    stat = dset->putAndInsertString(DCM_DoseGridScaling, buf);
-    Exception::ofcheck(stat, L"MHD conversion: Failed to update DoseGridScaling");
+    stat = dset->putAndInsertUint16(DCM_BitsAllocated, bits);
+    Exception::ofcheck(stat, failmsg);
+    stat = dset->putAndInsertUint16(DCM_BitsStored, bits);
+    Exception::ofcheck(stat, failmsg);
+    stat = dset->putAndInsertUint16(DCM_HighBit, bits - 1);
+    Exception::ofcheck(stat, failmsg);
 }
 
 
@@ -254,50 +777,457 @@ void MHDConverter::write_grid_scaling(DcmDataset *dset, DataT dosegridscaling)
 #undef max
 
 
+/** @class Spools quantized frames to a local temp file, which DCMTK then
+ *      reads back on demand while saving. The file is deleted on destruction
+ *      unless it has been handed off with release()
+ */
+class PixelSpool {
+    wchar_t m_path[MAX_PATH];
+    FILE   *m_fp;
+
+public:
+    PixelSpool():
+        m_fp(nullptr)
+    {
+        wchar_t dir[MAX_PATH];
+
+        if (!GetTempPath(BUFLEN(dir), dir) || !GetTempFileName(dir, L"qag", 0, m_path)) {
+            throw MHDConverter::Exception(L"Cannot create a temp file for pixel data");
+        }
+        m_fp = _wfopen(m_path, L"wb");
+        if (!m_fp) {
+            int err = errno;
+            DeleteFile(m_path);
+            throw MHDConverter::Exception(err, L"Cannot open pixel data temp file");
+        }
+    }
+
+    ~PixelSpool()
+    {
+        if (m_fp) {
+            std::fclose(m_fp);
+        }
+        if (m_path[0]) {
+            DeleteFile(m_path);
+        }
+    }
+
+    void write(const void *buf, std::size_t size)
+    {
+        if (std::fwrite(buf, 1, size, m_fp) != size) {
+            throw MHDConverter::Exception(errno, L"Cannot write pixel data temp file");
+        }
+    }
+
+    /** @brief Closes the file and hands its deletion over to DCMTK */
+    DcmInputStreamFactory *release()
+    {
+        DcmTempFileHandler *handler;
+        DcmInputStreamFactory *res;
+        int err;
+
+        err = std::fclose(m_fp);
+        m_fp = nullptr;
+        if (err) {
+            throw MHDConverter::Exception(errno, L"Cannot flush pixel data temp file");
+        }
+        handler = DcmTempFileHandler::newInstance(OFFilename(m_path));
+        res = new DcmInputTempFileStreamFactory(handler);
+        handler->decreaseRefCount();    /* The factory holds it now */
+        m_path[0] = L'\0';
+        return res;
+    }
+};
+
+
+/** @brief Hands the spooled pixels to @p dset as its PixelData */
+static void insert_spooled_pixels(DcmDataset *dset, PixelSpool &spool, std::size_t nbytes)
+{
+    DcmOtherByteOtherWord *px;
+    OFCondition stat;
+
+    px = new DcmOtherByteOtherWord(DcmTag(DCM_PixelData, EVR_OW));
+    stat = px->createValueFromTempFile(spool.release(), static_cast<Uint32>(nbytes), EBO_LittleEndian);
+    if (stat.good()) {
+        stat = dset->insert(px, true);
+    }
+    if (stat.bad()) {
+        delete px;
+    }
+    MHDConverter::Exception::ofcheck(stat, L"Failed to set the pixel data");
+}
+
+
+/** @brief Creates the PixelData element in @p dset and returns its value
+ *      buffer, so that the quantizer can write straight into DCMTK's storage
+ *  @param dset
+ *      Output dataset
+ *  @param n
+ *      Number of pixels
+ *  @returns The buffer, owned by the dataset
+ */
+template <class PixelT>
+static PixelT *create_pixel_data(DcmDataset *dset, std::size_t n)
+{
+    DcmPixelData *px;
+    OFCondition stat;
+    Uint16 *words;
+
+    static_assert(sizeof (PixelT) % sizeof (Uint16) == 0);
+    px = new DcmPixelData(DCM_PixelData);
+    stat = px->createUint16Array(static_cast<Uint32>(n * (sizeof (PixelT) / sizeof (Uint16))), words);
+    if (stat.good()) {
+        stat = dset->insert(px, true);
+    }
+    if (stat.bad()) {
+        delete px;
+    }
+    MHDConverter::Exception::ofcheck(stat, L"Failed to create the pixel data");
+    return reinterpret_cast<PixelT *>(words);
+}
+
+
+/** @brief Grows @p box to cover the voxels of @p frame above @p thresh
+ *  @param frame
+ *      Source frame, @p nx by @p ny
+ *  @param z
+ *      Index of this frame in the volume
+ */
 template <class DataT>
-DataT datamax(const DataT *d0, const DataT *const d1)
+static void grow_box(MHDConverter::Box &box, const DataT *frame, std::size_t nx,
+                     std::size_t ny, std::size_t z, DataT thresh)
 {
-    DataT res = (DataT)0;
-    std::for_each(d0, d1, [&res](DataT x){ res = std::max(res, x); });
-    return res;
+    std::size_t first, start, last;
+    bool hit = false;
+
+    for (std::size_t y = 0; y < ny; y++, frame += nx) {
+        first = qagen_kernel_first_above(frame, nx, thresh);
+        if (first == nx) {
+            continue;
+        }
+        box.x0 = std::min(box.x0, first);
+        /* Only the tail past the current box can still widen it */
+        start = std::max(first, box.x1);
+        if (start < nx) {
+            last = start + qagen_kernel_last_above(frame + start, nx - start, thresh);
+            if (last < nx) {
+                box.x1 = last + 1;
+            }
+        }
+        box.y0 = std::min(box.y0, y);
+        box.y1 = std::max(box.y1, y + 1);
+        hit = true;
+    }
+    if (hit) {
+        box.z0 = std::min(box.z0, z);
+        box.z1 = std::max(box.z1, z + 1);
+    }
 }
 
 
+/** @brief First pass over the source: its maximum, clamped to nonnegative.
+ *      If cropping, this also finds m_box, otherwise m_box is the whole grid
+ *  @param nthreads
+ *      Number of threads to split each slab across
+ */
+template <class DataT>
+DataT MHDConverter::scan_source(unsigned nthreads)
+{
+    const size_t nx = m_mhd.DimSize(0), ny = m_mhd.DimSize(1);
+    const size_t framelen = nx * ny;
+    const size_t slab = m_src->slab_frames(nthreads);
+    const Box empty = { nx, 0, ny, 0, m_src->frames(), 0 };
+    const DataT thresh = (DataT)m_opts.crop_threshold;
+    std::vector<DataT> maxima(nthreads, (DataT)0), minima(nthreads, (DataT)0);
+    std::vector<size_t> nonfinite(nthreads, 0), negative(nthreads, 0);
+    std::vector<Box> boxes(nthreads, empty);
+    size_t first, got, nf = 0, neg = 0;
+    const DataT *dptr;
+    DataT min = 0;
+
+    /* One maximum and box per chunk of slices, merged in chunk order */
+    m_src->rewind();
+    while ((first = m_src->position()) < m_src->frames()) {
+        dptr = static_cast<const DataT *>(m_src->next(slab, got));
+        qagen_parallel_for(got, nthreads, [&](size_t k0, size_t k1, unsigned c){
+            const DataT *d0 = dptr + k0 * framelen, *d1 = dptr + k1 * framelen;
+            DataT lo = 0;
+            bool nan = false;
+
+            maxima[c] = qagen_kernel_max_min(d0, d1, maxima[c], lo, nan);
+            /* Only a bad source pays for counting what is wrong with it */
+            if (nan || lo < 0 || !(maxima[c] <= std::numeric_limits<DataT>::max())) {
+                qagen_kernel_invalid(d0, (size_t)(d1 - d0), nonfinite[c], negative[c], minima[c]);
+            }
+            if (m_opts.crop) {
+                for (size_t k = k0; k < k1; k++) {
+                    grow_box(boxes[c], dptr + k * framelen, nx, ny, first + k, thresh);
+                }
+            }
+        });
+    }
+    /* The max skips these, and the quantizer would turn them into garbage */
+    for (unsigned c = 0; c < nthreads; c++) {
+        nf += nonfinite[c];
+        neg += negative[c];
+        min = (minima[c] < min) ? minima[c] : min;
+    }
+    if (nf) {
+        throw Exception(L"Source has %zu NaN or infinite voxels", nf);
+    } else if (neg) {
+        throw Exception(L"Source has %zu negative voxels, down to %g", neg, (double)min);
+    }
+    m_box = empty;
+    for (const Box &b : boxes) {
+        m_box.x0 = std::min(m_box.x0, b.x0);
+        m_box.x1 = std::max(m_box.x1, b.x1);
+        m_box.y0 = std::min(m_box.y0, b.y0);
+        m_box.y1 = std::max(m_box.y1, b.y1);
+        m_box.z0 = std::min(m_box.z0, b.z0);
+        m_box.z1 = std::max(m_box.z1, b.z1);
+    }
+    if (!m_opts.crop || m_box.z0 >= m_box.z1) {
+        if (m_opts.crop) {
+            qagen_log_printf(QAGEN_LOG_WARN, L"No dose above %g, writing the whole grid",
+                             m_opts.crop_threshold);
+        }
+        m_box = { 0, nx, 0, ny, 0, m_src->frames() };
+    } else {
+        qagen_log_printf(QAGEN_LOG_INFO, L"Cropped to [%zu,%zu) x [%zu,%zu) x [%zu,%zu) of %zu x %zu x %zu",
+                         m_box.x0, m_box.x1, m_box.y0, m_box.y1, m_box.z0, m_box.z1,
+                         nx, ny, m_src->frames());
+    }
+    return qagen_kernel_max(maxima.data(), maxima.data() + maxima.size(), (DataT)0);
+}
+
+
+/** @brief Checks whether one PixelT step of a grid peaking at @p max is
+ *      within the dose tolerance. Pixels are truncated, so a step is also the
+ *      largest error of any voxel
+ */
+template <class PixelT, class DataT>
+bool MHDConverter::within_tolerance(DataT max) const noexcept
+{
+    return (double)max * m_slope / std::numeric_limits<PixelT>::max() <= m_opts.tolerance;
+}
+
+
+/** @brief Fails the conversion as soon as the quantization error measured so
+ *      far is past either tolerance
+ *  @param scal
+ *      Dose of one pixel step
+ */
+template <class PixelT>
+void MHDConverter::check_error(const DoseTally<PixelT> &tally, double scal) const
+{
+    double steps, rel;
+
+    tally.error(steps, rel);
+    if (m_opts.tolerance > 0.0 && steps * scal > m_opts.tolerance) {
+        throw Exception(L"Quantization error %g Gy exceeds the %g Gy tolerance", steps * scal, m_opts.tolerance);
+    }
+    if (m_opts.rel_tolerance > 0.0 && rel > m_opts.rel_tolerance) {
+        throw Exception(L"Relative quantization error %g exceeds the %g tolerance", rel, m_opts.rel_tolerance);
+    }
+}
+
+
+/** @brief Quantizes the source into PixelData, reoriented to the output
+ *      grid. Normally the pixels are written directly into the element's own
+ *      buffer. In streaming mode, peak memory is one slab of source frames
+ *      plus one slab of pixels, regardless of the volume size, unless the
+ *      source frames have to be resliced. Each output frame is tallied into
+ *      m_stats as soon as it is quantized
+ */
 template <class DataT, class PixelT>
 void MHDConverter::convert_pixels(DcmDataset *dset)
 {
-    const size_t framelen = (std::size_t)m_mhd.DimSize(0) * m_mhd.DimSize(1);
-    const size_t n = framelen * m_mhd.DimSize(2);
-    const DataT *dptr = reinterpret_cast<DataT *>(m_mhd.ElementData());
-    const DataT dosegridscal = datamax(dptr, dptr + n) / (DataT)std::numeric_limits<PixelT>::max();
+    /* Float only stays bit-exact against our baselines on a 16-bit grid. A
+    32-bit maximum isn't even representable in it */
+    using ScaleT = std::conditional_t<std::is_same_v<DataT, float> && sizeof (PixelT) == 2, float, double>;
+    const size_t dim[3] = {
+        (std::size_t)m_mhd.DimSize(0), (std::size_t)m_mhd.DimSize(1), m_src->frames()
+    };
+    const unsigned nthreads = qagen_parallel_threads(m_opts.nthreads);
+    const size_t slab = m_src->slab_frames(nthreads);
+    Reformat fmt(dim, m_mhd.ElementSpacing(), m_mhd.Origin(), m_mhd.TransformMatrix());
+    DoseTally<PixelT> tally(nthreads);
+    const auto tally_fn = [&tally](const PixelT *px, size_t w, size_t h, size_t ldd, unsigned c){
+        tally.add(px, w, h, ldd, c);
+    };
+    qagen_kernel_qerr *err;
+    std::unique_ptr<PixelSpool> spool;
     std::unique_ptr<PixelT[]> dest;
+    size_t lo[3], hi[3], outlen, n, first, got, z0, z1;
+    const DataT *dptr;
+    ScaleT dosegridscal, outscal;
     PixelT *dstptr;
-    OFCondition stat;
+    bool in_order;
+    DataT max;
 
-    write_grid_scaling(dset, dosegridscal);
-    dest = std::make_unique<PixelT[]>(n);
-    dstptr = dest.get();
-    /* Write each frame backwards */
-    dptr += framelen;
-    for (int k = 0; k < m_mhd.DimSize(2); k++) {
-        std::generate(dstptr, dstptr + framelen, [&dptr, dosegridscal](){
-            return static_cast<PixelT>(*--dptr / dosegridscal);
-        });
-        dptr += 2 * framelen;
-        dstptr += framelen;
+    /* A deepened pass reuses the maximum and box of the pass that gave up */
+    max = (m_scanned) ? (DataT)m_max : scan_source<DataT>(nthreads);
+    m_max = (double)max;
+    m_scanned = true;
+    if (m_opts.tolerance > 0.0 && !within_tolerance<PixelT>(max)) {
+        if constexpr (sizeof (PixelT) < sizeof (Uint32)) {
+            if (m_opts.jpegls) {
+                throw Exception(L"A 16-bit step exceeds the %g Gy tolerance, and JPEG-LS cannot go deeper",
+                                m_opts.tolerance);
+            }
+            qagen_log_printf(QAGEN_LOG_INFO, L"Deepening to 32 bits to stay within %g Gy", m_opts.tolerance);
+            convert_pixels<DataT, Uint32>(dset);
+            return;
+        } else {
+            throw Exception(L"Tolerance %g Gy is finer than a 32-bit step of %g Gy",
+                            m_opts.tolerance, (double)max * m_slope / std::numeric_limits<PixelT>::max());
+        }
+    }
+    dosegridscal = (ScaleT)max / (ScaleT)std::numeric_limits<PixelT>::max();
+    lo[0] = m_box.x0, lo[1] = m_box.y0, lo[2] = m_box.z0;
+    hi[0] = m_box.x1, hi[1] = m_box.y1, hi[2] = m_box.z1;
+    fmt.crop(lo, hi);
+    outlen = fmt.frame_size();
+    n = outlen * fmt.size(2);
+    in_order = fmt.in_order();
+    if (n * sizeof (PixelT) > 0xfffffffe) {
+        throw Exception(L"Pixel data is too large for DICOM: %zu bytes", n * sizeof (PixelT));
+    }
+    convert_geometry(dset, fmt);
+    /* Pixels are quantized from the raw voxels, the slope only changes what
+    one step is worth */
+    outscal = (m_slope == 1.0) ? dosegridscal : (ScaleT)(dosegridscal * m_slope);
+    write_grid_scaling(dset, outscal);
+    write_pixel_format<PixelT>(dset);
+    err = tally.errors();
+
+    if (m_writer || m_opts.stream) {
+        if (m_writer) {
+            m_writer->begin(*m_header, dset, n * sizeof (PixelT));
+        } else {
+            spool = std::make_unique<PixelSpool>();
+        }
+        /* Output that doesn't follow the source frames is held until the end */
+        dest = std::make_unique<PixelT[]>((in_order) ? outlen * std::min(slab, m_src->frames()) : n);
+        dstptr = dest.get();
+    } else if (m_opts.jpegls) {
+        /* Frames are encoded once they are all quantized */
+        dest = std::make_unique<PixelT[]>(n);
+        dstptr = dest.get();
+    } else {
+        dstptr = create_pixel_data<PixelT>(dset, n);
+    }
+    m_src->rewind();
+    while ((first = m_src->position()) < m_box.z1) {
+        dptr = static_cast<const DataT *>(m_src->next(slab, got));
+        if (!in_order) {
+            fmt.apply(dstptr, 0, dptr, first, got, dosegridscal, nthreads, err, tally_fn);
+            check_error(tally, outscal);
+            continue;
+        }
+        z0 = std::max(first, m_box.z0);
+        z1 = std::min(first + got, m_box.z1);
+        if (z0 >= z1) {
+            continue;
+        }
+        fmt.apply(dstptr, z0 - m_box.z0, dptr, first, got, dosegridscal, nthreads, err, tally_fn);
+        check_error(tally, outscal);
+        if (m_writer) {
+            m_writer->write(dstptr, (z1 - z0) * outlen * sizeof (PixelT));
+        } else if (spool) {
+            spool->write(dstptr, (z1 - z0) * outlen * sizeof (PixelT));
+        } else {
+            dstptr += (z1 - z0) * outlen;
+        }
+    }
+    tally.finish(outscal, m_mhd.ElementSpacing(), m_stats);
+    qagen_log_printf(QAGEN_LOG_INFO, L"Largest quantization error %g Gy, and %g relative above %g Gy",
+                     m_stats.max_error, m_stats.max_rel_error, m_stats.max * QAGEN_STATS_ERROR_FLOOR);
+    if (!in_order && m_writer) {
+        m_writer->write(dstptr, n * sizeof (PixelT));
+    } else if (!in_order && spool) {
+        spool->write(dstptr, n * sizeof (PixelT));
+    }
+    if (m_writer) {
+        m_writer->finish();
+    } else if (spool) {
+        insert_spooled_pixels(dset, *spool, n * sizeof (PixelT));
+    } else if (m_opts.jpegls) {
+        /* JPEG-LS tops out at 16 bits, the constructor already refused 32 */
+        if constexpr (std::is_same_v<PixelT, Uint16>) {
+            qagen_jpls_insert(dset, dest.get(), fmt.size(0), fmt.size(1), fmt.size(2), nthreads);
+        }
+    }
+}
+
+
+/** @brief Picks the pixel converter for this element type and output depth.
+ *      Each entry is its own instantiation, so the choice is made once here
+ *      rather than per voxel
+ *  @param type
+ *      MetaImage element type
+ *  @param bits
+ *      Output BitsAllocated
+ *  @returns The converter, or nullptr if this combination is not supported
+ */
+MHDConverter::pixel_fn MHDConverter::select_pixels(MET_ValueEnumType type, unsigned bits)
+{
+    static const struct {
+        MET_ValueEnumType type;
+        unsigned          bits;
+        pixel_fn          fn;
+    } table[] = {
+        { MET_FLOAT,  16, &MHDConverter::convert_pixels<float,  Uint16> },
+        { MET_FLOAT,  32, &MHDConverter::convert_pixels<float,  Uint32> },
+        { MET_DOUBLE, 16, &MHDConverter::convert_pixels<double, Uint16> },
+        { MET_DOUBLE, 32, &MHDConverter::convert_pixels<double, Uint32> },
+        { MET_SHORT,  16, &MHDConverter::convert_pixels<Sint16, Uint16> },
+        { MET_SHORT,  32, &MHDConverter::convert_pixels<Sint16, Uint32> },
+        { MET_USHORT, 16, &MHDConverter::convert_pixels<Uint16, Uint16> },
+        { MET_USHORT, 32, &MHDConverter::convert_pixels<Uint16, Uint32> }
+    };
+
+    for (const auto &ent : table) {
+        if (ent.type == type && ent.bits == bits) {
+            return ent.fn;
+        }
     }
-    stat = dset->putAndInsertUint8Array(DCM_PixelData, reinterpret_cast<Uint8 *>(dest.get()), static_cast<unsigned long>(n * sizeof (PixelT)));
-    Exception::ofcheck(stat, L"Failed to set the pixel data");
+    return nullptr;
 }
 
 
-MHDConverter::MHDConverter(const wchar_t *restrict mhd, const wchar_t *restrict tmplt)
+MHDConverter::MHDConverter(const wchar_t *restrict mhd,
+                           const struct qagen_metaio_template *tmplt,
+                           const struct qagen_metaio_opts *opts):
+    m_opts(),
+    m_slope(1.0),
+    m_box(),
+    m_max(0.0),
+    m_scanned(false),
+    m_stats(),
+    m_header(nullptr),
+    m_convert(nullptr)
 {
+    if (opts) {
+        m_opts = *opts;
+    }
+    if (m_opts.deflate < 0 || m_opts.deflate > 9) {
+        throw Exception(L"Deflate level must be 1 to 9, not %d", m_opts.deflate);
+    }
+    if (m_opts.jpegls && (m_opts.bits == 32 || m_opts.deflate || m_opts.direct || m_opts.stream)) {
+        throw Exception(L"JPEG-LS output is 16-bit, and cannot be deflated, written directly or streamed");
+    }
     load_template(tmplt);
     load_mhd(mhd);
 }
 
 
+MHDConverter::~MHDConverter()
+{
+
+}
+
+
 void MHDConverter::convert(const wchar_t *dst)
 {
     OFCondition stat;
@@ -307,8 +1237,18 @@ void MHDConverter::convert(const wchar_t *dst)
     convert_time(dset);
     convert_uid(dset);
     convert_strings(dset);
-    convert_geometry(dset);
-    convert_pixels<float, uint16_t>(dset);
-    stat = m_dcfile.saveFile(OFFilename(dst));
-    Exception::ofcheck(stat, L"Failed to save converted DICOM file");
+    /* The geometry is written by the pixel pass, once it knows the box */
+    if (m_header) {
+        m_writer = std::make_unique<Part10Writer>(dst, m_opts.deflate);
+        (this->*m_convert)(dset);
+    } else {
+        (this->*m_convert)(dset);
+        if (m_opts.jpegls) {
+            stat = m_dcfile.saveFile(OFFilename(dst), EXS_JPEGLSLossless);
+        } else {
+            stat = m_dcfile.saveFile(OFFilename(dst));
+        }
+        Exception::ofcheck(stat, L"Failed to save converted DICOM file");
+    }
+    qagen_stats_write(&m_stats, dst);
 }
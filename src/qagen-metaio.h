@@ -10,10 +10,166 @@
 #define QAGEN_METAIO_H
 
 #include "qagen-defs.h"
+#include "qagen-error.h"
+#include "qagen-stats.h"
 
 EXTERN_C_START
 
 
+/** Conversion options. Zero-initialize this for the defaults */
+struct qagen_metaio_opts {
+    unsigned nthreads;  /* Threads used to split each volume by slice. Zero
+                        uses one per logical processor */
+    bool     stream;    /* Spool the pixels through a temp file a slab at a
+                        time, instead of holding the whole output in memory.
+                        Data that cannot be mapped or read directly falls back
+                        to a normal MetaIO read */
+    unsigned bits;      /* Output BitsAllocated, 16 or 32. Zero means 16 */
+    bool     direct;    /* Write the file directly from a header encoded once
+                        per template, streaming the pixels straight to disk,
+                        instead of building and saving a DcmFileFormat */
+    unsigned nworkers;  /* Volumes converted at once by a batch conversion.
+                        Zero converts up to QAGEN_METAIO_WORKERS at once. The
+                        nthreads above are shared between them */
+    bool     crop;      /* Only write the bounding box of the voxels above
+                        crop_threshold. Dose inside the box is unchanged */
+    double   crop_threshold;    /* In source units, before any NIfTI slope */
+    int      deflate;   /* Save as Deflated Explicit VR Little Endian at this
+                        zlib level, 1 (fastest) to 9 (smallest). Zero saves
+                        uncompressed. Deflated files are always written
+                        directly, and deflate on a thread of their own,
+                        overlapping the quantizer */
+    bool     jpegls;    /* Save as JPEG-LS lossless, one fragment per frame,
+                        with the frames encoded in parallel. Only 16-bit, and
+                        not with deflate, direct or stream */
+    double   tolerance; /* Largest acceptable quantization error, in Gy.
+                        When positive, bits is only the shallowest depth
+                        tried: the output is deepened to 32 bits if a 16-bit
+                        step would exceed this, and the conversion fails if
+                        even a 32-bit step would, or if any voxel is measured
+                        past it. Zero always writes bits */
+    double   rel_tolerance; /* Largest acceptable quantization error relative
+                            to the voxel's dose, checked as each slab is
+                            written for voxels above QAGEN_STATS_ERROR_FLOOR
+                            of the maximum. Zero disables the check */
+    const wchar_t *cache;   /* Directory of previously converted Dose_Beams,
+                            reused while their MHD, voxel data, template and
+                            options are unchanged. NULL disables the cache */
+    uint64_t cache_max;     /* Bytes kept in the cache before the least
+                            recently used entries are evicted. Zero means
+                            QAGEN_METAIO_CACHE_MAX */
+};
+
+
+/** Default worker count for batch conversions. Past this the disk is usually
+ *  the bottleneck anyway */
+#define QAGEN_METAIO_WORKERS 4
+
+
+/** Default size cap of the conversion cache */
+#define QAGEN_METAIO_CACHE_MAX (4ULL << 30)
+
+
+/** Result of one item of a batch conversion */
+struct qagen_metaio_status {
+    int result;                 /* Zero on success, positive on error, and
+                                negative if the item was never converted
+                                because the batch was cancelled */
+    struct qagen_error error;   /* The error raised by this item, if it failed */
+    struct qagen_dose_stats stats;  /* Dose statistics of its output, if it
+                                    succeeded */
+};
+
+
+/** @brief Batch progress callback. This is always called on the thread that
+ *      called qagen_metaio_convert_batch, once for each item as it finishes
+ *  @param idx
+ *      Index of the item that finished
+ *  @param status
+ *      Its result
+ *  @param data
+ *      User data
+ *  @returns false to cancel every item that has not started yet
+ */
+typedef bool (*qagen_metaio_progress_fn)(size_t idx, const struct qagen_metaio_status *status, void *data);
+
+
+/** A parsed RD template, without its PixelData. Load this once per patient
+ *  and share it between every Dose_Beam conversion */
+struct qagen_metaio_template;
+
+
+/** @brief Parses the RD template at @p path, stopping before PixelData
+ *  @param path
+ *      Path to DICOM template file
+ *  @returns The template, or NULL on error. Free this with
+ *      qagen_metaio_template_free
+ */
+struct qagen_metaio_template *qagen_metaio_template_load(const wchar_t *path);
+
+
+/** @brief Frees a template loaded by qagen_metaio_template_load
+ *  @param tmplt
+ *      Template, may be NULL
+ */
+void qagen_metaio_template_free(struct qagen_metaio_template *tmplt);
+
+
+/** @brief Convert the given @p mhd file to a DICOM file at @p dst, starting
+ *      from a clone of the cached template @p tmplt. Its dose statistics are
+ *      written next to it, see qagen_stats_write
+ *  @param mhd
+ *      Path to MHD file. A NIfTI-1 file (.nii or .nii.gz) works too
+ *  @param dst
+ *      Path to destination DICOM file
+ *  @param tmplt
+ *      Cached template
+ *  @param opts
+ *      Conversion options, or NULL for the defaults
+ *  @returns Nonzero on error
+ *  @note This may be called from several threads at once with the same
+ *      template
+ */
+int qagen_metaio_convert_cached(const wchar_t *restrict mhd,
+                                const wchar_t *restrict dst,
+                                const struct qagen_metaio_template *tmplt,
+                                const struct qagen_metaio_opts *opts);
+
+
+/** @brief Converts every file in @p mhd to a DICOM file of the same name in
+ *      @p outdir, several at a time
+ *  @details The template is parsed once and shared. Each output is named after
+ *      its MHD with the extension replaced by .dcm. Items are independent, so
+ *      one failure does not stop the others
+ *  @param mhd
+ *      Array of paths to MHD files
+ *  @param n
+ *      Number of paths in @p mhd
+ *  @param tmplt
+ *      Path to DICOM template file
+ *  @param outdir
+ *      Output directory
+ *  @param opts
+ *      Conversion options, or NULL for the defaults
+ *  @param[out] status
+ *      Array of @p n per-item results, or NULL if you don't care
+ *  @param progress
+ *      Progress callback, may be NULL
+ *  @param data
+ *      User data passed to @p progress
+ *  @returns Nonzero if the template could not be loaded, or any item failed.
+ *      The error state is that of the first failed item
+ */
+int qagen_metaio_convert_batch(const wchar_t *const      *mhd,
+                               size_t                     n,
+                               const wchar_t *restrict    tmplt,
+                               const wchar_t *restrict    outdir,
+                               const struct qagen_metaio_opts *opts,
+                               struct qagen_metaio_status *status,
+                               qagen_metaio_progress_fn   progress,
+                               void                      *data);
+
+
 /** @brief Convert the given @p mhd file to a DICOM file at @p dst
  *  @param mhd
  *      Path to MHD file
@@ -22,13 +178,16 @@ EXTERN_C_START
  *  @param tmplt
  *      Path to DICOM template file (remember, use a TPS dose file if a template
  *      cannot be found)
+ *  @param opts
+ *      Conversion options, or NULL for the defaults
  *  @returns Nonzero on error
  *  @note @p dst should be the *exact* path to the output file, including the
  *      desired file extension
  */
 int qagen_metaio_convert(const wchar_t *restrict mhd,
                          const wchar_t *restrict dst,
-                         const wchar_t *restrict tmplt);
+                         const wchar_t *restrict tmplt,
+                         const struct qagen_metaio_opts *opts);
 
 
 EXTERN_C_END
@@ -36,8 +195,14 @@ EXTERN_C_END
 #if defined(__cplusplus) || __cplusplus
 #   include <dcmtk/dcmdata/dcdatset.h>
 #   include <dcmtk/dcmdata/dcfilefo.h>
+#   include <memory>
 #   include <metaImage.h>
 
+class SlabSource;
+class Part10Header;
+class Part10Writer;
+class Reformat;
+
 
 /** @class Loads MHD files and their data, and writes them out to DICOM RTDose
  *      files
@@ -71,32 +236,88 @@ public:
         static void ofcheck(OFCondition stat, const wchar_t *msg);
     };
 
+    /** @struct Output sub-grid, as half-open source voxel index ranges */
+    struct Box {
+        std::size_t x0, x1;
+        std::size_t y0, y1;
+        std::size_t z0, z1;
+    };
+
 private:
     DcmFileFormat m_dcfile;
     MetaImage     m_mhd;
 
+    struct qagen_metaio_opts m_opts;
+
+    double m_slope;     /* Source voxel scale, folded into DoseGridScaling */
+
+    std::unique_ptr<SlabSource> m_src;  /* Voxel data, however it was read */
+
+    Box m_box;          /* Part of the source that is written. The whole grid
+                        unless cropping */
+
+    double m_max;       /* Source maximum, once a shallower pass has found it */
+    bool   m_scanned;
+
+    struct qagen_dose_stats m_stats;    /* Of the output, set by the pixel
+                                        pass */
+
+    const Part10Header *m_header;       /* Cached template header, if writing
+                                        directly. Owned by the template */
+    std::unique_ptr<Part10Writer> m_writer;
+
+    /** Quantizes the source into PixelData, for one combination of element
+     *  type and output pixel depth */
+    typedef void (MHDConverter::*pixel_fn)(DcmDataset *dset);
+
+    pixel_fn m_convert;     /* Picked by check_mhd() */
+
     static const wchar_t *m_failmsg;
 
-    void load_template(const wchar_t *fname);
+    static pixel_fn select_pixels(MET_ValueEnumType type, unsigned bits);
+
+    void load_template(const struct qagen_metaio_template *tmplt);
+    void check_mhd();
+    bool open_source(const wchar_t *fname);
     void load_mhd(const wchar_t *fname);
+    void load_nifti(const wchar_t *fname);
 
     void convert_time(DcmDataset *dset);
     void convert_uid(DcmDataset *dset);
     void convert_strings(DcmDataset *dset);
 
-    void convert_grid_frame_offset_vector(DcmDataset *dset);
-    void convert_geometry(DcmDataset *dset);
+    void convert_grid_frame_offset_vector(DcmDataset *dset, const Reformat &fmt);
+    void convert_geometry(DcmDataset *dset, const Reformat &fmt);
 
     template <class DataT>
     void write_grid_scaling(DcmDataset *dset, DataT dosegridscaling);
 
+    template <class PixelT>
+    void write_pixel_format(DcmDataset *dset);
+
     template <class DataT, class PixelT>
     void convert_pixels(DcmDataset *dset);
 
+    template <class DataT>
+    DataT scan_source(unsigned nthreads);
+
+    template <class PixelT, class DataT>
+    bool within_tolerance(DataT max) const noexcept;
+
+    template <class PixelT>
+    void check_error(const DoseTally<PixelT> &tally, double scal) const;
+
 public:
-    MHDConverter(const wchar_t *restrict mhd, const wchar_t *restrict tmplt);
+    MHDConverter(const wchar_t *restrict mhd,
+                 const struct qagen_metaio_template *tmplt,
+                 const struct qagen_metaio_opts *opts);
+
+    ~MHDConverter();
 
+    /** @brief Writes the RTDose file, and its dose statistics next to it */
     void convert(const wchar_t *dst);
+
+    const struct qagen_dose_stats &stats() const noexcept { return m_stats; }
 };
 
 
@@ -0,0 +1,247 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <zlib.h>
+#include "qagen-nifti.h"
+#include "qagen-metaio.h"
+#include "qagen-source.h"
+
+
+/** The on-disk NIfTI-1 header. Every field is naturally aligned, so there is
+ *  no padding to worry about */
+struct nifti_1_header {
+    int32_t sizeof_hdr;
+    char    data_type[10];
+    char    db_name[18];
+    int32_t extents;
+    int16_t session_error;
+    char    regular;
+    char    dim_info;
+    int16_t dim[8];
+    float   intent_p1, intent_p2, intent_p3;
+    int16_t intent_code;
+    int16_t datatype;
+    int16_t bitpix;
+    int16_t slice_start;
+    float   pixdim[8];
+    float   vox_offset;
+    float   scl_slope, scl_inter;
+    int16_t slice_end;
+    char    slice_code;
+    char    xyzt_units;
+    float   cal_max, cal_min;
+    float   slice_duration;
+    float   toffset;
+    int32_t glmax, glmin;
+    char    descrip[80];
+    char    aux_file[24];
+    int16_t qform_code, sform_code;
+    float   quatern_b, quatern_c, quatern_d;
+    float   qoffset_x, qoffset_y, qoffset_z;
+    float   srow_x[4], srow_y[4], srow_z[4];
+    char    intent_name[16];
+    char    magic[4];
+};
+
+static_assert(sizeof (struct nifti_1_header) == 348);
+
+
+/** @brief Maps a NIfTI datatype code onto the MetaIO element type */
+static MET_ValueEnumType nifti_type(int16_t datatype)
+{
+    switch (datatype) {
+    case 4:     /* DT_INT16 */
+        return MET_SHORT;
+    case 16:    /* DT_FLOAT32 */
+        return MET_FLOAT;
+    case 64:    /* DT_FLOAT64 */
+        return MET_DOUBLE;
+    case 512:   /* DT_UINT16 */
+        return MET_USHORT;
+    default:
+        throw MHDConverter::Exception(L"Unsupported NIfTI datatype %d", datatype);
+    }
+}
+
+
+NiftiReader::NiftiReader(const wchar_t *path):
+    m_path(path),
+    m_gzip(false),
+    m_slope(1.0)
+{
+    struct nifti_1_header hdr;
+    unsigned char magic[2];
+    gzFile gz;
+    FILE *fp;
+    int nread;
+
+    fp = _wfopen(path, L"rb");
+    if (!fp) {
+        throw MHDConverter::Exception(errno, L"Cannot open NIfTI file");
+    }
+    m_gzip = std::fread(magic, 1, 2, fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    std::fclose(fp);
+
+    /* gzread passes plain files straight through */
+    gz = gzopen_w(path, "rb");
+    if (!gz) {
+        throw MHDConverter::Exception(errno, L"Cannot open NIfTI file");
+    }
+    nread = gzread(gz, &hdr, sizeof hdr);
+    gzclose(gz);
+    if (nread != (int)sizeof hdr) {
+        throw MHDConverter::Exception(L"NIfTI header is truncated");
+    }
+    if (hdr.sizeof_hdr != 348) {
+        throw MHDConverter::Exception(L"Not a little-endian NIfTI-1 file");
+    }
+    if (std::memcmp(hdr.magic, "n+1", 4)) {
+        throw MHDConverter::Exception(L"Only single-file NIfTI-1 is supported");
+    }
+    if (hdr.dim[0] < 3 || hdr.dim[0] > 7) {
+        throw MHDConverter::Exception(L"NIfTI has invalid dimensionality %d", hdr.dim[0]);
+    }
+    for (int i = 4; i <= hdr.dim[0]; i++) {
+        if (hdr.dim[i] > 1) {
+            throw MHDConverter::Exception(L"NIfTI has %d volumes, expected one", hdr.dim[i]);
+        }
+    }
+    m_type = nifti_type(hdr.datatype);
+    for (int i = 0; i < 3; i++) {
+        if (hdr.dim[i + 1] < 1) {
+            throw MHDConverter::Exception(L"NIfTI has invalid dimension %d along axis %d", hdr.dim[i + 1], i);
+        }
+        m_dim[i] = hdr.dim[i + 1];
+        m_spacing[i] = std::fabs(hdr.pixdim[i + 1]);
+    }
+    if (hdr.scl_slope != 0.0f && std::isfinite(hdr.scl_slope)) {
+        m_slope = hdr.scl_slope;
+    }
+    if (m_slope < 0.0 || (hdr.scl_inter != 0.0f && std::isfinite(hdr.scl_inter))) {
+        throw MHDConverter::Exception(L"NIfTI scaling %g * x + %g cannot be expressed as a DoseGridScaling",
+                                      m_slope, hdr.scl_inter);
+    }
+    m_offset = (long long)hdr.vox_offset;
+    if (m_offset < 348) {
+        throw MHDConverter::Exception(L"Invalid NIfTI vox_offset %lld", m_offset);
+    }
+    if (hdr.sform_code <= 0) {
+        /* Only the sform brings its own spacing */
+        for (int i = 0; i < 3; i++) {
+            if (!(m_spacing[i] > 0.0)) {
+                throw MHDConverter::Exception(L"NIfTI has invalid spacing %g along axis %d", m_spacing[i], i);
+            }
+        }
+    }
+    if (hdr.sform_code > 0) {
+        read_sform(hdr);
+    } else if (hdr.qform_code > 0) {
+        read_qform(hdr);
+    } else {
+        /* Method 1 in the standard: just the voxel grid */
+        std::memset(m_origin, 0, sizeof m_origin);
+        std::memset(m_axes, 0, sizeof m_axes);
+        m_axes[0] = m_axes[4] = m_axes[8] = 1.0;
+    }
+}
+
+
+/** @brief The quaternion method. NIfTI is RAS, so the first two components
+ *      are negated on the way to LPS
+ */
+void NiftiReader::read_qform(const struct nifti_1_header &hdr)
+{
+    const double qfac = (hdr.pixdim[0] < 0.0f) ? -1.0 : 1.0;
+    double a, b = hdr.quatern_b, c = hdr.quatern_c, d = hdr.quatern_d;
+    double r[3][3], s;
+
+    a = 1.0 - (b * b + c * c + d * d);
+    if (a < 1.0e-7) {
+        /* 180 degrees, so the quaternion needs normalizing */
+        s = 1.0 / std::sqrt(b * b + c * c + d * d);
+        b *= s;
+        c *= s;
+        d *= s;
+        a = 0.0;
+    } else {
+        a = std::sqrt(a);
+    }
+    r[0][0] = a * a + b * b - c * c - d * d;
+    r[0][1] = 2.0 * (b * c - a * d);
+    r[0][2] = 2.0 * (b * d + a * c) * qfac;
+    r[1][0] = 2.0 * (b * c + a * d);
+    r[1][1] = a * a + c * c - b * b - d * d;
+    r[1][2] = 2.0 * (c * d - a * b) * qfac;
+    r[2][0] = 2.0 * (b * d - a * c);
+    r[2][1] = 2.0 * (c * d + a * b);
+    r[2][2] = (a * a + d * d - c * c - b * b) * qfac;
+    for (int axis = 0; axis < 3; axis++) {
+        m_axes[3 * axis + 0] = -r[0][axis];
+        m_axes[3 * axis + 1] = -r[1][axis];
+        m_axes[3 * axis + 2] = r[2][axis];
+    }
+    m_origin[0] = -hdr.qoffset_x;
+    m_origin[1] = -hdr.qoffset_y;
+    m_origin[2] = hdr.qoffset_z;
+}
+
+
+/** @brief The affine method. Spacing comes from the column norms, which is
+ *      what the affine actually applies, rather than pixdim
+ */
+void NiftiReader::read_sform(const struct nifti_1_header &hdr)
+{
+    const float *const row[3] = { hdr.srow_x, hdr.srow_y, hdr.srow_z };
+    double norm;
+
+    for (int axis = 0; axis < 3; axis++) {
+        norm = std::sqrt(row[0][axis] * row[0][axis]
+                       + row[1][axis] * row[1][axis]
+                       + row[2][axis] * row[2][axis]);
+        if (!(norm > 0.0)) {
+            throw MHDConverter::Exception(L"NIfTI sform is singular");
+        }
+        m_spacing[axis] = norm;
+        m_axes[3 * axis + 0] = -row[0][axis] / norm;
+        m_axes[3 * axis + 1] = -row[1][axis] / norm;
+        m_axes[3 * axis + 2] = row[2][axis] / norm;
+    }
+    m_origin[0] = -row[0][3];
+    m_origin[1] = -row[1][3];
+    m_origin[2] = row[2][3];
+}
+
+
+bool NiftiReader::is_nifti(const wchar_t *path) noexcept
+{
+    const std::size_t len = wcslen(path);
+
+    return (len > 4 && !_wcsicmp(path + len - 4, L".nii"))
+        || (len > 7 && !_wcsicmp(path + len - 7, L".nii.gz"));
+}
+
+
+void NiftiReader::describe(MetaImage &mhd) const
+{
+    if (!mhd.InitializeEssential(3, m_dim, m_spacing, m_type, 1, nullptr, false)) {
+        throw MHDConverter::Exception(L"Cannot describe NIfTI volume");
+    }
+    mhd.Origin(m_origin);
+    mhd.TransformMatrix(m_axes);
+}
+
+
+std::unique_ptr<SlabSource> NiftiReader::source(std::size_t framesz) const
+{
+    std::unique_ptr<MappedFileSource> map;
+
+    if (m_gzip) {
+        return std::make_unique<InflateSource>(m_path.c_str(), 0, 0, framesz, m_dim[2], (std::size_t)m_offset);
+    }
+    map = std::make_unique<MappedFileSource>(framesz, m_dim[2]);
+    if (map->map(m_path.c_str(), m_offset)) {
+        return map;
+    }
+    return std::make_unique<RawFileSource>(m_path.c_str(), m_offset, framesz, m_dim[2]);
+}
@@ -0,0 +1,67 @@
+#pragma once
+/** @file A small NIfTI-1 reader, so that .nii.gz Dose_Beams can go through
+ *      MHDConverter instead of pulling all of ITK into the app
+ *
+ *  Only the single-file format is read (n+1, not the .hdr/.img pair), in
+ *  little-endian order, with three spatial dimensions
+ */
+#ifndef QAGEN_NIFTI_H
+#define QAGEN_NIFTI_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <memory>
+#include <string>
+#include <metaImage.h>
+
+class SlabSource;
+struct nifti_1_header;
+
+
+/** @class Reads a NIfTI-1 header and opens its voxels as a slab source */
+class NiftiReader {
+    std::wstring m_path;
+    bool         m_gzip;
+
+    MET_ValueEnumType m_type;
+    int       m_dim[3];
+    double    m_spacing[3];
+    double    m_origin[3];      /* LPS */
+    double    m_axes[9];        /* Row i is the LPS direction of axis i, which
+                                is MetaIO's TransformMatrix layout */
+    double    m_slope;
+    long long m_offset;         /* Offset of the voxels, after decompression */
+
+    void read_qform(const struct nifti_1_header &hdr);
+    void read_sform(const struct nifti_1_header &hdr);
+
+public:
+    /** @brief Reads the header of @p path, which may be gzipped
+     *  @throws MHDConverter::Exception if it can't be read or isn't supported
+     */
+    NiftiReader(const wchar_t *path);
+
+    /** @brief Returns true if @p path looks like a NIfTI file, by extension */
+    static bool is_nifti(const wchar_t *path) noexcept;
+
+    /** @brief Fills in @p mhd's header fields as if it had been read from an
+     *      MHD. No element data is allocated
+     */
+    void describe(MetaImage &mhd) const;
+
+    /** Voxel value scale. The intercept must be zero */
+    double slope() const noexcept { return m_slope; }
+
+    /** @brief Opens the voxels, inflating them on the fly if gzipped
+     *  @param framesz
+     *      Bytes per frame
+     */
+    std::unique_ptr<SlabSource> source(std::size_t framesz) const;
+};
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_NIFTI_H */
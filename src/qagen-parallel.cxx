@@ -0,0 +1,94 @@
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include "qagen-parallel.h"
+
+
+struct qagen_parallel_job {
+    const qagen_parallel_fn *fn;
+    std::size_t              n;
+    unsigned                 nchunks;
+
+    std::atomic<unsigned> next;     /* Next unclaimed chunk */
+
+    std::mutex         errlock;
+    std::exception_ptr err;         /* First exception thrown by a chunk */
+};
+
+
+/** @brief Claims and runs chunks until none remain */
+static void qagen_parallel_run(struct qagen_parallel_job *job)
+{
+    std::size_t begin, end;
+    unsigned c;
+
+    while ((c = job->next.fetch_add(1)) < job->nchunks) {
+        begin = job->n * c / job->nchunks;
+        end = job->n * (c + 1) / job->nchunks;
+        try {
+            (*job->fn)(begin, end, c);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job->errlock);
+            if (!job->err) {
+                job->err = std::current_exception();
+            }
+        }
+    }
+}
+
+
+static VOID CALLBACK qagen_parallel_callback(PTP_CALLBACK_INSTANCE inst,
+                                             PVOID                 ctx,
+                                             PTP_WORK              work)
+{
+    (void)inst;
+    (void)work;
+    qagen_parallel_run(reinterpret_cast<struct qagen_parallel_job *>(ctx));
+}
+
+
+unsigned qagen_parallel_threads(unsigned nthreads)
+{
+    DWORD ncpu;
+
+    if (nthreads) {
+        return nthreads;
+    }
+    ncpu = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return (ncpu) ? (unsigned)ncpu : 1;
+}
+
+
+void qagen_parallel_for(std::size_t n, unsigned nchunks, const qagen_parallel_fn &fn)
+{
+    struct qagen_parallel_job job;
+    PTP_WORK work = NULL;
+    unsigned i;
+
+    if (!n) {
+        return;
+    }
+    nchunks = (nchunks < 1) ? 1 : nchunks;
+    nchunks = (nchunks > n) ? (unsigned)n : nchunks;
+    job.fn = &fn;
+    job.n = n;
+    job.nchunks = nchunks;
+    job.next = 0;
+    if (nchunks > 1) {
+        /* If the pool won't give us a work object, we just do it all here */
+        work = CreateThreadpoolWork(qagen_parallel_callback, &job, NULL);
+    }
+    if (work) {
+        for (i = 1; i < nchunks; i++) {
+            SubmitThreadpoolWork(work);
+        }
+    }
+    qagen_parallel_run(&job);
+    if (work) {
+        WaitForThreadpoolWorkCallbacks(work, FALSE);
+        CloseThreadpoolWork(work);
+    }
+    if (job.err) {
+        std::rethrow_exception(job.err);
+    }
+}
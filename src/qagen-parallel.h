@@ -0,0 +1,52 @@
+#pragma once
+/** @file Splits index ranges across the process thread pool
+ *
+ *  This is a thin wrapper over the Win32 default thread pool. The calling
+ *  thread always takes part in the work, so nesting these (e.g. a beam worker
+ *  that splits its own slices) cannot starve
+ */
+#ifndef QAGEN_PARALLEL_H
+#define QAGEN_PARALLEL_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstddef>
+#include <functional>
+
+
+/** Chunk callback: first index, one past the last index, and chunk number */
+using qagen_parallel_fn = std::function<void(std::size_t, std::size_t, unsigned)>;
+
+
+/** @brief Resolves a requested thread count
+ *  @param nthreads
+ *      Requested number of threads. Zero means one per logical processor
+ *  @returns The number of threads to use, at least one
+ */
+unsigned qagen_parallel_threads(unsigned nthreads);
+
+
+/** @brief Splits [0, @p n) into at most @p nchunks contiguous chunks and runs
+ *      @p fn on each of them concurrently
+ *  @details Chunk c always covers [n * c / nchunks, n * (c + 1) / nchunks), so
+ *      results stored by chunk number can be merged deterministically. This
+ *      returns after every chunk has completed
+ *  @param n
+ *      Number of items
+ *  @param nchunks
+ *      Number of chunks, which is also the maximum concurrency. Clamped to
+ *      [1, n]
+ *  @param fn
+ *      Chunk callback
+ *  @throws Whatever the first failing chunk threw, rethrown on this thread
+ *  @warning The error state is thread-local. Chunks must not raise application
+ *      errors, they will not be visible on the calling thread
+ */
+void qagen_parallel_for(std::size_t n, unsigned nchunks, const qagen_parallel_fn &fn);
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_PARALLEL_H */
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <zlib.h>
+#include "qagen-part10.h"
+#include "qagen-metaio.h"
+#include "qagen-log.h"
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcostrmb.h>
+#include <dcmtk/dcmdata/dcuid.h>
+#include <dcmtk/dcmdata/dcvr.h>
+
+
+static void put16(std::string &out, Uint16 val)
+{
+    out += static_cast<char>(val & 0xff);
+    out += static_cast<char>(val >> 8);
+}
+
+
+static void put32(std::string &out, Uint32 val)
+{
+    put16(out, static_cast<Uint16>(val & 0xffff));
+    put16(out, static_cast<Uint16>(val >> 16));
+}
+
+
+/** @brief Appends an Explicit VR Little Endian element header */
+static void put_header(std::string &out, const DcmTagKey &tag, DcmEVR evr, std::size_t len)
+{
+    const DcmVR vr(evr);
+
+    put16(out, tag.getGroup());
+    put16(out, tag.getElement());
+    out.append(vr.getValidVRName(), 2);
+    if (vr.usesExtendedLengthEncoding()) {
+        put16(out, 0);
+        put32(out, static_cast<Uint32>(len));
+    } else if (len > 0xfffe) {
+        throw MHDConverter::Exception(L"Value of (%04x,%04x) is too long for its VR: %zu bytes",
+                                      tag.getGroup(), tag.getElement(), len);
+    } else {
+        put16(out, static_cast<Uint16>(len));
+    }
+}
+
+
+/** @brief Appends a complete string element, padded to even length */
+static void put_string(std::string &out, const DcmTagKey &tag, DcmEVR evr, const OFString &val)
+{
+    const bool odd = val.length() & 1;
+
+    put_header(out, tag, evr, val.length() + odd);
+    out.append(val.c_str(), val.length());
+    if (odd) {
+        out += (evr == EVR_UI) ? '\0' : ' ';
+    }
+}
+
+
+/** @brief Lets DCMTK encode a single element. This is only done for the
+ *      static parts of the template, and for odd slot VRs
+ */
+static std::string encode_object(DcmObject *obj)
+{
+    const E_TransferSyntax xfer = EXS_LittleEndianExplicit;
+    const Uint32 len = obj->calcElementLength(xfer, EET_ExplicitLength);
+    std::string res(len, '\0');
+    offile_off_t filled;
+    OFCondition stat;
+    void *buf;
+
+    DcmOutputBufferStream out(res.data(), len);
+    obj->transferInit();
+    stat = obj->write(out, xfer, EET_ExplicitLength, nullptr);
+    obj->transferEnd();
+    if (stat.bad()) {
+        throw MHDConverter::Exception(stat, L"Cannot encode template element (%04x,%04x)",
+                                      obj->getGTag(), obj->getETag());
+    }
+    out.flushBuffer(buf, filled);
+    res.resize(static_cast<std::size_t>(filled));
+    return res;
+}
+
+
+/** @brief Appends @p beam's value for @p tag
+ *  @returns false if @p beam doesn't have it
+ */
+static bool encode_slot(DcmDataset *beam, const DcmTagKey &tag, std::string &out)
+{
+    DcmElement *elem = nullptr;
+    OFString str;
+    Uint16 val;
+
+    if (beam->findAndGetElement(tag, elem).bad() || !elem) {
+        return false;
+    }
+    if (elem->ident() == EVR_US && elem->getVM() == 1) {
+        MHDConverter::Exception::ofcheck(elem->getUint16(val), L"Cannot read per-beam element");
+        put_header(out, tag, EVR_US, sizeof val);
+        put16(out, val);
+    } else if (elem->isaString()) {
+        MHDConverter::Exception::ofcheck(elem->getOFStringArray(str), L"Cannot read per-beam element");
+        put_string(out, tag, elem->ident(), str);
+    } else {
+        out += encode_object(elem);
+    }
+    return true;
+}
+
+
+Part10Header::Part10Header(DcmDataset *tmplt, const DcmTagKey *slots, std::size_t nslots)
+{
+    DcmDataset copy(*tmplt);
+    DcmObject *obj = nullptr;
+    OFString sopclass;
+    std::size_t k;
+
+    for (k = 0; k < nslots; k++) {
+        if (slots[k] != DCM_PixelData) {
+            m_slots.push_back(slots[k]);
+        }
+    }
+    std::sort(m_slots.begin(), m_slots.end());
+    m_segments.resize(m_slots.size() + 1);
+    m_defaults.resize(m_slots.size());
+
+    if (copy.findAndGetOFString(DCM_SOPClassUID, sopclass).good()) {
+        m_sopclass = sopclass.c_str();
+    } else {
+        m_sopclass = UID_RTDoseStorage;
+    }
+    /* Group lengths would be wrong as soon as a slot changes size */
+    copy.computeGroupLengthAndPadding(EGL_withoutGL, EPD_noChange, EXS_LittleEndianExplicit);
+    while ((obj = copy.nextInContainer(obj))) {
+        const DcmTagKey tag = obj->getTag();
+
+        if (tag >= DCM_PixelData) {
+            qagen_log_printf(QAGEN_LOG_DEBUG, L"Dropping template element (%04x,%04x) past PixelData",
+                             tag.getGroup(), tag.getElement());
+            continue;
+        }
+        k = std::lower_bound(m_slots.begin(), m_slots.end(), tag) - m_slots.begin();
+        if (k < m_slots.size() && m_slots[k] == tag) {
+            m_defaults[k] = encode_object(obj);
+        } else {
+            m_segments[k] += encode_object(obj);
+        }
+    }
+}
+
+
+std::size_t Part10Header::encode(DcmDataset *beam, std::size_t pixelsz, bool deflated, std::string &out) const
+{
+    const char *xfer = (deflated) ? UID_DeflatedExplicitVRLittleEndianTransferSyntax
+                                  : UID_LittleEndianExplicitTransferSyntax;
+    OFString sopinst;
+    std::string meta;
+    std::size_t res;
+
+    if (beam->findAndGetOFString(DCM_SOPInstanceUID, sopinst).bad()) {
+        throw MHDConverter::Exception(L"Output has no SOPInstanceUID");
+    }
+    /* File meta information, always written by hand */
+    put_header(meta, DCM_FileMetaInformationVersion, EVR_OB, 2);
+    meta += '\0';
+    meta += '\1';
+    put_string(meta, DCM_MediaStorageSOPClassUID, EVR_UI, m_sopclass.c_str());
+    put_string(meta, DCM_MediaStorageSOPInstanceUID, EVR_UI, sopinst);
+    put_string(meta, DCM_TransferSyntaxUID, EVR_UI, xfer);
+    put_string(meta, DCM_ImplementationClassUID, EVR_UI, OFFIS_IMPLEMENTATION_CLASS_UID);
+    put_string(meta, DCM_ImplementationVersionName, EVR_SH, OFFIS_DTK_IMPLEMENTATION_VERSION_NAME);
+
+    out.assign(128, '\0');
+    out += "DICM";
+    put_header(out, DCM_FileMetaInformationGroupLength, EVR_UL, 4);
+    put32(out, static_cast<Uint32>(meta.size()));
+    out += meta;
+    res = out.size();
+
+    for (std::size_t k = 0; k < m_slots.size(); k++) {
+        out += m_segments[k];
+        if (!encode_slot(beam, m_slots[k], out)) {
+            out += m_defaults[k];
+        }
+    }
+    out += m_segments.back();
+    put_header(out, DCM_PixelData, EVR_OW, pixelsz);
+    return res;
+}
+
+
+/** @class Raw deflate into a file, on a thread of its own. Writes are copied
+ *      into a short queue, so the caller can go back to quantizing while the
+ *      last slab is compressed
+ */
+class Part10Deflater {
+    static constexpr std::size_t queue_max = 2;         /* Pending buffers */
+    static constexpr std::size_t outbuf_size = 1 << 18;
+
+    std::FILE  *m_fp;
+    z_stream    m_zs;
+    bool        m_zinit;
+    std::size_t m_outlen;   /* Compressed bytes written */
+
+    std::unique_ptr<unsigned char[]> m_outbuf;
+
+    std::mutex              m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::vector<unsigned char>> m_queue;
+    std::vector<std::vector<unsigned char>> m_spare;    /* Buffers to reuse */
+    bool m_closing;
+    int  m_errno;       /* Set by a failed write */
+    int  m_zerr;        /* Set by a zlib failure */
+
+    std::thread m_thread;   /* Last, so that everything above exists first */
+
+    /** @brief Records a failure for the writer to throw */
+    bool fail(int err, int zerr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_errno = err;
+            m_zerr = zerr;
+        }
+        m_cv.notify_all();
+        return false;
+    }
+
+    /** @brief Deflates @p size bytes with @p flush, and writes whatever comes
+     *      out. This runs on the deflate thread, without the lock
+     *  @returns false on error
+     */
+    bool deflate_buffer(const unsigned char *buf, std::size_t size, int flush)
+    {
+        unsigned char *const out = m_outbuf.get();
+        std::size_t have;
+        int zres;
+
+        m_zs.next_in = const_cast<unsigned char *>(buf);
+        m_zs.avail_in = static_cast<uInt>(size);
+        do {
+            m_zs.next_out = out;
+            m_zs.avail_out = static_cast<uInt>(outbuf_size);
+            zres = ::deflate(&m_zs, flush);
+            if (zres == Z_STREAM_ERROR) {
+                return fail(0, zres);
+            }
+            have = outbuf_size - m_zs.avail_out;
+            if (std::fwrite(out, 1, have, m_fp) != have) {
+                return fail(errno, 0);
+            }
+            m_outlen += have;
+        } while (m_zs.avail_out == 0);
+        return true;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        std::vector<unsigned char> buf;
+        bool ok = true;
+
+        for (;;) {
+            m_cv.wait(lock, [this] { return !m_queue.empty() || m_closing; });
+            if (m_queue.empty()) {
+                break;
+            }
+            buf = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+            m_cv.notify_all();
+            /* After a failure the queue is still drained, so the writer
+            never waits on it forever */
+            ok = ok && deflate_buffer(buf.data(), buf.size(), Z_NO_FLUSH);
+            lock.lock();
+            m_spare.push_back(std::move(buf));
+        }
+        lock.unlock();
+        if (ok && deflate_buffer(nullptr, 0, Z_FINISH) && (m_outlen & 1)) {
+            /* The deflated stream is padded to even length */
+            if (std::fputc('\0', m_fp) == EOF) {
+                fail(errno, 0);
+            }
+        }
+    }
+
+    /** @brief Throws if the deflate thread has failed. Call with the lock */
+    void check() const
+    {
+        if (m_errno) {
+            throw MHDConverter::Exception(m_errno, L"Cannot write deflated DICOM data");
+        } else if (m_zerr) {
+            throw MHDConverter::Exception(L"zlib failed to deflate the output: %d", m_zerr);
+        }
+    }
+
+    /** @brief Tells the thread to finish up, and waits for it */
+    void close() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_closing = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+public:
+    Part10Deflater(std::FILE *fp, int level):
+        m_fp(fp),
+        m_zs(),
+        m_zinit(false),
+        m_outlen(0),
+        m_outbuf(std::make_unique<unsigned char[]>(outbuf_size)),
+        m_closing(false),
+        m_errno(0),
+        m_zerr(0)
+    {
+        int zres;
+
+        /* Raw deflate, DICOM has no zlib header or trailer */
+        zres = deflateInit2(&m_zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        if (zres != Z_OK) {
+            throw MHDConverter::Exception(L"Cannot start deflating at level %d: zlib error %d", level, zres);
+        }
+        m_zinit = true;
+        m_thread = std::thread(&Part10Deflater::run, this);
+    }
+
+    ~Part10Deflater()
+    {
+        close();
+        if (m_zinit) {
+            deflateEnd(&m_zs);
+        }
+    }
+
+    Part10Deflater(const Part10Deflater &) = delete;
+    Part10Deflater &operator=(const Part10Deflater &) = delete;
+
+    /** @brief Queues a copy of @p size bytes, waiting if the queue is full */
+    void write(const void *buf, std::size_t size)
+    {
+        const unsigned char *src = static_cast<const unsigned char *>(buf);
+        std::unique_lock<std::mutex> lock(m_lock);
+        std::vector<unsigned char> copy;
+
+        m_cv.wait(lock, [this] { return m_queue.size() < queue_max || m_errno || m_zerr; });
+        check();
+        if (!m_spare.empty()) {
+            copy = std::move(m_spare.back());
+            m_spare.pop_back();
+        }
+        lock.unlock();
+        copy.assign(src, src + size);
+        lock.lock();
+        m_queue.push_back(std::move(copy));
+        lock.unlock();
+        m_cv.notify_all();
+    }
+
+    /** @brief Deflates everything that is left, and ends the stream */
+    void finish()
+    {
+        close();
+        check();
+    }
+};
+
+
+Part10Writer::Part10Writer(const wchar_t *path, int deflate):
+    m_path(path),
+    m_fp(nullptr),
+    m_remain(0)
+{
+    m_fp = _wfopen(path, L"wb");
+    if (!m_fp) {
+        m_path.clear();
+        throw MHDConverter::Exception(errno, L"Cannot create output DICOM file");
+    }
+    /* The pixels come in slab-sized writes anyway */
+    std::setvbuf(m_fp, nullptr, _IOFBF, 1 << 20);
+    if (deflate) {
+        m_zip = std::make_unique<Part10Deflater>(m_fp, deflate);
+    }
+}
+
+
+Part10Writer::~Part10Writer()
+{
+    /* The deflate thread writes to m_fp until it is joined */
+    m_zip.reset();
+    if (m_fp) {
+        std::fclose(m_fp);
+    }
+    if (!m_path.empty()) {
+        _wremove(m_path.c_str());
+    }
+}
+
+
+void Part10Writer::begin(const Part10Header &hdr, DcmDataset *beam, std::size_t pixelsz)
+{
+    std::string buf;
+    std::size_t meta;
+
+    meta = hdr.encode(beam, pixelsz, m_zip != nullptr, buf);
+    /* The file meta information is never deflated */
+    if (!m_zip) {
+        meta = buf.size();
+    }
+    if (std::fwrite(buf.data(), 1, meta, m_fp) != meta) {
+        throw MHDConverter::Exception(errno, L"Cannot write DICOM header");
+    }
+    if (m_zip) {
+        m_zip->write(buf.data() + meta, buf.size() - meta);
+    }
+    m_remain = pixelsz;
+}
+
+
+void Part10Writer::write(const void *buf, std::size_t size)
+{
+    if (size > m_remain) {
+        throw MHDConverter::Exception(L"Too many pixel bytes for the PixelData length");
+    }
+    if (m_zip) {
+        m_zip->write(buf, size);
+    } else if (std::fwrite(buf, 1, size, m_fp) != size) {
+        throw MHDConverter::Exception(errno, L"Cannot write pixel data");
+    }
+    m_remain -= size;
+}
+
+
+void Part10Writer::finish()
+{
+    int err;
+
+    if (m_remain) {
+        throw MHDConverter::Exception(L"PixelData is %zu bytes short", m_remain);
+    }
+    if (m_zip) {
+        m_zip->finish();
+        m_zip.reset();
+    }
+    err = std::fclose(m_fp);
+    m_fp = nullptr;
+    if (err) {
+        throw MHDConverter::Exception(errno, L"Cannot flush output DICOM file");
+    }
+    m_path.clear();
+}
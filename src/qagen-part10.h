@@ -0,0 +1,115 @@
+#pragma once
+/** @file Writes DICOM Part-10 files directly, without building and encoding a
+ *      full DcmFileFormat for every output
+ *
+ *  The template is encoded once, with holes left for the elements that change
+ *  from beam to beam. Each output is then the cached bytes with those few
+ *  elements spliced in, followed by the pixels streamed straight to the file.
+ *  Everything is written as Explicit VR Little Endian, and optionally deflated
+ *  after the file meta information (Deflated Explicit VR Little Endian)
+ */
+#ifndef QAGEN_PART10_H
+#define QAGEN_PART10_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <dcmtk/dcmdata/dcdatset.h>
+
+
+/** @class A template dataset encoded once, with slots for per-beam elements */
+class Part10Header {
+    std::vector<DcmTagKey>   m_slots;       /* Per-beam tags, ascending */
+    std::vector<std::string> m_segments;    /* Segment k is the static run
+                                            before slot k. There is one more of
+                                            these than there are slots */
+    std::vector<std::string> m_defaults;    /* The template's own encoding of
+                                            each slot, used if a beam doesn't
+                                            set it. May be empty */
+    std::string m_sopclass;                 /* SOPClassUID, for the meta header */
+
+public:
+    /** @brief Encodes everything in @p tmplt except the slots
+     *  @param tmplt
+     *      Template dataset. It should not contain PixelData
+     *  @param slots
+     *      Tags that are filled in per beam. PixelData is always a slot, and
+     *      is always written last
+     *  @param nslots
+     *      Number of slots
+     *  @throws MHDConverter::Exception if DCMTK cannot encode an element
+     */
+    Part10Header(DcmDataset *tmplt, const DcmTagKey *slots, std::size_t nslots);
+
+    /** @brief Encodes the complete file up to the PixelData value
+     *  @param beam
+     *      Dataset holding this beam's values for the slots. Any other
+     *      elements in it are ignored
+     *  @param pixelsz
+     *      PixelData length in bytes
+     *  @param deflated
+     *      Declare the Deflated Explicit VR Little Endian transfer syntax. The
+     *      dataset bytes are the same either way, deflating them is up to the
+     *      caller
+     *  @param[out] out
+     *      Buffer receiving the file header
+     *  @returns The length of the preamble and file meta information, where
+     *      the dataset starts
+     */
+    std::size_t encode(DcmDataset *beam, std::size_t pixelsz, bool deflated, std::string &out) const;
+};
+
+
+class Part10Deflater;
+
+
+/** @class Writes one Part-10 file. The output is deleted unless finish() is
+ *      reached
+ */
+class Part10Writer {
+    std::wstring m_path;
+    std::FILE   *m_fp;
+    std::size_t  m_remain;  /* PixelData bytes still expected */
+
+    std::unique_ptr<Part10Deflater> m_zip;  /* Compresses the dataset on its
+                                            own thread, if deflating */
+
+public:
+    /** @brief Creates the file at @p path
+     *  @param deflate
+     *      zlib level to deflate the dataset at, 1 to 9. Zero writes it
+     *      uncompressed
+     */
+    Part10Writer(const wchar_t *path, int deflate);
+
+    ~Part10Writer();
+
+    Part10Writer(const Part10Writer &) = delete;
+    Part10Writer &operator=(const Part10Writer &) = delete;
+
+    /** @brief Writes the header, up to the PixelData value
+     *  @param hdr
+     *      Cached template header
+     *  @param beam
+     *      This beam's slot values
+     *  @param pixelsz
+     *      Number of pixel bytes that will follow
+     */
+    void begin(const Part10Header &hdr, DcmDataset *beam, std::size_t pixelsz);
+
+    /** @brief Appends @p size bytes of pixels */
+    void write(const void *buf, std::size_t size);
+
+    /** @brief Flushes and closes the file. It is kept after this */
+    void finish();
+};
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_PART10_H */
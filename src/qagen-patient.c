@@ -388,10 +388,13 @@ static int qagen_patient_write_json(const struct qagen_patient *pt,
 }
 
 
+/* static const wchar_t *qagen_patient_json = L"patient.json"; */
+static const wchar_t *qagen_patient_json = L"plan_QA.json";
+
+
 static int qagen_patient_create_json(struct qagen_patient *pt)
 {
-    /* static const wchar_t *fname = L"patient.json"; */
-    static const wchar_t *fname = L"plan_QA.json";
+    const wchar_t *fname = qagen_patient_json;
     int res = 1;
 
     if (!qagen_path_join(&pt->basepath, fname)) {
@@ -428,3 +431,16 @@ int qagen_patient_create_qa(struct qagen_patient *pt)
         || qagen_patient_create_json(pt)
         || qagen_patient_create_excel(pt);
 }
+
+
+int qagen_patient_add_dose_stats(struct qagen_patient                 *pt,
+                                 const struct qagen_dose_stats *const *stats)
+{
+    int res = 1;
+
+    if (!qagen_path_join(&pt->basepath, qagen_patient_json)) {
+        res = qagen_json_add_dose(pt->basepath->buf, stats, qagen_patient_num_beams(pt));
+        qagen_path_remove_filespec(&pt->basepath);
+    }
+    return res;
+}
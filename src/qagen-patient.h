@@ -7,6 +7,7 @@
 #include "qagen-defs.h"
 #include "qagen-files.h"
 #include "qagen-path.h"
+#include "qagen-stats.h"
  
 #define BEAMSET_LIMIT 16    /* I believe this is imposed by Raystation itself */
 #define FOLDER_LIMIT  22 + BEAMSET_LIMIT   /* LlFf_(x.xx,y.yy,z.zz)-<BEAMSET> */
@@ -104,4 +105,16 @@ uint32_t qagen_patient_num_beams(const struct qagen_patient *pt);
 int qagen_patient_create_qa(struct qagen_patient *pt);
 
 
+/** @brief Adds each field's dose statistics to the JSON in the QA folder
+ *  @param pt
+ *      Patient context, after qagen_patient_create_qa
+ *  @param stats
+ *      One entry for each beam in the RP file, in order. NULL entries are left
+ *      out
+ *  @returns Nonzero on error
+ */
+int qagen_patient_add_dose_stats(struct qagen_patient                 *pt,
+                                 const struct qagen_dose_stats *const *stats);
+
+
 #endif /* QAGEN_PATIENT_H */
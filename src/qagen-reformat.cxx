@@ -0,0 +1,96 @@
+#include <cmath>
+#include <cstring>
+#include "qagen-reformat.h"
+
+
+Reformat::Reformat(const std::size_t dim[3], const double spacing[3],
+                   const double origin[3], const double *axes)
+    noexcept
+{
+    static const double identity[9] = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+    double best, iop[6], dot;
+    bool used[3] = { false, false, false };
+    unsigned a, b, i;
+
+    axes = (axes) ? axes : identity;
+    std::memcpy(m_axes, axes, sizeof m_axes);
+    for (a = 0; a < 3; a++) {
+        m_spacing[a] = spacing[a];
+        m_origin[a] = origin[a];
+        m_lo[a] = 0;
+        m_hi[a] = dim[a];
+    }
+    m_stride[0] = 1;
+    m_stride[1] = (std::ptrdiff_t)dim[0];
+    m_stride[2] = (std::ptrdiff_t)(dim[0] * dim[1]);
+
+    /* Undo the in-plane reversal: index 0 is the header's last voxel */
+    for (a = 0; a < 2; a++) {
+        for (i = 0; i < 3; i++) {
+            m_origin[i] += (double)(dim[a] - 1) * spacing[a] * m_axes[3 * a + i];
+            m_axes[3 * a + i] = -m_axes[3 * a + i];
+        }
+    }
+
+    /* Columns and rows go to the source axes closest to +x and +y */
+    for (b = 0; b < 2; b++) {
+        best = -1.0;
+        for (a = 0; a < 3; a++) {
+            if (!used[a] && std::fabs(m_axes[3 * a + b]) > best) {
+                best = std::fabs(m_axes[3 * a + b]);
+                m_perm[b] = a;
+            }
+        }
+        used[m_perm[b]] = true;
+        m_flip[b] = m_axes[3 * m_perm[b] + b] < 0.0;
+    }
+    m_perm[2] = 3 - m_perm[0] - m_perm[1];
+
+    /* Frames are stacked along the normal, whatever the source handedness */
+    orientation(iop);
+    dot = (iop[1] * iop[5] - iop[2] * iop[4]) * m_axes[3 * m_perm[2] + 0]
+        + (iop[2] * iop[3] - iop[0] * iop[5]) * m_axes[3 * m_perm[2] + 1]
+        + (iop[0] * iop[4] - iop[1] * iop[3]) * m_axes[3 * m_perm[2] + 2];
+    m_flip[2] = dot < 0.0;
+}
+
+
+void Reformat::crop(const std::size_t lo[3], const std::size_t hi[3])
+    noexcept
+{
+    for (unsigned a = 0; a < 3; a++) {
+        m_lo[a] = lo[a];
+        m_hi[a] = hi[a];
+    }
+}
+
+
+void Reformat::orientation(double iop[6]) const
+    noexcept
+{
+    double sign;
+
+    for (unsigned b = 0; b < 2; b++) {
+        sign = (m_flip[b]) ? -1.0 : 1.0;
+        for (unsigned i = 0; i < 3; i++) {
+            iop[3 * b + i] = sign * m_axes[3 * m_perm[b] + i];
+        }
+    }
+}
+
+
+void Reformat::position(double ipp[3]) const
+    noexcept
+{
+    std::size_t v;
+    unsigned a, i;
+
+    std::memcpy(ipp, m_origin, 3 * sizeof *ipp);
+    for (unsigned b = 0; b < 3; b++) {
+        a = m_perm[b];
+        v = (m_flip[b]) ? m_hi[a] - 1 : m_lo[a];
+        for (i = 0; i < 3; i++) {
+            ipp[i] += (double)v * m_spacing[a] * m_axes[3 * a + i];
+        }
+    }
+}
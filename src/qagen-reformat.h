@@ -0,0 +1,169 @@
+#pragma once
+/** @file Maps a Dose_Beam voxel grid onto the RTDose output grid
+ *
+ *  Output columns and rows run along whichever source axes are closest to the
+ *  patient's +x and +y, and frames are stacked along the image plane normal,
+ *  so GridFrameOffsetVector always increases. Getting there from an arbitrary
+ *  direction matrix means permuting and flipping the source axes, which is
+ *  done a frame at a time by qagen_kernel_reformat()
+ *
+ *  Dose_Beams store their in-plane axes reversed with respect to their header:
+ *  voxel (i, j, k) lies where the header puts (X - 1 - i, Y - 1 - j, k). That
+ *  is what both converters have always assumed, and for the usual identity
+ *  direction matrix this still writes every frame backwards, as before
+ */
+#ifndef QAGEN_REFORMAT_H
+#define QAGEN_REFORMAT_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <algorithm>
+#include <cstddef>
+#include "qagen-kernel.h"
+#include "qagen-parallel.h"
+
+
+/** @class Source grid geometry, and the axis mapping that writes it out */
+class Reformat {
+    std::ptrdiff_t m_stride[3];     /* Source element strides */
+    double         m_spacing[3];
+    double         m_origin[3];     /* LPS position of source voxel (0, 0, 0) */
+    double         m_axes[9];       /* Row a is the LPS direction of source
+                                    axis a, after undoing the in-plane
+                                    reversal */
+    std::size_t    m_lo[3];         /* Source box that is written, half-open */
+    std::size_t    m_hi[3];
+
+    unsigned m_perm[3];     /* Source axis behind each output axis */
+    bool     m_flip[3];     /* Output axis runs against its source axis */
+
+public:
+    /** @brief Picks the output axes for a source grid
+     *  @param dim
+     *      Source dimensions
+     *  @param spacing
+     *      Source voxel spacing
+     *  @param origin
+     *      Header origin
+     *  @param axes
+     *      Header direction matrix, with row a the direction of axis a (the
+     *      MetaIO TransformMatrix layout). nullptr means identity
+     */
+    Reformat(const std::size_t dim[3], const double spacing[3],
+             const double origin[3], const double *axes) noexcept;
+
+    /** @brief Restricts the output to the source voxels in [@p lo, @p hi) */
+    void crop(const std::size_t lo[3], const std::size_t hi[3]) noexcept;
+
+    /** Output columns, rows and frames, for @p b = 0, 1, 2 */
+    std::size_t size(unsigned b) const noexcept { return m_hi[m_perm[b]] - m_lo[m_perm[b]]; }
+
+    /** Pixels in an output frame */
+    std::size_t frame_size() const noexcept { return size(0) * size(1); }
+
+    /** Voxel spacing along output axis @p b */
+    double spacing(unsigned b) const noexcept { return m_spacing[m_perm[b]]; }
+
+    /** @brief ImageOrientationPatient: the row direction, then the column
+     *      direction */
+    void orientation(double iop[6]) const noexcept;
+
+    /** @brief ImagePositionPatient of the first output pixel */
+    void position(double ipp[3]) const noexcept;
+
+    /** @brief True if each source frame is exactly one output frame, in the
+     *      same order. Only then can output be written while the source is
+     *      still being read
+     */
+    bool in_order() const noexcept { return m_perm[2] == 2 && !m_flip[2]; }
+
+    /** @brief Quantizes every output pixel that comes from a slab of source
+     *      frames
+     *  @param dst
+     *      Output frame @p dstframe. If in_order(), this only has to hold the
+     *      frames of this slab. Otherwise pass the whole output volume
+     *  @param dstframe
+     *      Output frame that @p dst points at
+     *  @param slab
+     *      Source frames [first, first + count)
+     *  @param scal
+     *      Grid scaling
+     *  @param nthreads
+     *      Threads to split the output frames across
+     *  @param err
+     *      Quantization error accumulators, one per thread, or nullptr
+     *  @param fn
+     *      Called as fn(px, w, h, ldd, chunk) with each block of output
+     *      pixels straight after it is written, on the thread that wrote it.
+     *      Every output pixel is passed exactly once over the whole source
+     */
+    template <class DataT, class ScaleT, class PixelT, class FrameFn>
+    void apply(PixelT *dst, std::size_t dstframe, const DataT *slab,
+               std::size_t first, std::size_t count, ScaleT scal,
+               unsigned nthreads, qagen_kernel_qerr *err, FrameFn &&fn) const;
+
+    /** @brief apply(), with nothing done to the output afterwards */
+    template <class DataT, class ScaleT, class PixelT>
+    void apply(PixelT *dst, std::size_t dstframe, const DataT *slab,
+               std::size_t first, std::size_t count, ScaleT scal,
+               unsigned nthreads) const
+    {
+        apply(dst, dstframe, slab, first, count, scal, nthreads, nullptr,
+              [](const PixelT *, std::size_t, std::size_t, std::size_t, unsigned){ });
+    }
+};
+
+
+template <class DataT, class ScaleT, class PixelT, class FrameFn>
+void Reformat::apply(PixelT *dst, std::size_t dstframe, const DataT *slab,
+                     std::size_t first, std::size_t count, ScaleT scal,
+                     unsigned nthreads, qagen_kernel_qerr *err, FrameFn &&fn) const
+{
+    const std::size_t z0 = std::max(first, m_lo[2]);
+    const std::size_t z1 = std::min(first + count, m_hi[2]);
+    const std::size_t outlen = frame_size();
+    std::size_t ulo[3], uhi[3], v;
+    std::ptrdiff_t step[3], offs = 0;
+    unsigned a, b;
+
+    if (z0 >= z1) {
+        return;
+    }
+    /* Only the output run fed by these source frames is touched */
+    for (b = 0; b < 3; b++) {
+        a = m_perm[b];
+        ulo[b] = 0;
+        uhi[b] = size(b);
+        if (a == 2) {
+            ulo[b] = (m_flip[b]) ? m_hi[2] - z1 : z0 - m_lo[2];
+            uhi[b] = (m_flip[b]) ? m_hi[2] - z0 : z1 - m_lo[2];
+        }
+        v = (m_flip[b]) ? m_hi[a] - 1 - ulo[b] : m_lo[a] + ulo[b];
+        if (a == 2) {
+            v -= first;
+        }
+        offs += (std::ptrdiff_t)v * m_stride[a];
+        step[b] = (m_flip[b]) ? -m_stride[a] : m_stride[a];
+    }
+    slab += offs;
+    dst += ulo[1] * size(0) + ulo[0];
+    qagen_parallel_for(uhi[2] - ulo[2], nthreads, [&](std::size_t k0, std::size_t k1, unsigned c){
+        PixelT *frame;
+
+        for (std::size_t k = k0; k < k1; k++) {
+            frame = dst + (ulo[2] + k - dstframe) * outlen;
+            qagen_kernel_reformat(frame, size(0),
+                                  slab + (std::ptrdiff_t)k * step[2],
+                                  uhi[0] - ulo[0], uhi[1] - ulo[1],
+                                  step[0], step[1], scal, (err) ? &err[c] : nullptr);
+            fn(frame, uhi[0] - ulo[0], uhi[1] - ulo[1], size(0), c);
+        }
+    });
+}
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_REFORMAT_H */
@@ -0,0 +1,425 @@
+#include <cerrno>
+#include <zlib.h>
+#include "qagen-source.h"
+#include "qagen-metaio.h"
+#include "qagen-log.h"
+
+
+RawFileSource::RawFileSource(const wchar_t *path,
+                             long long      offset,
+                             std::size_t    framesz,
+                             std::size_t    nframes):
+    SlabSource(framesz, nframes),
+    m_fp(nullptr),
+    m_offset(offset)
+{
+    const long long datasz = (long long)framesz * nframes;
+    long long filesz;
+
+    m_fp = _wfopen(path, L"rb");
+    if (!m_fp) {
+        throw MHDConverter::Exception(errno, L"Cannot open MHD data file");
+    }
+    if (_fseeki64(m_fp, 0, SEEK_END) || (filesz = _ftelli64(m_fp)) < 0) {
+        int err = errno;
+        std::fclose(m_fp);
+        throw MHDConverter::Exception(err, L"Cannot seek MHD data file");
+    }
+    if (m_offset < 0) {
+        m_offset = filesz - datasz;
+    }
+    if (m_offset < 0 || filesz - m_offset < datasz) {
+        std::fclose(m_fp);
+        throw MHDConverter::Exception(L"MHD data file is too short: %lld bytes, expected %lld", filesz, datasz);
+    }
+    rewind();
+}
+
+
+RawFileSource::~RawFileSource()
+{
+    std::fclose(m_fp);
+}
+
+
+void RawFileSource::rewind()
+{
+    if (_fseeki64(m_fp, m_offset, SEEK_SET)) {
+        throw MHDConverter::Exception(errno, L"Cannot seek MHD data file");
+    }
+    m_pos = 0;
+}
+
+
+const void *RawFileSource::next(std::size_t nframes, std::size_t &got)
+{
+    got = (nframes < m_nframes - m_pos) ? nframes : m_nframes - m_pos;
+    m_buf.resize(got * m_framesz);
+    if (std::fread(m_buf.data(), m_framesz, got, m_fp) != got) {
+        if (std::ferror(m_fp)) {
+            throw MHDConverter::Exception(errno, L"Cannot read MHD data file");
+        }
+        throw MHDConverter::Exception(L"Unexpected end of MHD data file at frame %zu", m_pos);
+    }
+    m_pos += got;
+    return m_buf.data();
+}
+
+
+MappedFileSource::MappedFileSource(std::size_t framesz, std::size_t nframes)
+    noexcept:
+    SlabSource(framesz, nframes),
+    m_hfile(INVALID_HANDLE_VALUE),
+    m_hmap(NULL),
+    m_view(NULL),
+    m_data(NULL)
+{
+
+}
+
+
+MappedFileSource::~MappedFileSource()
+{
+    if (m_view) {
+        UnmapViewOfFile(m_view);
+    }
+    if (m_hmap) {
+        CloseHandle(m_hmap);
+    }
+    if (m_hfile != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hfile);
+    }
+}
+
+
+bool MappedFileSource::map(const wchar_t *path, long long offset)
+    noexcept
+{
+    const long long datasz = (long long)m_framesz * m_nframes;
+    LARGE_INTEGER filesz, base;
+    SYSTEM_INFO sysinfo;
+
+    m_hfile = CreateFile(path,
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_SEQUENTIAL_SCAN,
+                         NULL);
+    if (m_hfile == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_hfile, &filesz)) {
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Cannot open MHD data file for mapping: %#x", GetLastError());
+        return false;
+    }
+    offset = (offset < 0) ? filesz.QuadPart - datasz : offset;
+    if (!datasz || offset < 0 || filesz.QuadPart - offset < datasz
+     || (unsigned long long)(datasz + offset) > (SIZE_T)-1) {
+        /* Let the buffered reader report it */
+        return false;
+    }
+    m_hmap = CreateFileMapping(m_hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_hmap) {
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Cannot create MHD data file mapping: %#x", GetLastError());
+        return false;
+    }
+    /* Views must start on the allocation granularity */
+    GetSystemInfo(&sysinfo);
+    base.QuadPart = offset - offset % sysinfo.dwAllocationGranularity;
+    m_view = MapViewOfFile(m_hmap,
+                           FILE_MAP_READ,
+                           base.HighPart,
+                           base.LowPart,
+                           (SIZE_T)(offset - base.QuadPart + datasz));
+    if (!m_view) {
+        qagen_log_printf(QAGEN_LOG_DEBUG, L"Cannot map MHD data file view: %#x", GetLastError());
+        return false;
+    }
+    m_data = static_cast<const char *>(m_view) + (offset - base.QuadPart);
+    return true;
+}
+
+
+void MappedFileSource::prefetch(std::size_t first, std::size_t nframes)
+    noexcept
+{
+    WIN32_MEMORY_RANGE_ENTRY range;
+
+    if (first >= m_nframes) {
+        return;
+    }
+    nframes = (nframes < m_nframes - first) ? nframes : m_nframes - first;
+    range.VirtualAddress = const_cast<char *>(m_data + first * m_framesz);
+    range.NumberOfBytes = nframes * m_framesz;
+    /* Only a hint. If this fails, we just fault the pages in as usual */
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+
+void MappedFileSource::rewind()
+{
+    m_pos = 0;
+}
+
+
+const void *MappedFileSource::next(std::size_t nframes, std::size_t &got)
+{
+    const char *res = m_data + m_pos * m_framesz;
+
+    got = (nframes < m_nframes - m_pos) ? nframes : m_nframes - m_pos;
+    if (!m_pos) {
+        prefetch(0, got);
+    }
+    m_pos += got;
+    prefetch(m_pos, nframes);
+    return res;
+}
+
+
+InflateSource::InflateSource(const wchar_t *path,
+                             long long      offset,
+                             long long      compsz,
+                             std::size_t    framesz,
+                             std::size_t    nframes,
+                             std::size_t    skip):
+    SlabSource(framesz, nframes),
+    m_path(path),
+    m_offset(offset),
+    m_skip(skip),
+    m_slab(0),
+    m_stop(false),
+    m_done(true),
+    m_cur{ { }, 0 },
+    m_errnum(0)
+{
+    std::FILE *fp;
+    long long filesz;
+
+    /* Check that it's there now, rather than from the inflate thread later */
+    fp = _wfopen(path, L"rb");
+    if (!fp) {
+        throw MHDConverter::Exception(errno, L"Cannot open MHD data file");
+    }
+    if (_fseeki64(fp, 0, SEEK_END) || (filesz = _ftelli64(fp)) < 0) {
+        int err = errno;
+        std::fclose(fp);
+        throw MHDConverter::Exception(err, L"Cannot seek MHD data file");
+    }
+    std::fclose(fp);
+    if (m_offset < 0) {
+        m_offset = filesz - compsz;
+    }
+    if (m_offset < 0 || m_offset >= filesz) {
+        throw MHDConverter::Exception(L"MHD compressed data offset %lld is outside the file", m_offset);
+    }
+}
+
+
+InflateSource::~InflateSource()
+{
+    stop();
+}
+
+
+void InflateSource::start(std::size_t slab)
+{
+    m_slab = slab;
+    m_stop = false;
+    m_done = false;
+    m_errnum = 0;
+    m_errmsg.clear();
+    m_thread = std::thread(&InflateSource::produce, this);
+}
+
+
+void InflateSource::stop() noexcept
+{
+    if (!m_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    /* Keep the buffers, the next pass wants the same sizes */
+    for (auto &slab : m_full) {
+        m_free.push_back(std::move(slab));
+    }
+    m_full.clear();
+}
+
+
+void InflateSource::fail(int errnum, const wchar_t *msg)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_errnum = errnum;
+    m_errmsg = msg;
+}
+
+
+/** @brief Waits for a free buffer, or the stop signal
+ *  @returns false if the thread should quit
+ */
+bool InflateSource::acquire(Slab &slab) noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    m_cv.wait(lock, [this] { return m_stop || m_full.size() < m_depth; });
+    if (m_stop) {
+        return false;
+    }
+    if (!m_free.empty()) {
+        slab = std::move(m_free.back());
+        m_free.pop_back();
+    }
+    return true;
+}
+
+
+void InflateSource::publish(Slab &&slab) noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_full.push_back(std::move(slab));
+    }
+    m_cv.notify_all();
+}
+
+
+/** @brief Body of the inflate thread */
+void InflateSource::produce() noexcept
+{
+    std::vector<unsigned char> in, scratch;
+    std::size_t remain = m_nframes, skip = m_skip;
+    std::FILE *fp = nullptr;
+    z_stream zs = { };
+    Slab slab;
+    int zres;
+
+    try {
+        in.resize(1 << 20);
+        fp = _wfopen(m_path.c_str(), L"rb");
+        if (!fp || _fseeki64(fp, m_offset, SEEK_SET)) {
+            fail(errno, L"Cannot open MHD compressed data");
+            goto done;
+        }
+        /* 32 lets zlib detect gzip or zlib headers, MetaIO writes zlib */
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+            fail(ENOMEM, L"Cannot initialize zlib");
+            goto done;
+        }
+        while (skip) {
+            /* Inflate whatever precedes the voxels into the bin */
+            scratch.resize((skip < (1 << 16)) ? skip : (1 << 16));
+            zs.next_out = scratch.data();
+            zs.avail_out = static_cast<uInt>(scratch.size());
+            if (!zs.avail_in) {
+                zs.next_in = in.data();
+                zs.avail_in = static_cast<uInt>(std::fread(in.data(), 1, in.size(), fp));
+                if (!zs.avail_in) {
+                    fail((std::ferror(fp)) ? errno : 0, L"MHD compressed data is truncated");
+                    goto end;
+                }
+            }
+            zres = inflate(&zs, Z_NO_FLUSH);
+            if (zres != Z_OK) {
+                fail(0, L"MHD compressed data is corrupt");
+                goto end;
+            }
+            skip -= scratch.size() - zs.avail_out;
+        }
+        while (remain && acquire(slab)) {
+            slab.nframes = (m_slab < remain) ? m_slab : remain;
+            slab.buf.resize(slab.nframes * m_framesz);
+            zs.next_out = reinterpret_cast<Bytef *>(slab.buf.data());
+            zs.avail_out = static_cast<uInt>(slab.buf.size());
+            while (zs.avail_out) {
+                if (!zs.avail_in) {
+                    zs.next_in = in.data();
+                    zs.avail_in = static_cast<uInt>(std::fread(in.data(), 1, in.size(), fp));
+                    if (!zs.avail_in) {
+                        fail((std::ferror(fp)) ? errno : 0, L"MHD compressed data is truncated");
+                        goto end;
+                    }
+                }
+                zres = inflate(&zs, Z_NO_FLUSH);
+                if (zres == Z_STREAM_END && zs.avail_out) {
+                    fail(0, L"MHD compressed data ends early");
+                    goto end;
+                } else if (zres != Z_OK && zres != Z_STREAM_END) {
+                    fail(0, L"MHD compressed data is corrupt");
+                    goto end;
+                }
+            }
+            remain -= slab.nframes;
+            publish(std::move(slab));
+        }
+end:
+        inflateEnd(&zs);
+    } catch (std::bad_alloc &) {
+        fail(ENOMEM, L"Cannot allocate inflate buffers");
+    }
+done:
+    if (fp) {
+        std::fclose(fp);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_done = true;
+    }
+    m_cv.notify_all();
+}
+
+
+void InflateSource::rewind()
+{
+    stop();
+    if (m_cur.buf.capacity()) {
+        m_free.push_back(std::move(m_cur));
+        m_cur = { { }, 0 };
+    }
+    m_pos = 0;
+}
+
+
+const void *InflateSource::next(std::size_t nframes, std::size_t &got)
+{
+    std::unique_lock<std::mutex> lock(m_lock, std::defer_lock);
+
+    got = 0;
+    if (m_pos >= m_nframes) {
+        return nullptr;
+    }
+    if (!m_thread.joinable()) {
+        start(nframes);
+    }
+    lock.lock();
+    m_cv.wait(lock, [this] { return !m_full.empty() || m_done; });
+    if (m_full.empty()) {
+        if (m_errnum) {
+            throw MHDConverter::Exception(m_errnum, L"%s", m_errmsg.c_str());
+        }
+        throw MHDConverter::Exception(L"Cannot inflate MHD data", L"%s at frame %zu", m_errmsg.c_str(), m_pos);
+    }
+    if (m_cur.buf.capacity()) {
+        m_free.push_back(std::move(m_cur));
+    }
+    m_cur = std::move(m_full.front());
+    m_full.pop_front();
+    lock.unlock();
+    m_cv.notify_all();
+    got = m_cur.nframes;
+    m_pos += got;
+    return m_cur.buf.data();
+}
+
+
+const void *MemorySource::next(std::size_t nframes, std::size_t &got)
+{
+    const char *res = m_data + m_pos * m_framesz;
+
+    got = (nframes < m_nframes - m_pos) ? nframes : m_nframes - m_pos;
+    m_pos += got;
+    return res;
+}
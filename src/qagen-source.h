@@ -0,0 +1,251 @@
+#pragma once
+/** @file Slab sources, which feed raw voxel data to MHDConverter a few frames
+ *      at a time instead of loading the whole volume
+ */
+#ifndef QAGEN_SOURCE_H
+#define QAGEN_SOURCE_H
+
+#include "qagen-defs.h"
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/** Most bytes one slab may hold, whatever the thread count. A source that
+ *  buffers slabs ahead holds a few of these at once */
+#define QAGEN_SOURCE_SLAB_MAX ((std::size_t)16 << 20)
+
+
+/** @class Produces consecutive slabs of frames from a volume, in file order */
+class SlabSource {
+protected:
+    std::size_t m_framesz;  /* Bytes per frame */
+    std::size_t m_nframes;  /* Total frames in the volume */
+    std::size_t m_pos;      /* Index of the next frame to be returned */
+
+    /** @brief Caps @p nframes to QAGEN_SOURCE_SLAB_MAX bytes, but never below
+     *      one frame
+     */
+    std::size_t cap_frames(std::size_t nframes) const noexcept
+    {
+        const std::size_t lim = QAGEN_SOURCE_SLAB_MAX / ((m_framesz) ? m_framesz : 1);
+
+        return (nframes < lim) ? nframes : (lim) ? lim : 1;
+    }
+
+public:
+    SlabSource(std::size_t framesz, std::size_t nframes) noexcept:
+        m_framesz(framesz), m_nframes(nframes), m_pos(0) { }
+
+    virtual ~SlabSource() = default;
+
+    std::size_t frame_size() const noexcept { return m_framesz; }
+    std::size_t frames() const noexcept { return m_nframes; }
+    std::size_t position() const noexcept { return m_pos; }
+
+    /** @brief Returns a good slab size for this source, in frames. It is
+     *      never more than QAGEN_SOURCE_SLAB_MAX bytes, unless one frame is
+     *  @param nthreads
+     *      Number of threads each slab will be split across
+     */
+    virtual std::size_t slab_frames(unsigned nthreads) const { return cap_frames(nthreads); }
+
+    /** @brief Seeks back to the first frame */
+    virtual void rewind() = 0;
+
+    /** @brief Fetches the next @p nframes frames, or however many remain
+     *  @param nframes
+     *      Number of frames requested
+     *  @param[out] got
+     *      Number of frames actually returned
+     *  @returns A pointer to the slab. It stays valid until the next call to
+     *      either method
+     *  @throws MHDConverter::Exception on I/O failure
+     */
+    virtual const void *next(std::size_t nframes, std::size_t &got) = 0;
+};
+
+
+/** @class Reads slabs from an uncompressed ElementDataFile through a small
+ *      buffer
+ */
+class RawFileSource: public SlabSource {
+    std::FILE        *m_fp;
+    long long         m_offset; /* Byte offset of the first frame */
+    std::vector<char> m_buf;
+
+public:
+    /** @brief Opens @p path for reading
+     *  @param path
+     *      Path to the raw data file
+     *  @param offset
+     *      Offset of the voxel data in the file. Negative means that the data
+     *      is at the very end of the file, which is what MetaIO means by
+     *      HeaderSize = -1
+     *  @param framesz
+     *      Bytes per frame
+     *  @param nframes
+     *      Number of frames
+     */
+    RawFileSource(const wchar_t *path,
+                  long long      offset,
+                  std::size_t    framesz,
+                  std::size_t    nframes);
+
+    virtual ~RawFileSource();
+
+    RawFileSource(const RawFileSource &) = delete;
+    RawFileSource &operator=(const RawFileSource &) = delete;
+
+    virtual void rewind() override;
+    virtual const void *next(std::size_t nframes, std::size_t &got) override;
+};
+
+
+/** @class Maps an uncompressed ElementDataFile into memory and hands out
+ *      pointers straight into the mapping
+ *  @details The file is opened for sequential scan, and each slab prefetches
+ *      the one after it, so the page cache stays ahead of the kernels
+ */
+class MappedFileSource: public SlabSource {
+    HANDLE      m_hfile;
+    HANDLE      m_hmap;
+    void       *m_view;
+    const char *m_data;     /* First frame, inside the view */
+
+    void prefetch(std::size_t first, std::size_t nframes) noexcept;
+
+public:
+    MappedFileSource(std::size_t framesz, std::size_t nframes) noexcept;
+
+    virtual ~MappedFileSource();
+
+    MappedFileSource(const MappedFileSource &) = delete;
+    MappedFileSource &operator=(const MappedFileSource &) = delete;
+
+    /** @brief Maps @p path
+     *  @param path
+     *      Path to the raw data file
+     *  @param offset
+     *      Offset of the voxel data in the file, negative if it is at the end
+     *  @returns false if the file cannot be mapped. No error is raised, the
+     *      caller is expected to fall back to reading it
+     */
+    bool map(const wchar_t *path, long long offset) noexcept;
+
+    virtual std::size_t slab_frames(unsigned nthreads) const override { return cap_frames(4 * (std::size_t)nthreads); }
+
+    virtual void rewind() override;
+    virtual const void *next(std::size_t nframes, std::size_t &got) override;
+};
+
+
+/** @class Inflates a CompressedData ElementDataFile on its own thread, which
+ *      feeds slabs to the converter through a short queue
+ *  @details The converter quantizes one slab while the next is inflated. At
+ *      most m_depth slabs wait in the queue, plus the one being inflated and
+ *      the one last returned, so this never holds more than
+ *      (m_depth + 2) * QAGEN_SOURCE_SLAB_MAX bytes. Rewinding restarts the
+ *      stream from the top, so each pass over the volume inflates it again
+ */
+class InflateSource: public SlabSource {
+    /** A decompressed slab */
+    struct Slab {
+        std::vector<char> buf;
+        std::size_t       nframes;
+    };
+
+    static constexpr std::size_t m_depth = 3;   /* Slabs in flight */
+
+    std::wstring m_path;
+    long long    m_offset;      /* Byte offset of the compressed stream */
+    std::size_t  m_skip;        /* Decompressed bytes before the first frame */
+    std::size_t  m_slab;        /* Frames per slab, fixed by the first next() */
+
+    std::thread m_thread;
+    bool        m_stop;         /* Tells the inflate thread to quit */
+    bool        m_done;         /* The inflate thread has quit */
+
+    std::mutex              m_lock;
+    std::condition_variable m_cv;
+    std::deque<Slab>        m_full;     /* Inflated, waiting for next() */
+    std::vector<Slab>       m_free;     /* Buffers to reuse */
+    Slab                    m_cur;      /* Slab last returned by next() */
+
+    /* The inflate thread cannot raise the error itself, since error states are
+    thread-local, so it leaves these for next() */
+    int          m_errnum;
+    std::wstring m_errmsg;
+
+    void start(std::size_t slab);
+    void stop() noexcept;
+    void produce() noexcept;
+    void fail(int errnum, const wchar_t *msg);
+    bool acquire(Slab &slab) noexcept;
+    void publish(Slab &&slab) noexcept;
+
+public:
+    /** @brief Opens the compressed stream in @p path
+     *  @param path
+     *      Path to the compressed data file
+     *  @param offset
+     *      Offset of the stream in the file. Negative means that it is the
+     *      last @p compsz bytes of the file
+     *  @param compsz
+     *      Compressed size in bytes. Only needed if @p offset is negative
+     *  @param framesz
+     *      Bytes per decompressed frame
+     *  @param nframes
+     *      Number of frames
+     *  @param skip
+     *      Decompressed bytes to throw away before the first frame, e.g. a
+     *      gzipped NIfTI header
+     */
+    InflateSource(const wchar_t *path,
+                  long long      offset,
+                  long long      compsz,
+                  std::size_t    framesz,
+                  std::size_t    nframes,
+                  std::size_t    skip = 0);
+
+    virtual ~InflateSource();
+
+    InflateSource(const InflateSource &) = delete;
+    InflateSource &operator=(const InflateSource &) = delete;
+
+    virtual std::size_t slab_frames(unsigned nthreads) const override { return cap_frames(4 * (std::size_t)nthreads); }
+
+    virtual void rewind() override;
+
+    /** @note Every call between rewinds must request the same slab size */
+    virtual const void *next(std::size_t nframes, std::size_t &got) override;
+};
+
+
+/** @class Wraps a volume that is already in memory, e.g. MetaIO's buffer */
+class MemorySource: public SlabSource {
+    const char *m_data;
+
+public:
+    MemorySource(const void *data, std::size_t framesz, std::size_t nframes) noexcept:
+        SlabSource(framesz, nframes), m_data(static_cast<const char *>(data)) { }
+
+    /* No reason to split this up, it's all in memory anyway */
+    virtual std::size_t slab_frames(unsigned) const override { return m_nframes; }
+
+    virtual void rewind() override { m_pos = 0; }
+    virtual const void *next(std::size_t nframes, std::size_t &got) override;
+};
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_SOURCE_H */
@@ -0,0 +1,108 @@
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "qagen-stats.h"
+#include "qagen-log.h"
+
+
+/** @brief Appends @p x in its shortest round-trip form. JSON has no NaN or
+ *      infinity, so those are null
+ */
+static void put_number(std::string &s, double x)
+{
+    char buf[32];
+
+    if (!std::isfinite(x)) {
+        s += "null";
+        return;
+    }
+    s.append(buf, std::to_chars(buf, buf + sizeof buf, x).ptr);
+}
+
+
+static void put_number(std::string &s, std::uint64_t x)
+{
+    char buf[24];
+
+    s.append(buf, std::to_chars(buf, buf + sizeof buf, x).ptr);
+}
+
+
+EXTERN_C
+size_t qagen_stats_format(char *buf, size_t len, const struct qagen_dose_stats *stats)
+{
+    static const char *above[3] = { "\"10\":", ",\"50\":", ",\"90\":" };
+    std::string s;
+
+    s.reserve(512);
+    s += "{\"max\":";
+    put_number(s, stats->max);
+    s += ",\"integral\":";
+    put_number(s, stats->integral);
+    s += ",\"voxels\":";
+    put_number(s, stats->voxels);
+    s += ",\"voxel_volume\":";
+    put_number(s, stats->voxel_volume);
+    s += ",\"above\":{";
+    for (unsigned i = 0; i < 3; i++) {
+        s += above[i];
+        put_number(s, stats->above[i]);
+    }
+    s += "},\"error\":{\"max\":";
+    put_number(s, stats->max_error);
+    s += ",\"relative\":";
+    put_number(s, stats->max_rel_error);
+    s += "},\"histogram\":{\"bin_width\":";
+    put_number(s, stats->bin_width);
+    s += ",\"counts\":[";
+    for (unsigned i = 0; i < QAGEN_STATS_BINS; i++) {
+        if (i) {
+            s += ',';
+        }
+        put_number(s, stats->hist[i]);
+    }
+    s += "]}}";
+    if (len) {
+        len = (s.size() < len) ? s.size() : len - 1;
+        std::memcpy(buf, s.data(), len);
+        buf[len] = '\0';
+    }
+    return s.size();
+}
+
+
+EXTERN_C
+int qagen_stats_write(const struct qagen_dose_stats *stats, const wchar_t *dcm)
+{
+    std::wstring path = dcm;
+    size_t sep, dot;
+    char buf[1024];
+    size_t len;
+    FILE *fp;
+
+    sep = path.find_last_of(L"\\/");
+    dot = path.find_last_of(L'.');
+    if (dot != std::wstring::npos && (sep == std::wstring::npos || dot > sep)) {
+        path.erase(dot);
+    }
+    path += L".stats.json";
+    len = qagen_stats_format(buf, sizeof buf, stats);
+    if (len >= sizeof buf) {
+        qagen_log_puts(QAGEN_LOG_WARN, L"Dose statistics do not fit their buffer");
+        return 1;
+    }
+    fp = _wfopen(path.c_str(), L"w");
+    if (!fp) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"Could not _wfopen %s: %s", path.c_str(), _wcserror(errno));
+        return 1;
+    }
+    std::fputs(buf, fp);
+    if (std::fclose(fp)) {
+        qagen_log_printf(QAGEN_LOG_WARN, L"Could not write %s: %s", path.c_str(), _wcserror(errno));
+        return 1;
+    }
+    return 0;
+}
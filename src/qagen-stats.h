@@ -0,0 +1,199 @@
+#pragma once
+/** @file Dose statistics of a converted Dose_Beam
+ *
+ *  The converters tally each output frame right after quantizing it, while it
+ *  is still in cache, so nobody has to open the beam again to find its max or
+ *  integral dose. The statistics describe the RTDose file as written: every
+ *  dose is a pixel value times DoseGridScaling
+ */
+#ifndef QAGEN_STATS_H
+#define QAGEN_STATS_H
+
+#include "qagen-defs.h"
+#include <stddef.h>
+#include <stdint.h>
+
+EXTERN_C_START
+
+
+/** Histogram bins between zero and the maximum dose */
+#define QAGEN_STATS_BINS 20
+
+
+/** Fraction of the maximum dose below which voxels are left out of the
+ *  relative quantization error. Near zero, any error is huge relative */
+#define QAGEN_STATS_ERROR_FLOOR 0.01
+
+
+/** Statistics of one dose grid. Doses are in Gy and volumes in cm^3 */
+struct qagen_dose_stats {
+    double   max;           /* Maximum dose */
+    double   integral;      /* Sum of dose times voxel volume, in Gy cm^3 */
+    double   voxel_volume;
+    uint64_t voxels;        /* Voxels in the grid that was written */
+    uint64_t above[3];      /* Voxels above 10, 50 and 90% of the maximum */
+    double   max_error;     /* Largest quantization error of any voxel, as
+                            measured while quantizing */
+    double   max_rel_error; /* Largest quantization error relative to the
+                            voxel's dose, above QAGEN_STATS_ERROR_FLOOR.
+                            Never below the true value */
+    double   bin_width;     /* Dose spanned by each histogram bin */
+    uint64_t hist[QAGEN_STATS_BINS];    /* Bin k counts the voxels in
+                                        [k, k + 1) * bin_width */
+};
+
+
+/** @brief Formats @p stats as compact JSON
+ *  @param buf
+ *      Output buffer
+ *  @param len
+ *      Size of @p buf
+ *  @returns The length of the string, not counting the terminator. If this is
+ *      not less than @p len, the output was truncated
+ */
+size_t qagen_stats_format(char *buf, size_t len, const struct qagen_dose_stats *stats);
+
+
+/** @brief Writes @p stats next to the RTDose file @p dcm, as JSON with the
+ *      same name and the extension .stats.json
+ *  @returns Nonzero on error. This logs a warning, and does not raise anything,
+ *      because the dose file itself is fine
+ */
+int qagen_stats_write(const struct qagen_dose_stats *stats, const wchar_t *dcm);
+
+
+EXTERN_C_END
+
+#if defined(__cplusplus) && __cplusplus
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "qagen-kernel.h"
+
+
+/** @class Accumulates the statistics of a grid of PixelT, one chunk of frames
+ *      per thread. Chunks are merged in order, so the result never depends on
+ *      the schedule
+ */
+template <class PixelT>
+class DoseTally {
+    struct alignas(64) Chunk {
+        std::uint64_t sum;
+        std::uint64_t above[3];
+        std::uint64_t hist[QAGEN_STATS_BINS];
+        PixelT        max;
+    };
+
+    std::vector<Chunk> m_chunks;
+    PixelT             m_thresh[3];
+
+    std::vector<qagen_kernel_qerr> m_err;
+
+public:
+    /** @brief Sets up @p nchunks empty accumulators */
+    explicit DoseTally(unsigned nchunks);
+
+    /** @brief Adds a @p w by @p h block of pixels with row stride @p ldd to
+     *      accumulator @p c
+     */
+    void add(const PixelT *px, std::size_t w, std::size_t h, std::size_t ldd, unsigned c) noexcept
+    {
+        Chunk &ch = m_chunks[c];
+
+        if (ldd == w) {
+            w *= h;
+            h = 1;
+        }
+        for (std::size_t r = 0; r < h; r++, px += ldd) {
+            ch.max = qagen_kernel_tally<QAGEN_STATS_BINS>(px, w, m_thresh, ch.sum, ch.above, ch.hist, ch.max);
+        }
+    }
+
+    /** @brief Resets and returns the quantization error accumulators, one
+     *      per chunk, to hand to Reformat::apply()
+     *  @details The maximum quantizes to the top of the range, so relative
+     *      errors are floored at QAGEN_STATS_ERROR_FLOOR of that many steps
+     */
+    qagen_kernel_qerr *errors() noexcept
+    {
+        const double floor = QAGEN_STATS_ERROR_FLOOR * (double)std::numeric_limits<PixelT>::max();
+
+        for (qagen_kernel_qerr &e : m_err) {
+            e = { floor, 0.0, 0.0 };
+        }
+        return m_err.data();
+    }
+
+    /** @brief The quantization error so far, in pixel steps and relative */
+    void error(double &steps, double &rel) const noexcept
+    {
+        steps = rel = 0.0;
+        for (const qagen_kernel_qerr &e : m_err) {
+            steps = (steps < e.max_abs) ? e.max_abs : steps;
+            rel = (rel < e.max_rel) ? e.max_rel : rel;
+        }
+    }
+
+    /** @brief Merges the accumulators into @p stats
+     *  @param scal
+     *      Dose of one pixel step
+     *  @param spacing
+     *      Voxel spacing, in mm
+     */
+    void finish(double scal, const double spacing[3], struct qagen_dose_stats &stats) const noexcept;
+};
+
+
+template <class PixelT>
+DoseTally<PixelT>::DoseTally(unsigned nchunks):
+    m_chunks(nchunks, Chunk{ }),
+    m_err(nchunks, qagen_kernel_qerr{ })
+{
+    static const unsigned pct[3] = { 10, 50, 90 };
+    const std::uint64_t top = std::numeric_limits<PixelT>::max();
+
+    /* The maximum quantizes to the top of the range, so the thresholds are
+    fixed before the pass. Integer division floors, and for whole pixels
+    p > floor(x) is the same test as p > x */
+    for (unsigned i = 0; i < 3; i++) {
+        m_thresh[i] = (PixelT)(top * pct[i] / 100);
+    }
+}
+
+
+template <class PixelT>
+void DoseTally<PixelT>::finish(double scal, const double spacing[3], struct qagen_dose_stats &stats) const
+    noexcept
+{
+    constexpr double range = (double)std::numeric_limits<PixelT>::max() + 1.0;
+    std::uint64_t sum = 0;
+    PixelT max = 0;
+    double steps;
+    unsigned i;
+
+    stats = { };
+    for (const Chunk &ch : m_chunks) {
+        sum += ch.sum;
+        max = (max < ch.max) ? ch.max : max;
+        for (i = 0; i < 3; i++) {
+            stats.above[i] += ch.above[i];
+        }
+        for (i = 0; i < QAGEN_STATS_BINS; i++) {
+            stats.hist[i] += ch.hist[i];
+            stats.voxels += ch.hist[i];
+        }
+    }
+    stats.voxel_volume = spacing[0] * spacing[1] * spacing[2] * 1e-3;
+    stats.max = (double)max * scal;
+    stats.integral = (double)sum * scal * stats.voxel_volume;
+    stats.bin_width = range / QAGEN_STATS_BINS * scal;
+    error(steps, stats.max_rel_error);
+    stats.max_error = steps * scal;
+}
+
+
+#endif /* __cplusplus */
+
+#endif /* QAGEN_STATS_H */